@@ -26,12 +26,29 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
+/* Upper bound on the number of queues with separate statistics */
+#define BLOCK_ACCT_MAX_QUEUES 1024
+
+static void block_acct_queue_stats_free(gpointer p)
+{
+    BlockAcctQueueStats *q = p;
+    int i;
+
+    if (q) {
+        for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+            g_free(q->latency_hdr[i]);
+        }
+        g_free(q);
+    }
+}
+
 void block_acct_init(BlockAcctStats *stats)
 {
     qemu_mutex_init(&stats->lock);
@@ -40,6 +57,7 @@ void block_acct_init(BlockAcctStats *stats)
     }
     stats->account_invalid = true;
     stats->account_failed = true;
+    stats->queues = g_ptr_array_new_with_free_func(block_acct_queue_stats_free);
 }
 
 static bool bool_from_onoffauto(OnOffAuto val, bool def)
@@ -68,9 +86,15 @@ void block_acct_setup(BlockAcctStats *stats, enum OnOffAuto account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    int i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        g_free(stats->latency_hdr[i]);
+    }
+    g_ptr_array_free(stats->queues, true);
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -102,14 +126,129 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
-void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
-                      int64_t bytes, enum BlockAcctType type)
+void block_acct_start_queue(BlockAcctStats *stats, BlockAcctCookie *cookie,
+                            int64_t bytes, enum BlockAcctType type,
+                            int queue)
 {
     assert(type < BLOCK_MAX_IOTYPE);
 
     cookie->bytes = bytes;
     cookie->start_time_ns = qemu_clock_get_ns(clock_type);
     cookie->type = type;
+    cookie->queue = queue < BLOCK_ACCT_MAX_QUEUES ? queue : -1;
+}
+
+void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
+                      int64_t bytes, enum BlockAcctType type)
+{
+    block_acct_start_queue(stats, cookie, bytes, type, -1);
+}
+
+static int block_acct_hdr_index(uint64_t value)
+{
+    int e;
+
+    if (value < (1 << BLOCK_ACCT_HDR_SUB_BITS)) {
+        return value;
+    }
+
+    e = 63 - clz64(value);
+    return ((e - BLOCK_ACCT_HDR_SUB_BITS + 1) << BLOCK_ACCT_HDR_SUB_BITS) +
+           ((value >> (e - BLOCK_ACCT_HDR_SUB_BITS)) &
+            ((1 << BLOCK_ACCT_HDR_SUB_BITS) - 1));
+}
+
+/* Highest value that falls into bucket @index */
+static uint64_t block_acct_hdr_value(int index)
+{
+    int sub = index & ((1 << BLOCK_ACCT_HDR_SUB_BITS) - 1);
+    int shift;
+
+    if (index < (1 << BLOCK_ACCT_HDR_SUB_BITS)) {
+        return index;
+    }
+
+    shift = (index >> BLOCK_ACCT_HDR_SUB_BITS) - 1;
+    return (((uint64_t)(1 << BLOCK_ACCT_HDR_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static void block_acct_hdr_account(BlockAcctHdrHistogram **phdr,
+                                   int64_t latency_ns)
+{
+    BlockAcctHdrHistogram *hdr = *phdr;
+
+    latency_ns = MAX(latency_ns, 0);
+
+    if (!hdr) {
+        hdr = *phdr = g_new0(BlockAcctHdrHistogram, 1);
+    }
+
+    hdr->buckets[block_acct_hdr_index(latency_ns)]++;
+    hdr->count++;
+    hdr->max = MAX(hdr->max, latency_ns);
+}
+
+/* Smallest value that is greater than or equal to @permille of all values */
+static uint64_t block_acct_hdr_percentile(BlockAcctHdrHistogram *hdr,
+                                          unsigned permille)
+{
+    uint64_t target = DIV_ROUND_UP(hdr->count * permille, 1000);
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < BLOCK_ACCT_HDR_BUCKETS; i++) {
+        sum += hdr->buckets[i];
+        if (sum >= target) {
+            return MIN(block_acct_hdr_value(i), hdr->max);
+        }
+    }
+
+    return hdr->max;
+}
+
+unsigned block_acct_nb_queues(BlockAcctStats *stats)
+{
+    QEMU_LOCK_GUARD(&stats->lock);
+    return stats->queues->len;
+}
+
+/*
+ * Fill @pct with the latency percentiles of @type requests on @queue, or on
+ * all queues if @queue is -1. Returns false if there were no such requests.
+ */
+bool block_acct_latency_percentiles(BlockAcctStats *stats, int queue,
+                                    enum BlockAcctType type,
+                                    BlockAcctPercentiles *pct)
+{
+    BlockAcctHdrHistogram *hdr;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    QEMU_LOCK_GUARD(&stats->lock);
+
+    if (queue < 0) {
+        hdr = stats->latency_hdr[type];
+    } else {
+        BlockAcctQueueStats *q = NULL;
+
+        if (queue < stats->queues->len) {
+            q = g_ptr_array_index(stats->queues, queue);
+        }
+        hdr = q ? q->latency_hdr[type] : NULL;
+    }
+
+    if (!hdr || !hdr->count) {
+        return false;
+    }
+
+    *pct = (BlockAcctPercentiles) {
+        .count  = hdr->count,
+        .p50    = block_acct_hdr_percentile(hdr, 500),
+        .p99    = block_acct_hdr_percentile(hdr, 990),
+        .p999   = block_acct_hdr_percentile(hdr, 999),
+        .max    = hdr->max,
+    };
+    return true;
 }
 
 /* block_latency_histogram_compare_func:
@@ -232,6 +371,23 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
             stats->total_time_ns[cookie->type] += latency_ns;
             stats->last_access_time_ns = time_ns;
 
+            block_acct_hdr_account(&stats->latency_hdr[cookie->type],
+                                   latency_ns);
+            if (cookie->queue >= 0) {
+                BlockAcctQueueStats *q;
+
+                if (cookie->queue >= stats->queues->len) {
+                    g_ptr_array_set_size(stats->queues, cookie->queue + 1);
+                }
+                q = g_ptr_array_index(stats->queues, cookie->queue);
+                if (!q) {
+                    q = g_new0(BlockAcctQueueStats, 1);
+                    g_ptr_array_index(stats->queues, cookie->queue) = q;
+                }
+                block_acct_hdr_account(&q->latency_hdr[cookie->type],
+                                       latency_ns);
+            }
+
             QSLIST_FOREACH(s, &stats->intervals, entries) {
                 timed_average_account(&s->latency[cookie->type], latency_ns);
             }
@@ -336,6 +336,21 @@ static bool backup_cancel(Job *job, bool force)
     return true;
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+    BlockCopyStats stats;
+
+    block_copy_get_stats(s->bcs, &stats);
+
+    info->u.backup = (BlockJobInfoBackup) {
+        .chunk_size = MIN_NON_ZERO(stats.chunk_size, s->perf.max_chunk),
+        .max_workers = MIN(stats.max_workers, s->perf.max_workers),
+        .latency_ns = stats.latency_ns,
+        .throughput = stats.throughput,
+    };
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -350,6 +365,7 @@ static const BlockJobDriver backup_job_driver = {
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
+    .query = backup_query,
 };
 
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
@@ -492,6 +508,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->perf = *perf;
 
     block_copy_set_copy_opts(bcs, perf->use_copy_range, compress);
+    block_copy_set_auto_tune(bcs, perf->auto_tune);
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
     block_copy_set_speed(bcs, speed);
 
@@ -25,6 +25,7 @@
 #include "qemu/id.h"
 #include "qemu/main-loop.h"
 #include "qemu/option.h"
+#include "qemu/units.h"
 #include "trace.h"
 #include "migration/misc.h"
 
@@ -40,6 +41,29 @@ typedef struct BlockBackendAioNotifier {
     QLIST_ENTRY(BlockBackendAioNotifier) list;
 } BlockBackendAioNotifier;
 
+/* Limits for merging adjacent requests, see blk_co_coalesce() */
+#define BLK_COALESCE_MAX_REQS   32
+#define BLK_COALESCE_MAX_BYTES  (1 * MiB)
+
+typedef struct BlkCoalesceReq {
+    Coroutine *co;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    int64_t bytes;
+    int ret;
+    QSIMPLEQ_ENTRY(BlkCoalesceReq) next;
+} BlkCoalesceReq;
+
+typedef struct BlkCoalesceBatch {
+    AioContext *ctx;
+    BdrvRequestFlags flags;
+    int64_t offset;
+    int64_t bytes;
+    int nb_reqs;
+    int niov;
+    QSIMPLEQ_HEAD(, BlkCoalesceReq) reqs;
+} BlkCoalesceBatch;
+
 struct BlockBackend {
     char *name;
     int refcnt;
@@ -83,6 +107,10 @@ struct BlockBackend {
     CoQueue queued_requests;
     bool disable_request_queuing; /* atomic */
 
+    bool coalesce_requests; /* atomic */
+    QemuMutex coalesce_lock; /* protects coalesce_batch */
+    BlkCoalesceBatch *coalesce_batch[2]; /* open batch for reads and writes */
+
     VMChangeStateEntry *vmsh;
     bool force_allow_inactivate;
 
@@ -372,6 +400,7 @@ BlockBackend *blk_new(AioContext *ctx, uint64_t perm, uint64_t shared_perm)
 
     qemu_mutex_init(&blk->queued_requests_lock);
     qemu_co_queue_init(&blk->queued_requests);
+    qemu_mutex_init(&blk->coalesce_lock);
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
     QLIST_INIT(&blk->aio_notifiers);
@@ -495,6 +524,7 @@ static void blk_delete(BlockBackend *blk)
     assert(QLIST_EMPTY(&blk->aio_notifiers));
     assert(qemu_co_queue_empty(&blk->queued_requests));
     qemu_mutex_destroy(&blk->queued_requests_lock);
+    qemu_mutex_destroy(&blk->coalesce_lock);
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
@@ -1260,6 +1290,143 @@ void blk_set_disable_request_queuing(BlockBackend *blk, bool disable)
     qatomic_set(&blk->disable_request_queuing, disable);
 }
 
+/*
+ * Merge adjacent sequential read or write requests into one request to the
+ * root node. This is opt-in because it adds latency and makes merged
+ * requests fail together.
+ */
+void blk_set_coalesce_requests(BlockBackend *blk, bool coalesce)
+{
+    IO_CODE();
+    qatomic_set(&blk->coalesce_requests, coalesce);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+blk_co_do_rw(BlockBackend *blk, bool is_write, int64_t offset, int64_t bytes,
+             QEMUIOVector *qiov, size_t qiov_offset, BdrvRequestFlags flags)
+{
+    if (is_write) {
+        return bdrv_co_pwritev_part(blk->root, offset, bytes, qiov,
+                                    qiov_offset, flags);
+    } else {
+        return bdrv_co_preadv_part(blk->root, offset, bytes, qiov,
+                                   qiov_offset, flags);
+    }
+}
+
+/*
+ * Submit a request, merging it with other requests that continue it.
+ *
+ * If other requests are in flight, the first request of a batch waits until
+ * the AioContext has processed its pending events, which gives the device
+ * model the chance to submit the rest of a virtqueue or submission queue.
+ * Requests that start where the batch ends are appended to it, and the whole
+ * batch is submitted as a single request by the first one. At queue depth 1,
+ * requests are submitted immediately.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+blk_co_coalesce(BlockBackend *blk, bool is_write, int64_t offset,
+                int64_t bytes, QEMUIOVector *qiov, size_t qiov_offset,
+                BdrvRequestFlags flags)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    BlkCoalesceBatch new_batch, *batch;
+    BlkCoalesceReq req = {
+        .co             = qemu_coroutine_self(),
+        .qiov           = qiov,
+        .qiov_offset    = qiov_offset,
+        .bytes          = bytes,
+    };
+    int64_t max_bytes;
+    int max_iov;
+    int ret;
+
+    max_bytes = MIN_NON_ZERO(blk_get_max_transfer(blk),
+                             BLK_COALESCE_MAX_BYTES);
+    max_iov = blk_get_max_iov(blk);
+
+    qemu_mutex_lock(&blk->coalesce_lock);
+    batch = blk->coalesce_batch[is_write];
+    if (batch) {
+        /* Only merge with requests from the same thread */
+        if (batch->ctx == ctx && batch->flags == flags &&
+            batch->offset + batch->bytes == offset &&
+            batch->bytes + bytes <= max_bytes &&
+            batch->niov + qiov->niov <= max_iov)
+        {
+            QSIMPLEQ_INSERT_TAIL(&batch->reqs, &req, next);
+            batch->bytes += bytes;
+            batch->niov += qiov->niov;
+            if (++batch->nb_reqs == BLK_COALESCE_MAX_REQS) {
+                blk->coalesce_batch[is_write] = NULL;
+            }
+            qemu_mutex_unlock(&blk->coalesce_lock);
+
+            /* The first request of the batch completes us */
+            qemu_coroutine_yield();
+            return req.ret;
+        }
+        qemu_mutex_unlock(&blk->coalesce_lock);
+        return blk_co_do_rw(blk, is_write, offset, bytes, qiov, qiov_offset,
+                            flags);
+    }
+
+    if (qatomic_read(&blk->in_flight) <= 1 || bytes >= max_bytes) {
+        qemu_mutex_unlock(&blk->coalesce_lock);
+        return blk_co_do_rw(blk, is_write, offset, bytes, qiov, qiov_offset,
+                            flags);
+    }
+
+    batch = &new_batch;
+    *batch = (BlkCoalesceBatch) {
+        .ctx        = ctx,
+        .flags      = flags,
+        .offset     = offset,
+        .bytes      = bytes,
+        .nb_reqs    = 1,
+        .niov       = qiov->niov,
+    };
+    QSIMPLEQ_INIT(&batch->reqs);
+    QSIMPLEQ_INSERT_TAIL(&batch->reqs, &req, next);
+    blk->coalesce_batch[is_write] = batch;
+    qemu_mutex_unlock(&blk->coalesce_lock);
+
+    /* Let the other requests that are already queued in ctx run first */
+    aio_co_schedule(ctx, qemu_coroutine_self());
+    qemu_coroutine_yield();
+
+    qemu_mutex_lock(&blk->coalesce_lock);
+    if (blk->coalesce_batch[is_write] == batch) {
+        blk->coalesce_batch[is_write] = NULL;
+    }
+    qemu_mutex_unlock(&blk->coalesce_lock);
+
+    if (batch->nb_reqs == 1) {
+        return blk_co_do_rw(blk, is_write, offset, bytes, qiov, qiov_offset,
+                            flags);
+    } else {
+        QEMUIOVector merged;
+        BlkCoalesceReq *r;
+
+        qemu_iovec_init(&merged, batch->niov);
+        QSIMPLEQ_FOREACH(r, &batch->reqs, next) {
+            qemu_iovec_concat(&merged, r->qiov, r->qiov_offset, r->bytes);
+        }
+        ret = blk_co_do_rw(blk, is_write, batch->offset, batch->bytes,
+                           &merged, 0, flags);
+        qemu_iovec_destroy(&merged);
+
+        QSIMPLEQ_FOREACH(r, &batch->reqs, next) {
+            if (r != &req) {
+                r->ret = ret;
+                aio_co_wake(r->co);
+            }
+        }
+    }
+
+    return ret;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 blk_check_byte_request(BlockBackend *blk, int64_t offset, int64_t bytes)
 {
@@ -1348,8 +1515,13 @@ blk_co_do_preadv_part(BlockBackend *blk, int64_t offset, int64_t bytes,
                 bytes, THROTTLE_READ);
     }
 
-    ret = bdrv_co_preadv_part(blk->root, offset, bytes, qiov, qiov_offset,
+    if (qatomic_read(&blk->coalesce_requests) && !flags) {
+        ret = blk_co_coalesce(blk, false, offset, bytes, qiov, qiov_offset,
                               flags);
+    } else {
+        ret = bdrv_co_preadv_part(blk->root, offset, bytes, qiov, qiov_offset,
+                                  flags);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1426,8 +1598,15 @@ blk_co_do_pwritev_part(BlockBackend *blk, int64_t offset, int64_t bytes,
         flags |= BDRV_REQ_FUA;
     }
 
-    ret = bdrv_co_pwritev_part(blk->root, offset, bytes, qiov, qiov_offset,
-                               flags);
+    if (qatomic_read(&blk->coalesce_requests) &&
+        !(flags & ~BDRV_REQ_FUA))
+    {
+        ret = blk_co_coalesce(blk, true, offset, bytes, qiov, qiov_offset,
+                              flags);
+    } else {
+        ret = bdrv_co_pwritev_part(blk->root, offset, bytes, qiov,
+                                   qiov_offset, flags);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1696,12 +1875,97 @@ void coroutine_mixed_fn blk_get_geometry(BlockBackend *blk,
     *nb_sectors_ptr = ret < 0 ? 0 : ret;
 }
 
+static void blk_aio_prwv_fast_cb(void *opaque, int ret)
+{
+    BlkAioEmAIOCB *acb = opaque;
+
+    bdrv_graph_rdunlock_nowait();
+    acb->rwco.ret = ret;
+    blk_aio_complete(acb);
+}
+
+/*
+ * Plain reads and writes that need nothing from the BlockBackend that has to
+ * run in coroutine context (queuing while drained, throttling, coalescing, FUA
+ * emulation for a disabled write cache) are passed to bdrv_aio_prwv_fast(),
+ * which avoids creating and switching to a coroutine if the nodes below
+ * support it.
+ *
+ * Returns NULL if the request must go through blk_aio_prwv() instead.
+ */
+static BlockAIOCB *blk_aio_prwv_fast(BlockBackend *blk, int64_t offset,
+                                     QEMUIOVector *qiov,
+                                     BdrvRequestFlags flags, bool is_write,
+                                     BlockCompletionFunc *cb, void *opaque)
+{
+    BlkAioEmAIOCB *acb;
+
+    if (flags || offset < 0 ||
+        blk->public.throttle_group_member.throttle_state ||
+        qatomic_read(&blk->coalesce_requests) ||
+        (is_write && !blk->enable_write_cache) ||
+        blk_dev_is_tray_open(blk)) {
+        return NULL;
+    }
+
+    /* Checking quiesce_counter after this makes the check race-free */
+    blk_inc_in_flight(blk);
+    if (qatomic_read(&blk->quiesce_counter)) {
+        blk_dec_in_flight(blk);
+        return NULL;
+    }
+
+    /*
+     * Like a request in a coroutine, the request is a graph reader until it
+     * completes. If a writer is waiting, the coroutine path waits for it.
+     */
+    if (!bdrv_graph_rdlock_nowait()) {
+        blk_dec_in_flight(blk);
+        return NULL;
+    }
+    assume_graph_lock();
+
+    if (!blk->root) {
+        goto fail;
+    }
+
+    acb = blk_aio_get(&blk_aio_em_aiocb_info, blk, cb, opaque);
+    acb->rwco = (BlkRwCo) {
+        .blk    = blk,
+        .offset = offset,
+        .iobuf  = qiov,
+        .flags  = flags,
+        .ret    = NOT_DONE,
+    };
+    acb->bytes = qiov->size;
+    acb->has_returned = true; /* the callback never runs before we return */
+
+    if (!bdrv_aio_prwv_fast(blk->root, offset, qiov->size, qiov, flags,
+                            is_write, blk_aio_prwv_fast_cb, acb)) {
+        qemu_aio_unref(acb);
+        goto fail;
+    }
+
+    return &acb->common;
+
+fail:
+    bdrv_graph_rdunlock_nowait();
+    blk_dec_in_flight(blk);
+    return NULL;
+}
+
 BlockAIOCB *blk_aio_preadv(BlockBackend *blk, int64_t offset,
                            QEMUIOVector *qiov, BdrvRequestFlags flags,
                            BlockCompletionFunc *cb, void *opaque)
 {
+    BlockAIOCB *acb;
     IO_CODE();
     assert((uint64_t)qiov->size <= INT64_MAX);
+
+    acb = blk_aio_prwv_fast(blk, offset, qiov, flags, false, cb, opaque);
+    if (acb) {
+        return acb;
+    }
     return blk_aio_prwv(blk, offset, qiov->size, qiov,
                         blk_aio_read_entry, flags, cb, opaque);
 }
@@ -1710,8 +1974,14 @@ BlockAIOCB *blk_aio_pwritev(BlockBackend *blk, int64_t offset,
                             QEMUIOVector *qiov, BdrvRequestFlags flags,
                             BlockCompletionFunc *cb, void *opaque)
 {
+    BlockAIOCB *acb;
     IO_CODE();
     assert((uint64_t)qiov->size <= INT64_MAX);
+
+    acb = blk_aio_prwv_fast(blk, offset, qiov, flags, true, cb, opaque);
+    if (acb) {
+        return acb;
+    }
     return blk_aio_prwv(blk, offset, qiov->size, qiov,
                         blk_aio_write_entry, flags, cb, opaque);
 }
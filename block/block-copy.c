@@ -25,6 +25,8 @@
 #include "qemu/co-shared-resource.h"
 #include "qemu/coroutine.h"
 #include "qemu/ratelimit.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
@@ -35,11 +37,26 @@
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BLOCK_COPY_MAX_WRITE_ZEROES (1 * GiB)
+
+/*
+ * Auto-tuning of background copying, see block_copy_tune(). Decisions are
+ * taken once per window; a smoothed request latency above
+ * BLOCK_COPY_TUNE_LATENCY_FACTOR times the base (minimum) latency is taken as
+ * a sign of congestion on the target. The base latency expires after
+ * BLOCK_COPY_TUNE_BASE_TIME so that a permanently slower target does not
+ * look congested forever.
+ */
+#define BLOCK_COPY_TUNE_WINDOW (100 * SCALE_MS)
+#define BLOCK_COPY_TUNE_BASE_TIME (10 * NANOSECONDS_PER_SECOND)
+#define BLOCK_COPY_TUNE_LATENCY_FACTOR 2
+#define BLOCK_COPY_TUNE_INIT_WORKERS 4
 
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
     COPY_READ_WRITE,
     COPY_WRITE_ZEROES,
+    COPY_WRITE_ZEROES_UNMAP,
     COPY_RANGE_SMALL,
     COPY_RANGE_FULL
 } BlockCopyMethod;
@@ -54,6 +71,7 @@ typedef struct BlockCopyCallState {
     int max_workers;
     int64_t max_chunk;
     bool ignore_ratelimit;
+    bool auto_tune;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
     /* Coroutine where async block-copy is running */
@@ -105,6 +123,9 @@ typedef struct BlockCopyTask {
      * parallel read while updating @bytes value in block_copy_task_shrink().
      */
     BlockReq req;
+
+    /* Set in block_copy_task_entry(), used for auto-tuning */
+    int64_t start_ns;
 } BlockCopyTask;
 
 static int64_t task_end(BlockCopyTask *task)
@@ -159,6 +180,27 @@ typedef struct BlockCopyState {
     ProgressMeter *progress;
     SharedResource *mem;
     RateLimit rate_limit;
+
+    /*
+     * Auto-tuning state, protected by lock. @tune_chunk of zero means that
+     * the chunk size is not limited by auto-tuning; @tune_workers is also
+     * read without the lock by block_copy_dirty_clusters().
+     */
+    bool auto_tune;
+    int64_t tune_chunk;
+    int tune_workers;
+    int tune_ssthresh;
+    int64_t tune_window_start;
+    uint64_t tune_window_bytes;
+    uint64_t tune_window_min_latency;
+    bool tune_window_failed;
+    uint64_t tune_base_latency;
+    int64_t tune_base_time;
+
+    /* Published for block_copy_get_stats() */
+    Stat64 stat_latency;
+    Stat64 stat_throughput;
+    Stat64 stat_chunk;
 } BlockCopyState;
 
 /* Called with lock held */
@@ -180,19 +222,34 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
     }
 }
 
+/* Called with lock held */
+static int64_t block_copy_max_chunk(BlockCopyState *s,
+                                    BlockCopyCallState *call_state)
+{
+    int64_t max_chunk;
+
+    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    if (call_state->auto_tune) {
+        max_chunk = MIN_NON_ZERO(max_chunk, s->tune_chunk);
+    }
+
+    return max_chunk;
+}
+
 /*
  * Search for the first dirty area in offset/bytes range and create task at
- * the beginning of it.
+ * the beginning of it. The task is at most @max_bytes long, or the maximum
+ * chunk size for data if @max_bytes is 0.
  */
 static coroutine_fn BlockCopyTask *
 block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
-                       int64_t offset, int64_t bytes)
+                       int64_t offset, int64_t bytes, int64_t max_bytes)
 {
     BlockCopyTask *task;
     int64_t max_chunk;
 
     QEMU_LOCK_GUARD(&s->lock);
-    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    max_chunk = max_bytes ?: block_copy_max_chunk(s, call_state);
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
                                            max_chunk, &offset, &bytes))
@@ -306,6 +363,8 @@ void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
          */
         s->method = use_copy_range ? COPY_RANGE_SMALL : COPY_READ_WRITE;
     }
+
+    stat64_set(&s->stat_chunk, block_copy_chunk_size(s));
 }
 
 static int64_t block_copy_calculate_cluster_size(BlockDriverState *target,
@@ -415,6 +474,8 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
         .max_transfer = QEMU_ALIGN_DOWN(
                                     block_copy_max_transfer(source, target),
                                     cluster_size),
+        .tune_workers = BLOCK_COPY_MAX_WORKERS,
+        .tune_ssthresh = BLOCK_COPY_MAX_WORKERS,
     };
 
     block_copy_set_copy_opts(s, false, false);
@@ -427,12 +488,28 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
     return s;
 }
 
+/* Only set before running the job, no need for locking. */
+void block_copy_set_auto_tune(BlockCopyState *s, bool auto_tune)
+{
+    s->auto_tune = auto_tune;
+    s->tune_chunk = 0;
+    s->tune_workers = auto_tune ? BLOCK_COPY_TUNE_INIT_WORKERS :
+                                  BLOCK_COPY_MAX_WORKERS;
+    s->tune_ssthresh = BLOCK_COPY_MAX_WORKERS;
+}
+
 /* Only set before running the job, no need for locking. */
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm)
 {
     s->progress = pm;
 }
 
+static bool block_copy_task_is_zero(BlockCopyTask *t)
+{
+    return t->method == COPY_WRITE_ZEROES ||
+           t->method == COPY_WRITE_ZEROES_UNMAP;
+}
+
 /*
  * Takes ownership of @task
  *
@@ -454,7 +531,9 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
 
     aio_task_pool_wait_slot(pool);
     if (aio_task_pool_status(pool) < 0) {
-        co_put_to_shres(task->s->mem, task->req.bytes);
+        if (!block_copy_task_is_zero(task)) {
+            co_put_to_shres(task->s->mem, task->req.bytes);
+        }
         block_copy_task_end(task, -ECANCELED);
         g_free(task);
         return -ECANCELED;
@@ -496,8 +575,12 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
 
     switch (*method) {
     case COPY_WRITE_ZEROES:
-        ret = bdrv_co_pwrite_zeroes(s->target, offset, nbytes, s->write_flags &
-                                    ~BDRV_REQ_WRITE_COMPRESSED);
+    case COPY_WRITE_ZEROES_UNMAP:
+        ret = bdrv_co_pwrite_zeroes(s->target, offset, nbytes,
+                                    (s->write_flags &
+                                     ~BDRV_REQ_WRITE_COMPRESSED) |
+                                    (*method == COPY_WRITE_ZEROES_UNMAP ?
+                                     BDRV_REQ_MAY_UNMAP : 0));
         if (ret < 0) {
             trace_block_copy_write_zeroes_fail(s, offset, ret);
             *error_is_read = false;
@@ -558,6 +641,91 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
     return ret;
 }
 
+/*
+ * Account a finished copy request and, once per BLOCK_COPY_TUNE_WINDOW,
+ * adapt chunk size and number of parallel requests of auto-tuned calls,
+ * similar to TCP congestion control: on congestion (a failed request or
+ * request latency growing well beyond the base latency) the number of
+ * requests is halved, and once only one is left, the chunk size. Otherwise
+ * the chunk size is first restored, and then the number of requests grows,
+ * exponentially up to the last congestion point and linearly afterwards.
+ *
+ * Called with lock held.
+ */
+static void block_copy_tune(BlockCopyState *s, int64_t bytes,
+                            uint64_t latency, bool failed)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t avg = stat64_get(&s->stat_latency);
+    int64_t chunk = block_copy_chunk_size(s);
+    int64_t elapsed;
+    bool congested;
+
+    /* Smoothed like TCP's SRTT */
+    avg = avg ? avg - avg / 8 + latency / 8 : latency;
+    stat64_set(&s->stat_latency, avg);
+
+    if (!s->tune_window_start) {
+        s->tune_window_start = now;
+    }
+    s->tune_window_bytes += bytes;
+    s->tune_window_failed |= failed;
+    if (!s->tune_window_min_latency || latency < s->tune_window_min_latency) {
+        s->tune_window_min_latency = latency;
+    }
+
+    elapsed = now - s->tune_window_start;
+    if (elapsed < BLOCK_COPY_TUNE_WINDOW) {
+        return;
+    }
+
+    stat64_set(&s->stat_throughput,
+               s->tune_window_bytes * NANOSECONDS_PER_SECOND / elapsed);
+
+    if (!s->tune_base_latency ||
+        s->tune_window_min_latency < s->tune_base_latency ||
+        now - s->tune_base_time > BLOCK_COPY_TUNE_BASE_TIME)
+    {
+        s->tune_base_latency = s->tune_window_min_latency;
+        s->tune_base_time = now;
+    }
+
+    if (s->auto_tune) {
+        congested = s->tune_window_failed ||
+            avg > s->tune_base_latency * BLOCK_COPY_TUNE_LATENCY_FACTOR;
+
+        if (congested && s->tune_workers > 1) {
+            s->tune_ssthresh = MAX(s->tune_workers / 2, 1);
+            qatomic_set(&s->tune_workers, s->tune_ssthresh);
+        } else if (congested) {
+            chunk = MIN_NON_ZERO(s->tune_chunk, chunk);
+            s->tune_chunk = MAX(QEMU_ALIGN_DOWN(chunk / 2, s->cluster_size),
+                                s->cluster_size);
+            /* Requests of different size, the base latency is stale */
+            s->tune_base_latency = 0;
+        } else if (s->tune_chunk) {
+            s->tune_chunk *= 2;
+            if (s->tune_chunk >= chunk) {
+                s->tune_chunk = 0;
+            }
+            s->tune_base_latency = 0;
+        } else if (s->tune_workers < s->tune_ssthresh) {
+            qatomic_set(&s->tune_workers,
+                        MIN(s->tune_workers * 2, s->tune_ssthresh));
+        } else if (s->tune_workers < BLOCK_COPY_MAX_WORKERS) {
+            qatomic_set(&s->tune_workers, s->tune_workers + 1);
+        }
+    }
+
+    stat64_set(&s->stat_chunk, MIN_NON_ZERO(s->tune_chunk,
+                                            block_copy_chunk_size(s)));
+
+    s->tune_window_start = now;
+    s->tune_window_bytes = 0;
+    s->tune_window_min_latency = 0;
+    s->tune_window_failed = false;
+}
+
 static coroutine_fn int block_copy_task_entry(AioTask *task)
 {
     BlockCopyTask *t = container_of(task, BlockCopyTask, task);
@@ -566,6 +734,8 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyMethod method = t->method;
     int ret;
 
+    t->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     WITH_GRAPH_RDLOCK_GUARD() {
         ret = block_copy_do_copy(s, t->req.offset, t->req.bytes, &method,
                                  &error_is_read);
@@ -584,8 +754,17 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
         } else if (s->progress) {
             progress_work_done(s->progress, t->req.bytes);
         }
+
+        /* Zero writes tell nothing about the speed of the target */
+        if (!block_copy_task_is_zero(t)) {
+            block_copy_tune(s, t->req.bytes,
+                            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                            t->start_ns, ret < 0);
+        }
+    }
+    if (!block_copy_task_is_zero(t)) {
+        co_put_to_shres(s->mem, t->req.bytes);
     }
-    co_put_to_shres(s->mem, t->req.bytes);
     block_copy_task_end(t, ret);
 
     return ret;
@@ -726,6 +905,8 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     bool found_dirty = false;
     int64_t end = offset + bytes;
     AioTaskPool *aio = NULL;
+    int64_t status_offset = 0, status_bytes = 0;
+    int status = 0;
 
     /*
      * block_copy() user is responsible for keeping source and target in same
@@ -740,9 +921,33 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     while (bytes && aio_task_pool_status(aio) == 0 &&
            !qatomic_read(&call_state->cancelled)) {
         BlockCopyTask *task;
-        int64_t status_bytes;
+        int64_t dirty, max_bytes = 0;
+        bool zero;
+
+        /*
+         * Query block status for the whole remaining range at the first
+         * dirty cluster instead of once per task, so that large zero or
+         * unallocated extents become a single task no matter how the
+         * dirty bitmap is fragmented.
+         */
+        dirty = bdrv_dirty_bitmap_next_dirty(s->copy_bitmap, offset, bytes);
+        if (dirty < 0) {
+            trace_block_copy_skip_range(s, offset, bytes);
+            break;
+        }
+        if (dirty < status_offset || dirty >= status_offset + status_bytes) {
+            status_offset = dirty;
+            status = block_copy_block_status(s, dirty, end - dirty,
+                                             &status_bytes);
+            assert(status >= 0); /* never fail */
+        }
+        if (!(status & BDRV_BLOCK_DATA) || (status & BDRV_BLOCK_ZERO)) {
+            max_bytes = MIN(status_offset + status_bytes - dirty,
+                            BLOCK_COPY_MAX_WRITE_ZEROES);
+            max_bytes = MIN_NON_ZERO(max_bytes, call_state->max_chunk);
+        }
 
-        task = block_copy_task_create(s, call_state, offset, bytes);
+        task = block_copy_task_create(s, call_state, offset, bytes, max_bytes);
         if (!task) {
             /* No more dirty bits in the bitmap */
             trace_block_copy_skip_range(s, offset, bytes);
@@ -754,14 +959,22 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         found_dirty = true;
 
-        ret = block_copy_block_status(s, task->req.offset, task->req.bytes,
-                                      &status_bytes);
-        assert(ret >= 0); /* never fail */
-        if (status_bytes < task->req.bytes) {
-            block_copy_task_shrink(task, status_bytes);
+        /* The bitmap may have changed while we were querying block status */
+        if (task->req.offset < status_offset ||
+            task->req.offset >= status_offset + status_bytes) {
+            status_offset = task->req.offset;
+            status = block_copy_block_status(s, task->req.offset,
+                                             end - task->req.offset,
+                                             &status_bytes);
+            assert(status >= 0); /* never fail */
+        }
+        if (status_offset + status_bytes < task_end(task)) {
+            block_copy_task_shrink(task,
+                                   status_offset + status_bytes -
+                                   task->req.offset);
         }
         if (qatomic_read(&s->skip_unallocated) &&
-            !(ret & BDRV_BLOCK_ALLOCATED)) {
+            !(status & BDRV_BLOCK_ALLOCATED)) {
             block_copy_task_end(task, 0);
             trace_block_copy_skip_range(s, task->req.offset, task->req.bytes);
             offset = task_end(task);
@@ -769,11 +982,33 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
             g_free(task);
             continue;
         }
-        if (ret & BDRV_BLOCK_ZERO) {
-            task->method = COPY_WRITE_ZEROES;
+
+        zero = status & BDRV_BLOCK_ZERO;
+        if (zero) {
+            /*
+             * Let the target deallocate ranges that are unallocated in the
+             * whole source chain; allocated zeroes are kept allocated.
+             */
+            task->method = (status & BDRV_BLOCK_ALLOCATED) ?
+                COPY_WRITE_ZEROES : COPY_WRITE_ZEROES_UNMAP;
+        } else if (max_bytes) {
+            /* Extent turned into data after all, copy it in normal chunks */
+            int64_t max_chunk = 0;
+
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                max_chunk = block_copy_max_chunk(s, call_state);
+            }
+            if (max_chunk && task->req.bytes > max_chunk) {
+                block_copy_task_shrink(task, QEMU_ALIGN_UP(max_chunk,
+                                                           s->cluster_size));
+            }
         }
 
-        if (!call_state->ignore_ratelimit) {
+        /*
+         * Zero writes transfer no data, so they neither count against the
+         * memory limit nor the rate limit.
+         */
+        if (!zero && !call_state->ignore_ratelimit) {
             uint64_t ns = ratelimit_calculate_delay(&s->rate_limit, 0);
             if (ns > 0) {
                 block_copy_task_end(task, -EAGAIN);
@@ -784,11 +1019,15 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
             }
         }
 
-        ratelimit_calculate_delay(&s->rate_limit, task->req.bytes);
+        if (!zero) {
+            ratelimit_calculate_delay(&s->rate_limit, task->req.bytes);
+        }
 
         trace_block_copy_process(s, task->req.offset);
 
-        co_get_from_shres(s->mem, task->req.bytes);
+        if (!zero) {
+            co_get_from_shres(s->mem, task->req.bytes);
+        }
 
         offset = task_end(task);
         bytes = end - offset;
@@ -796,6 +1035,13 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         if (!aio && bytes) {
             aio = aio_task_pool_new(call_state->max_workers);
         }
+        if (aio && call_state->auto_tune) {
+            int workers = qatomic_read(&s->tune_workers);
+
+            aio_task_pool_set_max_busy_tasks(aio,
+                                             MIN(call_state->max_workers,
+                                                 workers));
+        }
 
         ret = block_copy_task_run(aio, task);
         if (ret < 0) {
@@ -955,6 +1201,7 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .bytes = bytes,
         .max_workers = max_workers,
         .max_chunk = max_chunk,
+        .auto_tune = s->auto_tune,
         .cb = cb,
         .cb_opaque = cb_opaque,
 
@@ -1029,6 +1276,16 @@ int64_t block_copy_cluster_size(BlockCopyState *s)
     return s->cluster_size;
 }
 
+void block_copy_get_stats(BlockCopyState *s, BlockCopyStats *stats)
+{
+    *stats = (BlockCopyStats) {
+        .chunk_size = stat64_get(&s->stat_chunk),
+        .max_workers = qatomic_read(&s->tune_workers),
+        .latency_ns = stat64_get(&s->stat_latency),
+        .throughput = stat64_get(&s->stat_throughput),
+    };
+}
+
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
 {
     qatomic_set(&s->skip_unallocated, skip);
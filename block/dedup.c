@@ -0,0 +1,1096 @@
+/*
+ * Block driver for deduplicating, content-addressed images
+ *
+ * Copyright (c) 2024 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Image layout (all fields little endian):
+ *
+ *   Header (at offset 0, padded to a cluster)
+ *   Map    (at header.map_offset, one DedupMapEntry per guest cluster)
+ *   Chunks (from header.data_offset, one cluster each, 1-based index)
+ *
+ * Every guest cluster is stored as a chunk that is identified by the SHA-256
+ * hash of its content. Guest clusters with identical content share a single
+ * chunk, so images that contain many copies of the same data (like images
+ * with lots of duplicated files) take up less space on the host and less of
+ * its page cache. All-zero clusters are not stored at all.
+ *
+ * Deduplication is per image: the chunks and the hash index belong to one
+ * image file, and separate images never share chunks with each other.
+ *
+ * The map is the only metadata that is kept on disk. Chunk reference counts
+ * and the hash index are rebuilt from it when the image is opened, and chunks
+ * that are not referenced by the map are free, so there is nothing to leak
+ * or get out of sync after a crash. Chunks are never overwritten while the
+ * map on disk may still refer to them: chunks that lose their last reference
+ * are only reused after the updated map has been flushed.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "qapi/qobject-input-visitor.h"
+#include "qapi/qapi-visit-block-core.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "sysemu/block-backend.h"
+#include "crypto/hash.h"
+#include "migration/blocker.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+
+#define DEDUP_MAGIC ('Q' | ('D' << 8) | ('D' << 16) | ('P' << 24))
+#define DEDUP_VERSION 1
+
+#define DEDUP_HASH_SIZE 32 /* SHA-256 */
+
+#define DEDUP_MIN_CLUSTER_SIZE (4 * KiB)
+#define DEDUP_MAX_CLUSTER_SIZE (2 * MiB)
+#define DEDUP_DEFAULT_CLUSTER_SIZE 65536
+/* Note: can't use 64 * KiB, because it's passed to stringify() */
+
+typedef struct DedupHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t reserved;
+    uint64_t disk_size;
+    uint64_t map_offset;
+    uint64_t data_offset;
+} QEMU_PACKED DedupHeader;
+
+typedef struct DedupMapEntry {
+    /* Chunk index, 0 if the cluster reads as zeroes */
+    uint64_t chunk;
+    /* Hash of the chunk content, only valid if @chunk is non-zero */
+    uint8_t hash[DEDUP_HASH_SIZE];
+    uint8_t reserved[24];
+} QEMU_PACKED DedupMapEntry;
+
+/* Entries must not cross sector boundaries, so that updates are atomic */
+QEMU_BUILD_BUG_ON(BDRV_SECTOR_SIZE % sizeof(DedupMapEntry));
+
+/*
+ * The map is read in a single operation, so limit its size to INT_MAX
+ * like other drivers do for their tables.
+ */
+#define DEDUP_MAX_ENTRIES ((uint64_t)INT_MAX / sizeof(DedupMapEntry))
+
+typedef struct DedupChunk {
+    uint8_t hash[DEDUP_HASH_SIZE];
+    uint64_t index;
+    uint64_t refcount;
+} DedupChunk;
+
+/* A guest cluster that a request is modifying */
+typedef struct DedupBusyCluster {
+    uint64_t cluster;
+    QLIST_ENTRY(DedupBusyCluster) next;
+} DedupBusyCluster;
+
+typedef struct BDRVDedupState {
+    /* Header in host endianness */
+    DedupHeader header;
+    uint64_t nb_entries;
+
+    /*
+     * Requests that modify a guest cluster claim it first, so that a
+     * read-modify-write cycle does not race with other updates of the same
+     * cluster. The lock below is then only needed for the metadata.
+     */
+    CoMutex busy_lock;
+    QLIST_HEAD(, DedupBusyCluster) busy_clusters;
+    CoQueue busy_queue;
+
+    /* Serialises map writeback, so that older entries can't overtake newer */
+    CoMutex flush_lock;
+
+    /*
+     * Everything below is protected by lock. Metadata updates take it
+     * exclusively, readers keep it shared while reading data from chunks, so
+     * that a chunk cannot be freed and reused in between.
+     */
+    CoRwlock lock;
+
+    /* The map entries are little endian (even in memory). */
+    DedupMapEntry *map;
+    /* Map entries that have changed since the last flush */
+    unsigned long *dirty_map;
+
+    /* Referenced chunks by index - 1, NULL for free chunks */
+    GPtrArray *chunks;
+    /* Referenced chunks by hash */
+    GHashTable *index;
+    /* Unreferenced chunk indices that can be allocated again */
+    GArray *free_chunks;
+    /* Unreferenced chunk indices that may still be used by the map on disk */
+    GArray *pending_free_chunks;
+
+    Error *migration_blocker;
+} BDRVDedupState;
+
+static QemuOptsList dedup_create_opts;
+
+static guint dedup_hash_hash(gconstpointer key)
+{
+    guint h;
+
+    /* The key is a cryptographic hash already */
+    memcpy(&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, DEDUP_HASH_SIZE);
+}
+
+static int dedup_hash_buf(const uint8_t *buf, size_t len, uint8_t *hash)
+{
+    g_autofree uint8_t *result = NULL;
+    size_t result_len = 0;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, (const char *)buf, len,
+                           &result, &result_len, NULL) < 0) {
+        return -EIO;
+    }
+    assert(result_len == DEDUP_HASH_SIZE);
+    memcpy(hash, result, DEDUP_HASH_SIZE);
+
+    return 0;
+}
+
+static uint64_t dedup_chunk_offset(BDRVDedupState *s, uint64_t index)
+{
+    return s->header.data_offset + (index - 1) * s->header.cluster_size;
+}
+
+static DedupChunk *dedup_get_chunk(BDRVDedupState *s, uint64_t index)
+{
+    return g_ptr_array_index(s->chunks, index - 1);
+}
+
+/* Allocate a chunk for new content, called with lock held exclusively */
+static DedupChunk *dedup_chunk_new(BDRVDedupState *s, const uint8_t *hash)
+{
+    DedupChunk *chunk = g_new0(DedupChunk, 1);
+
+    memcpy(chunk->hash, hash, DEDUP_HASH_SIZE);
+
+    if (s->free_chunks->len) {
+        chunk->index = g_array_index(s->free_chunks, uint64_t,
+                                     s->free_chunks->len - 1);
+        g_array_set_size(s->free_chunks, s->free_chunks->len - 1);
+        g_ptr_array_index(s->chunks, chunk->index - 1) = chunk;
+    } else {
+        g_ptr_array_add(s->chunks, chunk);
+        chunk->index = s->chunks->len;
+    }
+
+    return chunk;
+}
+
+/* Give back a chunk that isn't referenced and whose content isn't indexed */
+static void dedup_chunk_abort_new(BDRVDedupState *s, DedupChunk *chunk)
+{
+    assert(chunk->refcount == 0);
+
+    g_ptr_array_index(s->chunks, chunk->index - 1) = NULL;
+    g_array_append_val(s->free_chunks, chunk->index);
+    g_free(chunk);
+}
+
+static void dedup_chunk_unref(BDRVDedupState *s, uint64_t index)
+{
+    DedupChunk *chunk = dedup_get_chunk(s, index);
+
+    assert(chunk && chunk->refcount > 0);
+    if (--chunk->refcount > 0) {
+        return;
+    }
+
+    if (g_hash_table_lookup(s->index, chunk->hash) == chunk) {
+        g_hash_table_remove(s->index, chunk->hash);
+    }
+    g_ptr_array_index(s->chunks, index - 1) = NULL;
+    g_array_append_val(s->pending_free_chunks, index);
+    g_free(chunk);
+}
+
+/*
+ * Point the map entry for @cluster to the chunk @index (which must already
+ * hold a reference for it) or, if @index is 0, mark it as zero.
+ */
+static void dedup_set_entry(BDRVDedupState *s, uint64_t cluster,
+                            uint64_t index, const uint8_t *hash)
+{
+    uint64_t old_index = le64_to_cpu(s->map[cluster].chunk);
+
+    s->map[cluster].chunk = cpu_to_le64(index);
+    if (index) {
+        memcpy(s->map[cluster].hash, hash, DEDUP_HASH_SIZE);
+    } else {
+        memset(s->map[cluster].hash, 0, DEDUP_HASH_SIZE);
+    }
+    set_bit(cluster, s->dirty_map);
+
+    if (old_index) {
+        dedup_chunk_unref(s, old_index);
+    }
+}
+
+static int dedup_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    const DedupHeader *header = (const DedupHeader *)buf;
+
+    if (buf_size < sizeof(*header)) {
+        return 0;
+    }
+    if (le32_to_cpu(header->magic) != DEDUP_MAGIC) {
+        return 0;
+    }
+    return 100;
+}
+
+static void dedup_header_le_to_cpu(const DedupHeader *le, DedupHeader *cpu)
+{
+    cpu->magic = le32_to_cpu(le->magic);
+    cpu->version = le32_to_cpu(le->version);
+    cpu->cluster_size = le32_to_cpu(le->cluster_size);
+    cpu->reserved = le32_to_cpu(le->reserved);
+    cpu->disk_size = le64_to_cpu(le->disk_size);
+    cpu->map_offset = le64_to_cpu(le->map_offset);
+    cpu->data_offset = le64_to_cpu(le->data_offset);
+}
+
+static void dedup_header_cpu_to_le(const DedupHeader *cpu, DedupHeader *le)
+{
+    le->magic = cpu_to_le32(cpu->magic);
+    le->version = cpu_to_le32(cpu->version);
+    le->cluster_size = cpu_to_le32(cpu->cluster_size);
+    le->reserved = cpu_to_le32(cpu->reserved);
+    le->disk_size = cpu_to_le64(cpu->disk_size);
+    le->map_offset = cpu_to_le64(cpu->map_offset);
+    le->data_offset = cpu_to_le64(cpu->data_offset);
+}
+
+static void dedup_free_state(BDRVDedupState *s)
+{
+    if (s->chunks) {
+        g_ptr_array_set_free_func(s->chunks, g_free);
+        g_ptr_array_free(s->chunks, true);
+        s->chunks = NULL;
+    }
+    if (s->index) {
+        g_hash_table_destroy(s->index);
+        s->index = NULL;
+    }
+    if (s->free_chunks) {
+        g_array_free(s->free_chunks, true);
+        s->free_chunks = NULL;
+    }
+    if (s->pending_free_chunks) {
+        g_array_free(s->pending_free_chunks, true);
+        s->pending_free_chunks = NULL;
+    }
+    g_free(s->dirty_map);
+    s->dirty_map = NULL;
+    qemu_vfree(s->map);
+    s->map = NULL;
+}
+
+/* Rebuild reference counts, hash index and free list from the map */
+static int GRAPH_RDLOCK dedup_load_chunks(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    int64_t file_size;
+    uint64_t nb_chunks = 0;
+    uint64_t i;
+
+    file_size = bdrv_getlength(bs->file->bs);
+    if (file_size < 0) {
+        error_setg_errno(errp, -file_size, "Could not get image file size");
+        return file_size;
+    }
+    if (file_size > s->header.data_offset) {
+        nb_chunks = DIV_ROUND_UP(file_size - s->header.data_offset,
+                                 s->header.cluster_size);
+    }
+
+    s->chunks = g_ptr_array_sized_new(nb_chunks);
+    g_ptr_array_set_size(s->chunks, nb_chunks);
+    s->index = g_hash_table_new(dedup_hash_hash, dedup_hash_equal);
+    s->free_chunks = g_array_new(false, false, sizeof(uint64_t));
+    s->pending_free_chunks = g_array_new(false, false, sizeof(uint64_t));
+
+    for (i = 0; i < s->nb_entries; i++) {
+        uint64_t index = le64_to_cpu(s->map[i].chunk);
+        DedupChunk *chunk;
+
+        if (!index) {
+            continue;
+        }
+        if (index > nb_chunks) {
+            error_setg(errp, "Map entry %" PRIu64 " refers to chunk %" PRIu64
+                       " beyond the end of the image", i, index);
+            return -EINVAL;
+        }
+
+        chunk = dedup_get_chunk(s, index);
+        if (!chunk) {
+            chunk = g_new0(DedupChunk, 1);
+            chunk->index = index;
+            memcpy(chunk->hash, s->map[i].hash, DEDUP_HASH_SIZE);
+            g_ptr_array_index(s->chunks, index - 1) = chunk;
+            /*
+             * After a crash during a flush, the map may refer to two chunks
+             * with the same content; only one of them is used for new data.
+             */
+            if (!g_hash_table_contains(s->index, chunk->hash)) {
+                g_hash_table_insert(s->index, chunk->hash, chunk);
+            }
+        } else if (memcmp(chunk->hash, s->map[i].hash, DEDUP_HASH_SIZE)) {
+            error_setg(errp, "Map entry %" PRIu64 " has a different hash than "
+                       "other references to chunk %" PRIu64, i, index);
+            return -EINVAL;
+        }
+        chunk->refcount++;
+    }
+
+    /* Allocate free chunks from the start of the data area first */
+    for (i = nb_chunks; i > 0; i--) {
+        if (!dedup_get_chunk(s, i)) {
+            g_array_append_val(s->free_chunks, i);
+        }
+    }
+
+    return 0;
+}
+
+static int dedup_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupHeader header;
+    uint64_t map_size;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    ret = bdrv_pread(bs->file, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read image header");
+        return ret;
+    }
+    dedup_header_le_to_cpu(&header, &s->header);
+
+    if (s->header.magic != DEDUP_MAGIC) {
+        error_setg(errp, "Image not in dedup format");
+        return -EINVAL;
+    }
+    if (s->header.version != DEDUP_VERSION) {
+        error_setg(errp, "Unsupported dedup version %" PRIu32,
+                   s->header.version);
+        return -ENOTSUP;
+    }
+    if (s->header.cluster_size < DEDUP_MIN_CLUSTER_SIZE ||
+        s->header.cluster_size > DEDUP_MAX_CLUSTER_SIZE ||
+        !is_power_of_2(s->header.cluster_size))
+    {
+        error_setg(errp, "Invalid cluster size %" PRIu32,
+                   s->header.cluster_size);
+        return -EINVAL;
+    }
+
+    s->nb_entries = DIV_ROUND_UP(s->header.disk_size, s->header.cluster_size);
+    if (s->nb_entries > DEDUP_MAX_ENTRIES) {
+        error_setg(errp, "Unsupported image size %" PRIu64,
+                   s->header.disk_size);
+        return -ENOTSUP;
+    }
+    map_size = s->nb_entries * sizeof(DedupMapEntry);
+
+    if (s->header.map_offset < sizeof(header) ||
+        s->header.data_offset < s->header.map_offset + map_size ||
+        !QEMU_IS_ALIGNED(s->header.data_offset, s->header.cluster_size))
+    {
+        error_setg(errp, "Invalid map or data offset");
+        return -EINVAL;
+    }
+
+    bs->total_sectors = DIV_ROUND_UP(s->header.disk_size, BDRV_SECTOR_SIZE);
+
+    s->map = qemu_try_blockalign(bs->file->bs, MAX(map_size, 1));
+    if (!s->map) {
+        error_setg(errp, "Could not allocate map");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, s->header.map_offset, map_size, s->map, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read map");
+        goto fail;
+    }
+
+    s->dirty_map = bitmap_new(s->nb_entries);
+
+    ret = dedup_load_chunks(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Disable migration, the map is cached in memory */
+    error_setg(&s->migration_blocker, "The dedup format used by node '%s' "
+               "does not support live migration",
+               bdrv_get_device_or_node_name(bs));
+
+    ret = migrate_add_blocker_normal(&s->migration_blocker, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_co_rwlock_init(&s->lock);
+    qemu_co_mutex_init(&s->busy_lock);
+    qemu_co_mutex_init(&s->flush_lock);
+    qemu_co_queue_init(&s->busy_queue);
+    QLIST_INIT(&s->busy_clusters);
+
+    return 0;
+
+fail:
+    dedup_free_state(s);
+    return ret;
+}
+
+static int dedup_reopen_prepare(BDRVReopenState *state,
+                                BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void dedup_close(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    dedup_free_state(s);
+    migrate_del_blocker(&s->migration_blocker);
+}
+
+static void GRAPH_RDLOCK dedup_refresh_limits(BlockDriverState *bs,
+                                              Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bs->bl.pwrite_zeroes_alignment = s->header.cluster_size;
+    bs->bl.pdiscard_alignment = s->header.cluster_size;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bdi->cluster_size = s->header.cluster_size;
+    return 0;
+}
+
+static int GRAPH_RDLOCK dedup_has_zero_init(BlockDriverState *bs)
+{
+    return 1;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_block_status(BlockDriverState *bs, bool want_zero, int64_t offset,
+                      int64_t bytes, int64_t *pnum, int64_t *map,
+                      BlockDriverState **file)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t cluster_size = s->header.cluster_size;
+    uint64_t cluster = offset / cluster_size;
+    uint64_t next = cluster + 1;
+    uint64_t index;
+    bool shared = false;
+    int64_t n;
+
+    n = MIN(bytes, cluster_size - offset % cluster_size);
+
+    qemu_co_rwlock_rdlock(&s->lock);
+    index = le64_to_cpu(s->map[cluster].chunk);
+    if (index) {
+        shared = dedup_get_chunk(s, index)->refcount > 1;
+    }
+    /*
+     * Report runs of zero clusters and of contiguous unshared chunks at once.
+     * A chunk that is shared with other clusters has no offset of its own
+     * that callers could write to or copy from, so report it on its own.
+     */
+    while (n < bytes && !shared) {
+        uint64_t next_index = le64_to_cpu(s->map[next].chunk);
+
+        if (next_index != (index ? index + next - cluster : 0) ||
+            (next_index && dedup_get_chunk(s, next_index)->refcount > 1))
+        {
+            break;
+        }
+        n += MIN(bytes - n, cluster_size);
+        next++;
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    *pnum = n;
+    if (!index) {
+        return BDRV_BLOCK_ZERO;
+    }
+    if (shared) {
+        return BDRV_BLOCK_DATA;
+    }
+
+    *map = dedup_chunk_offset(s, index) + offset % cluster_size;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t cluster_size = s->header.cluster_size;
+    QEMUIOVector local_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+
+    qemu_co_rwlock_rdlock(&s->lock);
+    while (ret >= 0 && bytes > 0) {
+        uint64_t cluster = offset / cluster_size;
+        uint64_t offset_in_cluster = offset % cluster_size;
+        uint64_t index = le64_to_cpu(s->map[cluster].chunk);
+        uint64_t next = cluster + 1;
+        int64_t n = MIN(bytes, cluster_size - offset_in_cluster);
+
+        if (!index) {
+            qemu_iovec_memset(qiov, bytes_done, 0, n);
+        } else {
+            /* Read chunks that happen to be contiguous at once */
+            while (n < bytes &&
+                   le64_to_cpu(s->map[next].chunk) == index + next - cluster)
+            {
+                n += MIN(bytes - n, cluster_size);
+                next++;
+            }
+
+            qemu_iovec_reset(&local_qiov);
+            qemu_iovec_concat(&local_qiov, qiov, bytes_done, n);
+
+            ret = bdrv_co_preadv(bs->file,
+                                 dedup_chunk_offset(s, index) +
+                                 offset_in_cluster,
+                                 n, &local_qiov, 0);
+        }
+
+        bytes -= n;
+        offset += n;
+        bytes_done += n;
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    qemu_iovec_destroy(&local_qiov);
+
+    return ret;
+}
+
+/* Wait until no other request modifies @cluster, then claim it */
+static void coroutine_fn dedup_claim_cluster(BDRVDedupState *s,
+                                             DedupBusyCluster *busy,
+                                             uint64_t cluster)
+{
+    DedupBusyCluster *other;
+
+    qemu_co_mutex_lock(&s->busy_lock);
+retry:
+    QLIST_FOREACH(other, &s->busy_clusters, next) {
+        if (other->cluster == cluster) {
+            qemu_co_queue_wait(&s->busy_queue, &s->busy_lock);
+            goto retry;
+        }
+    }
+    busy->cluster = cluster;
+    QLIST_INSERT_HEAD(&s->busy_clusters, busy, next);
+    qemu_co_mutex_unlock(&s->busy_lock);
+}
+
+static void coroutine_fn dedup_release_cluster(BDRVDedupState *s,
+                                               DedupBusyCluster *busy)
+{
+    qemu_co_mutex_lock(&s->busy_lock);
+    QLIST_REMOVE(busy, next);
+    qemu_co_queue_restart_all(&s->busy_queue);
+    qemu_co_mutex_unlock(&s->busy_lock);
+}
+
+/*
+ * Called with @cluster claimed. The cluster keeps its chunk referenced, so
+ * the chunk cannot be freed while it is read.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_read_cluster(BlockDriverState *bs, uint64_t cluster, uint8_t *buf)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t index = le64_to_cpu(s->map[cluster].chunk);
+
+    if (!index) {
+        memset(buf, 0, s->header.cluster_size);
+        return 0;
+    }
+
+    return bdrv_co_pread(bs->file, dedup_chunk_offset(s, index),
+                         s->header.cluster_size, buf, 0);
+}
+
+/*
+ * Store the content of @cluster, whose hash is @hash or which is all zeroes
+ * if @hash is NULL. Only content that isn't stored yet is written to the
+ * image file.
+ *
+ * Called with @cluster claimed. The lock is only held while the metadata is
+ * looked up or updated, not while new content is written.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_store_cluster(BlockDriverState *bs, uint64_t cluster,
+                       const uint8_t *buf, const uint8_t *hash)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupChunk *chunk, *new_chunk;
+    int ret;
+
+    qemu_co_rwlock_wrlock(&s->lock);
+
+    if (!hash) {
+        if (s->map[cluster].chunk) {
+            dedup_set_entry(s, cluster, 0, NULL);
+        }
+        goto out;
+    }
+
+    chunk = g_hash_table_lookup(s->index, hash);
+    if (!chunk) {
+        /*
+         * Nothing refers to the new chunk before its content is written, so
+         * it can be written without the lock.
+         */
+        new_chunk = dedup_chunk_new(s, hash);
+        qemu_co_rwlock_unlock(&s->lock);
+
+        ret = bdrv_co_pwrite(bs->file, dedup_chunk_offset(s, new_chunk->index),
+                             s->header.cluster_size, buf, 0);
+
+        qemu_co_rwlock_wrlock(&s->lock);
+        if (ret < 0) {
+            dedup_chunk_abort_new(s, new_chunk);
+            qemu_co_rwlock_unlock(&s->lock);
+            return ret;
+        }
+
+        /* Another request may have stored the same content meanwhile */
+        chunk = g_hash_table_lookup(s->index, hash);
+        if (chunk) {
+            dedup_chunk_abort_new(s, new_chunk);
+        } else {
+            chunk = new_chunk;
+            g_hash_table_insert(s->index, chunk->hash, chunk);
+        }
+    }
+
+    chunk->refcount++;
+    dedup_set_entry(s, cluster, chunk->index, hash);
+
+out:
+    qemu_co_rwlock_unlock(&s->lock);
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                 QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t cluster_size = s->header.cluster_size;
+    uint8_t hash[DEDUP_HASH_SIZE];
+    DedupBusyCluster busy;
+    uint64_t bytes_done = 0;
+    uint8_t *buf;
+    int ret = 0;
+
+    buf = qemu_try_blockalign(bs->file->bs, cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    while (ret >= 0 && bytes > 0) {
+        uint64_t cluster = offset / cluster_size;
+        uint64_t offset_in_cluster = offset % cluster_size;
+        int64_t n = MIN(bytes, cluster_size - offset_in_cluster);
+        bool zero;
+
+        dedup_claim_cluster(s, &busy, cluster);
+
+        if (n == cluster_size) {
+            qemu_iovec_to_buf(qiov, bytes_done, buf, n);
+        } else {
+            ret = dedup_co_read_cluster(bs, cluster, buf);
+            if (ret < 0) {
+                dedup_release_cluster(s, &busy);
+                break;
+            }
+            qemu_iovec_to_buf(qiov, bytes_done, buf + offset_in_cluster, n);
+        }
+
+        zero = buffer_is_zero(buf, cluster_size);
+        if (!zero) {
+            ret = dedup_hash_buf(buf, cluster_size, hash);
+        }
+        if (ret >= 0) {
+            ret = dedup_co_store_cluster(bs, cluster, buf, zero ? NULL : hash);
+        }
+
+        dedup_release_cluster(s, &busy);
+
+        bytes -= n;
+        offset += n;
+        bytes_done += n;
+    }
+
+    qemu_vfree(buf);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_zero_clusters(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t cluster_size = s->header.cluster_size;
+    DedupBusyCluster busy;
+    uint64_t cluster, end;
+
+    /* A partial cluster at the end of the image is fine, too */
+    if (!QEMU_IS_ALIGNED(offset, cluster_size) ||
+        (!QEMU_IS_ALIGNED(bytes, cluster_size) &&
+         offset + bytes != bs->total_sectors * BDRV_SECTOR_SIZE))
+    {
+        return -ENOTSUP;
+    }
+
+    end = DIV_ROUND_UP(offset + bytes, cluster_size);
+
+    for (cluster = offset / cluster_size; cluster < end; cluster++) {
+        dedup_claim_cluster(s, &busy, cluster);
+        dedup_co_store_cluster(bs, cluster, NULL, NULL);
+        dedup_release_cluster(s, &busy);
+    }
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       BdrvRequestFlags flags)
+{
+    return dedup_co_zero_clusters(bs, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    return dedup_co_zero_clusters(bs, offset, bytes);
+}
+
+/* Changed map entries, copied for writeback */
+typedef struct DedupMapRange {
+    uint64_t start;
+    uint64_t count;
+    DedupMapEntry *entries;
+} DedupMapRange;
+
+/*
+ * Write the changed map entries. The chunks they refer to are flushed before,
+ * and chunks that have become unreferenced can only be reused once the new
+ * map is stable.
+ *
+ * The entries are copied while the lock is held, the I/O is done without it,
+ * so that requests can go on while the image file is flushed.
+ */
+static int coroutine_fn GRAPH_RDLOCK dedup_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    g_autoptr(GArray) ranges = g_array_new(false, false,
+                                           sizeof(DedupMapRange));
+    GArray *freed;
+    DedupMapRange *range;
+    unsigned long start, end;
+    unsigned i;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->flush_lock);
+
+    qemu_co_rwlock_wrlock(&s->lock);
+    start = find_first_bit(s->dirty_map, s->nb_entries);
+    while (start < s->nb_entries) {
+        DedupMapRange new_range;
+
+        end = find_next_zero_bit(s->dirty_map, s->nb_entries, start);
+        new_range = (DedupMapRange) {
+            .start = start,
+            .count = end - start,
+            .entries = g_memdup2(&s->map[start],
+                                 (end - start) * sizeof(DedupMapEntry)),
+        };
+        g_array_append_val(ranges, new_range);
+        bitmap_clear(s->dirty_map, start, end - start);
+        start = find_next_bit(s->dirty_map, s->nb_entries, end);
+    }
+    freed = s->pending_free_chunks;
+    s->pending_free_chunks = g_array_new(false, false, sizeof(uint64_t));
+    qemu_co_rwlock_unlock(&s->lock);
+
+    if (!ranges->len && !freed->len) {
+        goto out;
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    for (i = 0; ret >= 0 && i < ranges->len; i++) {
+        range = &g_array_index(ranges, DedupMapRange, i);
+        ret = bdrv_co_pwrite(bs->file, s->header.map_offset +
+                             range->start * sizeof(DedupMapEntry),
+                             range->count * sizeof(DedupMapEntry),
+                             range->entries, 0);
+    }
+    if (ret >= 0) {
+        ret = bdrv_co_flush(bs->file->bs);
+    }
+
+    qemu_co_rwlock_wrlock(&s->lock);
+    if (ret < 0) {
+        /* Write the entries again with the next flush */
+        for (i = 0; i < ranges->len; i++) {
+            range = &g_array_index(ranges, DedupMapRange, i);
+            bitmap_set(s->dirty_map, range->start, range->count);
+        }
+        g_array_append_vals(s->pending_free_chunks, freed->data, freed->len);
+    } else {
+        g_array_append_vals(s->free_chunks, freed->data, freed->len);
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+out:
+    for (i = 0; i < ranges->len; i++) {
+        g_free(g_array_index(ranges, DedupMapRange, i).entries);
+    }
+    g_array_free(freed, true);
+    qemu_co_mutex_unlock(&s->flush_lock);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_UNLOCKED
+dedup_co_create(BlockdevCreateOptions *opts, Error **errp)
+{
+    BlockdevCreateOptionsDedup *dedup_opts;
+    BlockDriverState *bs = NULL;
+    BlockBackend *blk = NULL;
+    DedupHeader header, le_header;
+    uint64_t cluster_size, nb_entries, map_size;
+    int ret;
+
+    assert(opts->driver == BLOCKDEV_DRIVER_DEDUP);
+    dedup_opts = &opts->u.dedup;
+
+    if (!dedup_opts->has_cluster_size) {
+        dedup_opts->cluster_size = DEDUP_DEFAULT_CLUSTER_SIZE;
+    }
+    cluster_size = dedup_opts->cluster_size;
+    if (cluster_size < DEDUP_MIN_CLUSTER_SIZE ||
+        cluster_size > DEDUP_MAX_CLUSTER_SIZE ||
+        !is_power_of_2(cluster_size))
+    {
+        error_setg(errp, "Cluster size must be a power of two between %d "
+                   "and %dk", DEDUP_MIN_CLUSTER_SIZE,
+                   DEDUP_MAX_CLUSTER_SIZE / KiB);
+        return -EINVAL;
+    }
+
+    nb_entries = DIV_ROUND_UP(dedup_opts->size, cluster_size);
+    if (nb_entries > DEDUP_MAX_ENTRIES) {
+        error_setg(errp, "Image size is too large for this cluster size");
+        return -EINVAL;
+    }
+    map_size = nb_entries * sizeof(DedupMapEntry);
+
+    header = (DedupHeader) {
+        .magic = DEDUP_MAGIC,
+        .version = DEDUP_VERSION,
+        .cluster_size = cluster_size,
+        .disk_size = dedup_opts->size,
+        .map_offset = cluster_size,
+        .data_offset = ROUND_UP(cluster_size + map_size, cluster_size),
+    };
+    dedup_header_cpu_to_le(&header, &le_header);
+
+    bs = bdrv_co_open_blockdev_ref(dedup_opts->file, errp);
+    if (bs == NULL) {
+        return -EIO;
+    }
+
+    blk = blk_co_new_with_bs(bs, BLK_PERM_WRITE | BLK_PERM_RESIZE,
+                             BLK_PERM_ALL, errp);
+    if (!blk) {
+        ret = -EPERM;
+        goto out;
+    }
+    blk_set_allow_write_beyond_eof(blk, true);
+
+    ret = blk_co_truncate(blk, 0, true, PREALLOC_MODE_OFF, 0, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = blk_co_pwrite(blk, 0, sizeof(le_header), &le_header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Error writing header");
+        goto out;
+    }
+
+    ret = blk_co_pwrite_zeroes(blk, header.map_offset,
+                               header.data_offset - header.map_offset, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Error writing map");
+        goto out;
+    }
+
+    ret = 0;
+out:
+    blk_co_unref(blk);
+    bdrv_co_unref(bs);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_UNLOCKED
+dedup_co_create_opts(BlockDriver *drv, const char *filename,
+                     QemuOpts *opts, Error **errp)
+{
+    QDict *qdict;
+    Visitor *v;
+    BlockDriverState *bs = NULL;
+    BlockdevCreateOptions *create_options = NULL;
+    int ret;
+
+    qdict = qemu_opts_to_qdict_filtered(opts, NULL, &dedup_create_opts, true);
+
+    /* Create and open the file (protocol layer) */
+    ret = bdrv_co_create_file(filename, opts, errp);
+    if (ret < 0) {
+        goto done;
+    }
+
+    bs = bdrv_co_open(filename, NULL, NULL,
+                      BDRV_O_RDWR | BDRV_O_RESIZE | BDRV_O_PROTOCOL, errp);
+    if (bs == NULL) {
+        ret = -EIO;
+        goto done;
+    }
+
+    qdict_put_str(qdict, "driver", "dedup");
+    qdict_put_str(qdict, "file", bs->node_name);
+
+    /* Get the QAPI object */
+    v = qobject_input_visitor_new_flat_confused(qdict, errp);
+    if (!v) {
+        ret = -EINVAL;
+        goto done;
+    }
+    visit_type_BlockdevCreateOptions(v, NULL, &create_options, errp);
+    visit_free(v);
+    if (!create_options) {
+        ret = -EINVAL;
+        goto done;
+    }
+
+    /* Silently round up size */
+    assert(create_options->driver == BLOCKDEV_DRIVER_DEDUP);
+    create_options->u.dedup.size = ROUND_UP(create_options->u.dedup.size,
+                                            BDRV_SECTOR_SIZE);
+
+    /* Create the dedup image (format layer) */
+    ret = dedup_co_create(create_options, errp);
+done:
+    qobject_unref(qdict);
+    qapi_free_BlockdevCreateOptions(create_options);
+    bdrv_co_unref(bs);
+    return ret;
+}
+
+static QemuOptsList dedup_create_opts = {
+    .name = "dedup-create-opts",
+    .head = QTAILQ_HEAD_INITIALIZER(dedup_create_opts.head),
+    .desc = {
+        {
+            .name = BLOCK_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Virtual disk size"
+        },
+        {
+            .name = BLOCK_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Deduplication granularity (cluster size)",
+            .def_value_str = stringify(DEDUP_DEFAULT_CLUSTER_SIZE)
+        },
+        { /* end of list */ }
+    }
+};
+
+static BlockDriver bdrv_dedup = {
+    .format_name            = "dedup",
+    .instance_size          = sizeof(BDRVDedupState),
+    .bdrv_probe             = dedup_probe,
+    .bdrv_open              = dedup_open,
+    .bdrv_close             = dedup_close,
+    .bdrv_reopen_prepare    = dedup_reopen_prepare,
+    .bdrv_child_perm        = bdrv_default_perms,
+    .bdrv_co_create         = dedup_co_create,
+    .bdrv_co_create_opts    = dedup_co_create_opts,
+    .bdrv_has_zero_init     = dedup_has_zero_init,
+    .bdrv_refresh_limits    = dedup_refresh_limits,
+    .bdrv_co_block_status   = dedup_co_block_status,
+
+    .bdrv_co_preadv         = dedup_co_preadv,
+    .bdrv_co_pwritev        = dedup_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = dedup_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = dedup_co_pdiscard,
+    .bdrv_co_flush_to_os    = dedup_co_flush_to_os,
+
+    .bdrv_co_get_info       = dedup_co_get_info,
+
+    .is_format              = true,
+    .create_opts            = &dedup_create_opts,
+};
+
+static void bdrv_dedup_init(void)
+{
+    bdrv_register(&bdrv_dedup);
+}
+
+block_init(bdrv_dedup_init);
@@ -80,6 +80,8 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
     BlockDriverState *bs;
     BlockBackend *blk = NULL;
     AioContext *ctx;
+    AioContext **iothread_ctxs = NULL;
+    size_t num_iothread_ctxs = 0;
     uint64_t perm;
     int ret;
 
@@ -100,6 +102,19 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         return NULL;
     }
 
+    if (export->iothreads) {
+        if (export->iothread) {
+            error_setg(errp, "iothread and iothreads cannot be set at the "
+                       "same time");
+            return NULL;
+        }
+        if (!drv->supports_multi_iothread) {
+            error_setg(errp, "Export type '%s' does not support multiple "
+                       "iothreads", BlockExportType_str(export->type));
+            return NULL;
+        }
+    }
+
     bs = bdrv_lookup_bs(NULL, export->node_name, errp);
     if (!bs) {
         return NULL;
@@ -115,19 +130,45 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
 
     ctx = bdrv_get_aio_context(bs);
 
-    if (export->iothread) {
-        IOThread *iothread;
+    if (export->iothreads) {
+        strList *node;
+
+        for (node = export->iothreads; node; node = node->next) {
+            num_iothread_ctxs++;
+        }
+
+        iothread_ctxs = g_new(AioContext *, num_iothread_ctxs);
+        num_iothread_ctxs = 0;
+
+        for (node = export->iothreads; node; node = node->next) {
+            IOThread *iothread = iothread_by_id(node->value);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found", node->value);
+                goto fail;
+            }
+            iothread_ctxs[num_iothread_ctxs++] =
+                iothread_get_aio_context(iothread);
+        }
+    }
+
+    if (export->iothread || iothread_ctxs) {
         AioContext *new_ctx;
         Error **set_context_errp;
 
-        iothread = iothread_by_id(export->iothread);
-        if (!iothread) {
-            error_setg(errp, "iothread \"%s\" not found", export->iothread);
-            goto fail;
+        if (export->iothread) {
+            IOThread *iothread = iothread_by_id(export->iothread);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found",
+                           export->iothread);
+                goto fail;
+            }
+            new_ctx = iothread_get_aio_context(iothread);
+        } else {
+            new_ctx = iothread_ctxs[0];
         }
 
-        new_ctx = iothread_get_aio_context(iothread);
-
         /* Ignore errors with fixed-iothread=false */
         set_context_errp = fixed_iothread ? errp : NULL;
         ret = bdrv_try_change_aio_context(bs, new_ctx, NULL, set_context_errp);
@@ -178,6 +219,8 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         .id         = g_strdup(export->id),
         .ctx        = ctx,
         .blk        = blk,
+        .iothread_ctxs      = iothread_ctxs,
+        .num_iothread_ctxs  = num_iothread_ctxs,
     };
 
     ret = drv->create(exp, export, errp);
@@ -199,6 +242,7 @@ fail:
         g_free(exp->id);
         g_free(exp);
     }
+    g_free(iothread_ctxs);
     return NULL;
 }
 
@@ -219,6 +263,7 @@ static void blk_exp_delete_bh(void *opaque)
     blk_set_dev_ops(exp->blk, NULL, NULL);
     blk_unref(exp->blk);
     qapi_event_send_block_export_deleted(exp->id);
+    g_free(exp->iothread_ctxs);
     g_free(exp->id);
     g_free(exp);
 }
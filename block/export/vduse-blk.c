@@ -33,13 +33,70 @@ typedef struct VduseBlkExport {
     char *recon_file;
     unsigned int inflight; /* atomic */
     bool vqs_started;
+
+    /*
+     * If the export runs in multiple iothreads, virtqueue n is processed in
+     * export.iothread_ctxs[n % export.num_iothread_ctxs].  libvduse is not
+     * thread-safe, so each of these iothreads holds its vq_locks entry while
+     * it accesses virtqueues, and everything else that touches the device
+     * (VDUSE messages, starting and stopping virtqueues) takes all of them.
+     */
+    QemuRecMutex *vq_locks;
 } VduseBlkExport;
 
 typedef struct VduseBlkReq {
     VduseVirtqElement elem;
     VduseVirtq *vq;
+    VirtioBlkAioReq aio_req;
 } VduseBlkReq;
 
+/* Returns the AioContext in which @vq is processed */
+static AioContext *vduse_blk_vq_aio_context(VduseBlkExport *vblk_exp,
+                                            VduseVirtq *vq)
+{
+    BlockExport *exp = &vblk_exp->export;
+
+    if (exp->num_iothread_ctxs) {
+        return exp->iothread_ctxs[vduse_queue_get_index(vq) %
+                                  exp->num_iothread_ctxs];
+    }
+    return exp->ctx;
+}
+
+static void vduse_blk_vq_lock(VduseBlkExport *vblk_exp, VduseVirtq *vq)
+{
+    BlockExport *exp = &vblk_exp->export;
+
+    if (exp->num_iothread_ctxs) {
+        qemu_rec_mutex_lock(&vblk_exp->vq_locks[vduse_queue_get_index(vq) %
+                                                exp->num_iothread_ctxs]);
+    }
+}
+
+static void vduse_blk_vq_unlock(VduseBlkExport *vblk_exp, VduseVirtq *vq)
+{
+    BlockExport *exp = &vblk_exp->export;
+
+    if (exp->num_iothread_ctxs) {
+        qemu_rec_mutex_unlock(&vblk_exp->vq_locks[vduse_queue_get_index(vq) %
+                                                  exp->num_iothread_ctxs]);
+    }
+}
+
+static void vduse_blk_lock_all_vqs(VduseBlkExport *vblk_exp)
+{
+    for (size_t i = 0; i < vblk_exp->export.num_iothread_ctxs; i++) {
+        qemu_rec_mutex_lock(&vblk_exp->vq_locks[i]);
+    }
+}
+
+static void vduse_blk_unlock_all_vqs(VduseBlkExport *vblk_exp)
+{
+    for (size_t i = 0; i < vblk_exp->export.num_iothread_ctxs; i++) {
+        qemu_rec_mutex_unlock(&vblk_exp->vq_locks[i]);
+    }
+}
+
 static void vduse_blk_inflight_inc(VduseBlkExport *vblk_exp)
 {
     if (qatomic_fetch_inc(&vblk_exp->inflight) == 0) {
@@ -61,12 +118,27 @@ static void vduse_blk_inflight_dec(VduseBlkExport *vblk_exp)
 
 static void vduse_blk_req_complete(VduseBlkReq *req, size_t in_len)
 {
+    VduseBlkExport *vblk_exp =
+        vduse_dev_get_priv(vduse_queue_get_dev(req->vq));
+
+    vduse_blk_vq_lock(vblk_exp, req->vq);
     vduse_queue_push(req->vq, &req->elem, in_len);
     vduse_queue_notify(req->vq);
+    vduse_blk_vq_unlock(vblk_exp, req->vq);
 
     free(req);
 }
 
+static void vduse_blk_aio_req_complete(VirtioBlkAioReq *aio_req, int in_len)
+{
+    VduseBlkReq *req = container_of(aio_req, VduseBlkReq, aio_req);
+    VduseBlkExport *vblk_exp =
+        vduse_dev_get_priv(vduse_queue_get_dev(req->vq));
+
+    vduse_blk_req_complete(req, in_len);
+    vduse_blk_inflight_dec(vblk_exp);
+}
+
 static void coroutine_fn vduse_blk_virtio_process_req(void *opaque)
 {
     VduseBlkReq *req = opaque;
@@ -105,10 +177,19 @@ static void vduse_blk_vq_handler(VduseDev *dev, VduseVirtq *vq)
         }
         req->vq = vq;
 
+        vduse_blk_inflight_inc(vblk_exp);
+
+        /* Reads and writes can avoid coroutines altogether */
+        if (virtio_blk_process_rw_aio(&vblk_exp->handler, &req->aio_req,
+                                      req->elem.in_sg, req->elem.out_sg,
+                                      req->elem.in_num, req->elem.out_num,
+                                      vduse_blk_aio_req_complete)) {
+            continue;
+        }
+
         Coroutine *co =
             qemu_coroutine_create(vduse_blk_virtio_process_req, req);
 
-        vduse_blk_inflight_inc(vblk_exp);
         qemu_coroutine_enter(co);
     }
 }
@@ -117,17 +198,32 @@ static void on_vduse_vq_kick(void *opaque)
 {
     VduseVirtq *vq = opaque;
     VduseDev *dev = vduse_queue_get_dev(vq);
-    int fd = vduse_queue_get_fd(vq);
+    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
     eventfd_t kick_data;
+    int fd;
+
+    vduse_blk_vq_lock(vblk_exp, vq);
+
+    /*
+     * Another thread may have stopped the virtqueues, or a VDUSE message
+     * may have disabled this one and closed its kick fd, in the meantime.
+     */
+    fd = vduse_queue_get_fd(vq);
+    if (!vblk_exp->vqs_started || fd < 0) {
+        goto out;
+    }
 
     if (eventfd_read(fd, &kick_data) == -1) {
         error_report("failed to read data from eventfd");
-        return;
+        goto out;
     }
 
     vduse_blk_vq_handler(dev, vq);
+out:
+    vduse_blk_vq_unlock(vblk_exp, vq);
 }
 
+/* Called with all vq_locks held */
 static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
@@ -136,12 +232,14 @@ static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
         return; /* vduse_blk_drained_end() will start vqs later */
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, vduse_queue_get_fd(vq),
+    aio_set_fd_handler(vduse_blk_vq_aio_context(vblk_exp, vq),
+                       vduse_queue_get_fd(vq),
                        on_vduse_vq_kick, NULL, NULL, NULL, vq);
     /* Make sure we don't miss any kick after reconnecting */
     eventfd_write(vduse_queue_get_fd(vq), 1);
 }
 
+/* Called with all vq_locks held */
 static void vduse_blk_disable_queue(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
@@ -151,7 +249,7 @@ static void vduse_blk_disable_queue(VduseDev *dev, VduseVirtq *vq)
         return;
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, fd,
+    aio_set_fd_handler(vduse_blk_vq_aio_context(vblk_exp, vq), fd,
                        NULL, NULL, NULL, NULL, NULL);
 }
 
@@ -163,8 +261,12 @@ static const VduseOps vduse_blk_ops = {
 static void on_vduse_dev_kick(void *opaque)
 {
     VduseDev *dev = opaque;
+    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
 
+    /* Messages may remap guest memory or reset virtqueues */
+    vduse_blk_lock_all_vqs(vblk_exp);
     vduse_dev_handler(dev);
+    vduse_blk_unlock_all_vqs(vblk_exp);
 }
 
 static void vduse_blk_attach_ctx(VduseBlkExport *vblk_exp, AioContext *ctx)
@@ -209,29 +311,39 @@ static void vduse_blk_resize(void *opaque)
 
     config.capacity =
             cpu_to_le64(blk_getlength(exp->blk) >> VIRTIO_BLK_SECTOR_BITS);
+    vduse_blk_lock_all_vqs(vblk_exp);
     vduse_dev_update_config(vblk_exp->dev, sizeof(config.capacity),
                             offsetof(struct virtio_blk_config, capacity),
                             (char *)&config.capacity);
+    vduse_blk_unlock_all_vqs(vblk_exp);
 }
 
 static void vduse_blk_stop_virtqueues(VduseBlkExport *vblk_exp)
 {
+    vduse_blk_lock_all_vqs(vblk_exp);
+
     for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
         VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
         vduse_blk_disable_queue(vblk_exp->dev, vq);
     }
 
     vblk_exp->vqs_started = false;
+
+    vduse_blk_unlock_all_vqs(vblk_exp);
 }
 
 static void vduse_blk_start_virtqueues(VduseBlkExport *vblk_exp)
 {
+    vduse_blk_lock_all_vqs(vblk_exp);
+
     vblk_exp->vqs_started = true;
 
     for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
         VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
         vduse_blk_enable_queue(vblk_exp->dev, vq);
     }
+
+    vduse_blk_unlock_all_vqs(vblk_exp);
 }
 
 static void vduse_blk_drained_begin(void *opaque)
@@ -265,6 +377,15 @@ static const BlockDevOps vduse_block_ops = {
     .drained_poll  = vduse_blk_drained_poll,
 };
 
+static void vduse_blk_free_vq_locks(VduseBlkExport *vblk_exp)
+{
+    for (size_t i = 0; i < vblk_exp->export.num_iothread_ctxs; i++) {
+        qemu_rec_mutex_destroy(&vblk_exp->vq_locks[i]);
+    }
+    g_free(vblk_exp->vq_locks);
+    vblk_exp->vq_locks = NULL;
+}
+
 static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                 Error **errp)
 {
@@ -284,6 +405,9 @@ static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
             error_setg(errp, "num-queues must be greater than 0");
             return -EINVAL;
         }
+    } else if (exp->num_iothread_ctxs) {
+        /* One virtqueue per iothread unless the user wants otherwise */
+        num_queues = MIN(exp->num_iothread_ctxs, UINT16_MAX);
     }
 
     if (vblk_opts->has_queue_size) {
@@ -311,6 +435,13 @@ static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     vblk_exp->handler.writable = opts->writable;
     vblk_exp->vqs_started = true;
 
+    if (exp->num_iothread_ctxs) {
+        vblk_exp->vq_locks = g_new(QemuRecMutex, exp->num_iothread_ctxs);
+        for (i = 0; i < exp->num_iothread_ctxs; i++) {
+            qemu_rec_mutex_init(&vblk_exp->vq_locks[i]);
+        }
+    }
+
     config.capacity =
             cpu_to_le64(blk_getlength(exp->blk) >> VIRTIO_BLK_SECTOR_BITS);
     config.seg_max = cpu_to_le32(queue_size - 2);
@@ -383,6 +514,7 @@ err:
     vduse_dev_destroy(vblk_exp->dev);
     g_free(vblk_exp->recon_file);
 err_dev:
+    vduse_blk_free_vq_locks(vblk_exp);
     g_free(vblk_exp->handler.serial);
     return ret;
 }
@@ -402,6 +534,7 @@ static void vduse_blk_exp_delete(BlockExport *exp)
         unlink(vblk_exp->recon_file);
     }
     g_free(vblk_exp->recon_file);
+    vduse_blk_free_vq_locks(vblk_exp);
     g_free(vblk_exp->handler.serial);
 }
 
@@ -416,6 +549,7 @@ static void vduse_blk_exp_request_shutdown(BlockExport *exp)
 const BlockExportDriver blk_exp_vduse_blk = {
     .type               = BLOCK_EXPORT_TYPE_VDUSE_BLK,
     .instance_size      = sizeof(VduseBlkExport),
+    .supports_multi_iothread = true,
     .create             = vduse_blk_exp_create,
     .delete             = vduse_blk_exp_delete,
     .request_shutdown   = vduse_blk_exp_request_shutdown,
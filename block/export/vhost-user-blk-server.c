@@ -43,9 +43,12 @@ typedef struct {
 static void vu_blk_req_complete(VuBlkReq *req, size_t in_len)
 {
     VuDev *vu_dev = &req->server->vu_dev;
+    int vq_index = req->vq - vu_dev->vq;
 
+    vhost_user_server_lock_vq(req->server, vq_index);
     vu_queue_push(vu_dev, req->vq, &req->elem, in_len);
     vu_queue_notify(vu_dev, req->vq);
+    vhost_user_server_unlock_vq(req->server, vq_index);
 
     free(req);
 }
@@ -339,6 +342,9 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
 
     if (vu_opts->has_num_queues) {
         num_queues = vu_opts->num_queues;
+    } else if (exp->num_iothread_ctxs) {
+        /* One virtqueue per iothread unless the user wants otherwise */
+        num_queues = MIN(exp->num_iothread_ctxs, UINT16_MAX);
     }
     if (num_queues == 0) {
         error_setg(errp, "num-queues must be greater than 0");
@@ -357,7 +363,12 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
 
     blk_set_dev_ops(exp->blk, &vu_blk_dev_ops, vexp);
 
+    /*
+     * With multiple iothreads, virtqueues are processed in the iothreads in
+     * round-robin order while vhost-user messages stay in exp->ctx.
+     */
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
+                                 exp->iothread_ctxs, exp->num_iothread_ctxs,
                                  num_queues, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
@@ -374,12 +385,14 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    vhost_user_server_cleanup(&vexp->vu_server);
     g_free(vexp->handler.serial);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
     .type               = BLOCK_EXPORT_TYPE_VHOST_USER_BLK,
     .instance_size      = sizeof(VuBlkExport),
+    .supports_multi_iothread = true,
     .create             = vu_blk_exp_create,
     .delete             = vu_blk_exp_delete,
     .request_shutdown   = vu_blk_exp_request_shutdown,
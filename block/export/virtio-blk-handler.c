@@ -22,12 +22,11 @@ struct virtio_blk_inhdr {
     unsigned char status;
 };
 
-static bool coroutine_fn
-virtio_blk_sect_range_ok(BlockBackend *blk, uint32_t block_size,
-                         uint64_t sector, size_t size)
+static bool
+virtio_blk_sect_range_valid(uint64_t total_sectors, uint32_t block_size,
+                            uint64_t sector, size_t size)
 {
     uint64_t nb_sectors;
-    uint64_t total_sectors;
 
     if (size % VIRTIO_BLK_SECTOR_SIZE) {
         return false;
@@ -42,13 +41,23 @@ virtio_blk_sect_range_ok(BlockBackend *blk, uint32_t block_size,
     if ((sector << VIRTIO_BLK_SECTOR_BITS) % block_size) {
         return false;
     }
-    blk_co_get_geometry(blk, &total_sectors);
     if (sector > total_sectors || nb_sectors > total_sectors - sector) {
         return false;
     }
     return true;
 }
 
+static bool coroutine_fn
+virtio_blk_sect_range_ok(BlockBackend *blk, uint32_t block_size,
+                         uint64_t sector, size_t size)
+{
+    uint64_t total_sectors;
+
+    blk_co_get_geometry(blk, &total_sectors);
+    return virtio_blk_sect_range_valid(total_sectors, block_size, sector,
+                                       size);
+}
+
 static int coroutine_fn
 virtio_blk_discard_write_zeroes(VirtioBlkHandler *handler, struct iovec *iov,
                                 uint32_t iovcnt, uint32_t type)
@@ -239,3 +248,86 @@ int coroutine_fn virtio_blk_process_req(VirtioBlkHandler *handler,
 
     return in_len;
 }
+
+static void virtio_blk_rw_aio_complete(void *opaque, int ret)
+{
+    VirtioBlkAioReq *req = opaque;
+
+    *req->status = ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+    req->cb(req, req->in_len);
+}
+
+/*
+ * Starts a read or write request with blk_aio_preadv() or blk_aio_pwritev().
+ * Unlike virtio_blk_process_req() this does not need a coroutine, and neither
+ * does the block layer if the nodes support bdrv_aio_prwv_fast() (e.g. raw
+ * images on io_uring).
+ *
+ * Returns false without modifying anything if the request is not a read or
+ * write that can be handled this way; use virtio_blk_process_req() then.
+ * Otherwise @cb is called with the length of the in buffers once the request
+ * has completed, possibly before this function returns.
+ */
+bool virtio_blk_process_rw_aio(VirtioBlkHandler *handler,
+                               VirtioBlkAioReq *req,
+                               struct iovec *in_iov,
+                               struct iovec *out_iov,
+                               unsigned int in_num,
+                               unsigned int out_num,
+                               VirtioBlkAioCompleteFunc *cb)
+{
+    BlockBackend *blk = handler->blk;
+    struct virtio_blk_outhdr out;
+    uint64_t total_sectors;
+    int64_t sector_num;
+    uint32_t type;
+    bool is_write;
+
+    /* virtio_blk_process_req() reports malformed requests */
+    if (out_num < 1 || in_num < 1 ||
+        iov_to_buf(out_iov, out_num, 0, &out, sizeof(out)) != sizeof(out) ||
+        in_iov[in_num - 1].iov_len < sizeof(struct virtio_blk_inhdr)) {
+        return false;
+    }
+
+    type = le32_to_cpu(out.type) & ~VIRTIO_BLK_T_BARRIER;
+    is_write = type == VIRTIO_BLK_T_OUT;
+    if ((type != VIRTIO_BLK_T_IN && !is_write) ||
+        (is_write && !handler->writable)) {
+        return false;
+    }
+
+    iov_discard_front(&out_iov, &out_num, sizeof(out));
+
+    /* We always touch the last byte, so just see how big in_iov is. */
+    req->in_len = iov_size(in_iov, in_num);
+    req->status = (uint8_t *)in_iov[in_num - 1].iov_base
+                  + in_iov[in_num - 1].iov_len
+                  - sizeof(struct virtio_blk_inhdr);
+    iov_discard_back(in_iov, &in_num, sizeof(struct virtio_blk_inhdr));
+    req->cb = cb;
+
+    if (is_write) {
+        qemu_iovec_init_external(&req->qiov, out_iov, out_num);
+    } else {
+        qemu_iovec_init_external(&req->qiov, in_iov, in_num);
+    }
+
+    sector_num = le64_to_cpu(out.sector);
+    blk_get_geometry(blk, &total_sectors);
+    if (unlikely(!virtio_blk_sect_range_valid(total_sectors,
+                                              handler->logical_block_size,
+                                              sector_num, req->qiov.size))) {
+        virtio_blk_rw_aio_complete(req, -EINVAL);
+        return true;
+    }
+
+    if (is_write) {
+        blk_aio_pwritev(blk, sector_num << VIRTIO_BLK_SECTOR_BITS, &req->qiov,
+                        0, virtio_blk_rw_aio_complete, req);
+    } else {
+        blk_aio_preadv(blk, sector_num << VIRTIO_BLK_SECTOR_BITS, &req->qiov,
+                       0, virtio_blk_rw_aio_complete, req);
+    }
+    return true;
+}
@@ -28,10 +28,29 @@ typedef struct {
     bool writable;
 } VirtioBlkHandler;
 
+typedef struct VirtioBlkAioReq VirtioBlkAioReq;
+typedef void VirtioBlkAioCompleteFunc(VirtioBlkAioReq *req, int in_len);
+
+/* A request started with virtio_blk_process_rw_aio() */
+struct VirtioBlkAioReq {
+    QEMUIOVector qiov;
+    uint8_t *status;
+    int in_len;
+    VirtioBlkAioCompleteFunc *cb;
+};
+
 int coroutine_fn virtio_blk_process_req(VirtioBlkHandler *handler,
                                         struct iovec *in_iov,
                                         struct iovec *out_iov,
                                         unsigned int in_num,
                                         unsigned int out_num);
 
+bool virtio_blk_process_rw_aio(VirtioBlkHandler *handler,
+                               VirtioBlkAioReq *req,
+                               struct iovec *in_iov,
+                               struct iovec *out_iov,
+                               unsigned int in_num,
+                               unsigned int out_num,
+                               VirtioBlkAioCompleteFunc *cb);
+
 #endif /* VIRTIO_BLK_HANDLER_H */
@@ -35,6 +35,7 @@
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
+#include "qemu/interval-tree.h"
 #include "block/raw-aio.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
@@ -152,6 +153,15 @@ typedef struct BDRVRawState {
 
     uint64_t aio_max_batch;
 
+    /*
+     * Discard aggregation: pending discard ranges, merged when they touch,
+     * that are issued together once the batch delay expires.
+     */
+    uint64_t discard_batch_delay_ns;
+    QemuMutex discard_lock;
+    IntervalTreeRoot discard_ranges;
+    AioContext *discard_batch_ctx; /* non-NULL while a batch is pending */
+
     int perm_change_fd;
     int perm_change_flags;
     BDRVReopenState *reopen_state;
@@ -560,6 +570,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "discard-batch-delay",
+            .type = QEMU_OPT_NUMBER,
+            .help = "microseconds to wait for adjacent discard requests "
+                    "to merge them (0 = disabled, default: 0)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -641,6 +657,14 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
 
+    s->discard_batch_delay_ns =
+        qemu_opt_get_number(opts, "discard-batch-delay", 0) * SCALE_US;
+    if (s->discard_batch_delay_ns > NANOSECONDS_PER_SECOND) {
+        error_setg(errp, "discard-batch-delay must not exceed one second");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
                               ON_OFF_AUTO_AUTO, &local_err);
@@ -805,6 +829,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+    qemu_mutex_init(&s->discard_lock);
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2578,6 +2603,30 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, int64_t offset,
     return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_WRITE);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Aligned reads and writes are submitted on the event loop's io_uring and
+ * complete with a callback, without entering a coroutine.
+ */
+static bool raw_aio_prwv_fast(BlockDriverState *bs, int64_t offset,
+                              int64_t bytes, QEMUIOVector *qiov, bool is_write,
+                              BlockCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (!s->use_linux_io_uring || s->fd < 0 ||
+        bs->bl.zoned != BLK_Z_NONE ||
+        !aio_has_io_uring(qemu_get_current_aio_context()) ||
+        (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov))) {
+        return false;
+    }
+
+    luring_aio_submit(bs, s->fd, offset, qiov,
+                      is_write ? QEMU_AIO_WRITE : QEMU_AIO_READ, cb, opaque);
+    return true;
+}
+#endif
+
 static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -2607,6 +2656,9 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    assert(interval_tree_is_empty(&s->discard_ranges));
+    qemu_mutex_destroy(&s->discard_lock);
+
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
@@ -3536,13 +3588,13 @@ static int coroutine_fn raw_co_zone_append(BlockDriverState *bs,
 }
 #endif
 
+/* Discard without accounting, see raw_do_pdiscard() */
 static coroutine_fn int
-raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
-                bool blkdev)
+raw_submit_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                    bool blkdev)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
-    int ret;
 
     acb = (RawPosixAIOData) {
         .bs             = bs,
@@ -3556,14 +3608,158 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
-    ret = raw_thread_pool_submit(handle_aiocb_discard, &acb);
+    return raw_thread_pool_submit(handle_aiocb_discard, &acb);
+}
+
+static coroutine_fn int
+raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                bool blkdev)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    ret = raw_submit_pdiscard(bs, offset, bytes, blkdev);
     raw_account_discard(s, bytes, ret);
     return ret;
 }
 
+typedef struct RawDiscardReq {
+    Coroutine *co;
+    int64_t bytes;  /* of the request, for accounting */
+    int ret;
+    QSIMPLEQ_ENTRY(RawDiscardReq) next;
+} RawDiscardReq;
+
+typedef struct RawDiscardRange {
+    IntervalTreeNode node;
+    QSIMPLEQ_HEAD(, RawDiscardReq) reqs;
+} RawDiscardRange;
+
+/*
+ * Add a discard request to the pending batch, merging it with all pending
+ * ranges that overlap or are adjacent to it, unless the merged range would
+ * exceed max_pdiscard. Called with discard_lock held.
+ */
+static void raw_discard_batch_add(BlockDriverState *bs, RawDiscardReq *req,
+                                  int64_t offset, int64_t bytes)
+{
+    BDRVRawState *s = bs->opaque;
+    RawDiscardRange *range = g_new0(RawDiscardRange, 1);
+    uint64_t max_bytes = bs->bl.max_pdiscard ?: UINT64_MAX;
+    IntervalTreeNode *n;
+    uint64_t lo, hi;
+
+    range->node.start = offset;
+    range->node.last = offset + bytes - 1;
+    QSIMPLEQ_INIT(&range->reqs);
+    QSIMPLEQ_INSERT_TAIL(&range->reqs, req, next);
+
+restart:
+    lo = range->node.start ? range->node.start - 1 : 0;
+    hi = range->node.last + 1;
+    for (n = interval_tree_iter_first(&s->discard_ranges, lo, hi); n;
+         n = interval_tree_iter_next(n, lo, hi))
+    {
+        RawDiscardRange *other = container_of(n, RawDiscardRange, node);
+        uint64_t start = MIN(range->node.start, n->start);
+        uint64_t last = MAX(range->node.last, n->last);
+
+        if (last - start >= max_bytes) {
+            /* Neighbours on the other side may still fit */
+            continue;
+        }
+
+        interval_tree_remove(n, &s->discard_ranges);
+        range->node.start = start;
+        range->node.last = last;
+        QSIMPLEQ_CONCAT(&range->reqs, &other->reqs);
+        g_free(other);
+
+        /* The range has grown, so look for neighbours again */
+        goto restart;
+    }
+
+    interval_tree_insert(&range->node, &s->discard_ranges);
+}
+
+/*
+ * Guests trimming a large filesystem send many small discard requests in a
+ * short time. Instead of issuing one fallocate() or BLKDISCARD per request,
+ * the first request waits for discard_batch_delay_ns and then issues all
+ * requests that arrived in the meantime, with adjacent ranges merged.
+ * Requests only wait for a batch from their own AioContext; otherwise they
+ * are issued directly.
+ */
+static coroutine_fn int
+raw_co_pdiscard_batched(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                        bool blkdev)
+{
+    BDRVRawState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    RawDiscardReq req = { .co = qemu_coroutine_self(), .bytes = bytes };
+    IntervalTreeRoot batch;
+    IntervalTreeNode *n;
+    bool leader;
+
+    WITH_QEMU_LOCK_GUARD(&s->discard_lock) {
+        if (s->discard_batch_ctx && s->discard_batch_ctx != ctx) {
+            leader = false;
+            req.co = NULL;
+        } else {
+            leader = !s->discard_batch_ctx;
+            s->discard_batch_ctx = ctx;
+            raw_discard_batch_add(bs, &req, offset, bytes);
+        }
+    }
+
+    if (!req.co) {
+        return raw_do_pdiscard(bs, offset, bytes, blkdev);
+    }
+    if (!leader) {
+        /* Woken up by the leader once our range was discarded */
+        qemu_coroutine_yield();
+        return req.ret;
+    }
+
+    qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, s->discard_batch_delay_ns);
+
+    WITH_QEMU_LOCK_GUARD(&s->discard_lock) {
+        batch = s->discard_ranges;
+        s->discard_ranges = (IntervalTreeRoot) {};
+        s->discard_batch_ctx = NULL;
+    }
+
+    while ((n = interval_tree_iter_first(&batch, 0, UINT64_MAX))) {
+        RawDiscardRange *range = container_of(n, RawDiscardRange, node);
+        RawDiscardReq *r, *next_r;
+        int ret;
+
+        interval_tree_remove(n, &batch);
+        ret = raw_submit_pdiscard(bs, n->start, n->last - n->start + 1,
+                                  blkdev);
+
+        /* Statistics count the requests, not the merged ranges */
+        QSIMPLEQ_FOREACH_SAFE(r, &range->reqs, next, next_r) {
+            raw_account_discard(s, r->bytes, ret);
+            r->ret = ret;
+            if (r != &req) {
+                aio_co_wake(r->co);
+            }
+        }
+        g_free(range);
+    }
+
+    return req.ret;
+}
+
 static coroutine_fn int
 raw_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
 {
+    BDRVRawState *s = bs->opaque;
+
+    if (s->discard_batch_delay_ns) {
+        return raw_co_pdiscard_batched(bs, offset, bytes, false);
+    }
     return raw_do_pdiscard(bs, offset, bytes, false);
 }
 
@@ -3894,6 +4090,9 @@ BlockDriver bdrv_file = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_aio_prwv_fast     = raw_aio_prwv_fast,
+#endif
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
@@ -4227,6 +4426,9 @@ hdev_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
         raw_account_discard(s, bytes, ret);
         return ret;
     }
+    if (s->discard_batch_delay_ns) {
+        return raw_co_pdiscard_batched(bs, offset, bytes, true);
+    }
     return raw_do_pdiscard(bs, offset, bytes, true);
 }
 
@@ -4263,6 +4465,9 @@ static BlockDriver bdrv_host_device = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_aio_prwv_fast     = raw_aio_prwv_fast,
+#endif
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
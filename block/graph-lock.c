@@ -233,7 +233,30 @@ void coroutine_fn bdrv_graph_co_rdlock(void)
     }
 }
 
+bool bdrv_graph_rdlock_nowait(void)
+{
+    BdrvGraphRWlock *bdrv_graph;
+    bdrv_graph = qemu_get_current_aio_context()->bdrv_graph;
+
+    qatomic_set(&bdrv_graph->reader_count,
+                bdrv_graph->reader_count + 1);
+    /* make sure writer sees reader_count before we check has_writer */
+    smp_mb();
+
+    /* Same as the fast path of bdrv_graph_co_rdlock(), but never sleep */
+    if (qatomic_read(&has_writer)) {
+        bdrv_graph_rdunlock_nowait();
+        return false;
+    }
+    return true;
+}
+
 void coroutine_fn bdrv_graph_co_rdunlock(void)
+{
+    bdrv_graph_rdunlock_nowait();
+}
+
+void bdrv_graph_rdunlock_nowait(void)
 {
     BdrvGraphRWlock *bdrv_graph;
     bdrv_graph = qemu_get_current_aio_context()->bdrv_graph;
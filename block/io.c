@@ -600,14 +600,12 @@ static void coroutine_fn tracked_request_end(BdrvTrackedRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
-/**
- * Add an active request to the tracked requests list
- */
-static void coroutine_fn tracked_request_begin(BdrvTrackedRequest *req,
-                                               BlockDriverState *bs,
-                                               int64_t offset,
-                                               int64_t bytes,
-                                               enum BdrvTrackedRequestType type)
+static void tracked_request_init(BdrvTrackedRequest *req,
+                                 BlockDriverState *bs,
+                                 int64_t offset,
+                                 int64_t bytes,
+                                 enum BdrvTrackedRequestType type,
+                                 Coroutine *co)
 {
     bdrv_check_request(offset, bytes, &error_abort);
 
@@ -616,13 +614,25 @@ static void coroutine_fn tracked_request_begin(BdrvTrackedRequest *req,
         .offset         = offset,
         .bytes          = bytes,
         .type           = type,
-        .co             = qemu_coroutine_self(),
+        .co             = co,
         .serialising    = false,
         .overlap_offset = offset,
         .overlap_bytes  = bytes,
     };
 
     qemu_co_queue_init(&req->wait_queue);
+}
+
+/**
+ * Add an active request to the tracked requests list
+ */
+static void coroutine_fn tracked_request_begin(BdrvTrackedRequest *req,
+                                               BlockDriverState *bs,
+                                               int64_t offset,
+                                               int64_t bytes,
+                                               enum BdrvTrackedRequestType type)
+{
+    tracked_request_init(req, bs, offset, bytes, type, qemu_coroutine_self());
 
     qemu_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
@@ -2301,6 +2311,135 @@ out:
     return ret;
 }
 
+typedef struct BdrvFastRequest {
+    BdrvChild *child;
+    BdrvTrackedRequest req;
+    BlockCompletionFunc *cb;
+    void *opaque;
+} BdrvFastRequest;
+
+static void bdrv_aio_prwv_fast_cb(void *opaque, int ret)
+{
+    BdrvFastRequest *fr = opaque;
+    BlockDriverState *bs = fr->child->bs;
+    BdrvTrackedRequest *req = &fr->req;
+
+    if (req->type == BDRV_TRACKED_WRITE) {
+        /* The fast path never extends the image, see bdrv_aio_prwv_fast() */
+        qatomic_inc(&bs->write_gen);
+        stat64_max(&bs->wr_highest_offset, req->offset + req->bytes);
+        bdrv_set_dirty(bs, req->offset, req->bytes);
+    }
+
+    qemu_mutex_lock(&bs->reqs_lock);
+    QLIST_REMOVE(req, list);
+    qemu_mutex_unlock(&bs->reqs_lock);
+
+    /*
+     * Serialising requests that started after us may be waiting for this
+     * request.  We are not in coroutine context, so enter them directly.
+     */
+    qemu_co_enter_all(&req->wait_queue, NULL);
+
+    bdrv_dec_in_flight(bs);
+    fr->cb(fr->opaque, ret);
+    g_free(fr);
+}
+
+/*
+ * Submit a plain read or write without entering a coroutine.  This is only
+ * possible if the request needs none of the processing that
+ * bdrv_co_preadv_part() and bdrv_co_pwritev_part() can add on top of calling
+ * the driver: padding, fragmentation, copy-on-read, zero detection, waiting
+ * for serialising requests or growing the image.  The request is still
+ * tracked so that serialising requests submitted later wait for it, and it is
+ * accounted as in flight so that drained sections wait for it.
+ *
+ * Returns false without side effects if the caller must take the coroutine
+ * path.  Otherwise @cb is called once the request completes, but never before
+ * this function returns.
+ */
+bool bdrv_aio_prwv_fast(BdrvChild *child, int64_t offset, int64_t bytes,
+                        QEMUIOVector *qiov, BdrvRequestFlags flags,
+                        bool is_write, BlockCompletionFunc *cb, void *opaque)
+{
+    BlockDriverState *bs = child->bs;
+    BlockDriver *drv = bs->drv;
+    int64_t max_transfer;
+    BdrvFastRequest *fr;
+    IO_CODE();
+
+    if (!drv || !drv->bdrv_aio_prwv_fast || flags) {
+        return false;
+    }
+
+    if (bytes == 0 || qiov->size != bytes ||
+        bdrv_check_request32(offset, bytes, qiov, 0) < 0 ||
+        !QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment) ||
+        offset + bytes > bs->total_sectors * BDRV_SECTOR_SIZE) {
+        return false;
+    }
+
+    max_transfer = QEMU_ALIGN_DOWN(MIN_NON_ZERO(bs->bl.max_transfer, INT_MAX),
+                                   bs->bl.request_alignment);
+    if (bytes > max_transfer) {
+        return false;
+    }
+
+    if (is_write) {
+        /* bdrv_co_write_req_prepare() asserts that the node is active */
+        if (bdrv_is_read_only(bs) || bs->detect_zeroes ||
+            (bs->open_flags & BDRV_O_INACTIVE)) {
+            return false;
+        }
+    } else if (qatomic_read(&bs->copy_on_read)) {
+        return false;
+    }
+
+    fr = g_new(BdrvFastRequest, 1);
+    fr->child = child;
+    fr->cb = cb;
+    fr->opaque = opaque;
+
+    /* Checking quiesce_counter after this makes the check race-free */
+    bdrv_inc_in_flight(bs);
+    if (qatomic_read(&bs->quiesce_counter)) {
+        goto fail;
+    }
+
+    qemu_mutex_lock(&bs->reqs_lock);
+    if (qatomic_read(&bs->serialising_in_flight)) {
+        qemu_mutex_unlock(&bs->reqs_lock);
+        goto fail;
+    }
+    tracked_request_init(&fr->req, bs, offset, bytes,
+                         is_write ? BDRV_TRACKED_WRITE : BDRV_TRACKED_READ,
+                         NULL);
+    QLIST_INSERT_HEAD(&bs->tracked_requests, &fr->req, list);
+    qemu_mutex_unlock(&bs->reqs_lock);
+
+    if (is_write) {
+        assert(child->perm & BLK_PERM_WRITE);
+        bdrv_write_threshold_check_write(bs, offset, bytes);
+    }
+
+    if (!drv->bdrv_aio_prwv_fast(bs, offset, bytes, qiov, is_write,
+                                 bdrv_aio_prwv_fast_cb, fr)) {
+        qemu_mutex_lock(&bs->reqs_lock);
+        QLIST_REMOVE(&fr->req, list);
+        qemu_mutex_unlock(&bs->reqs_lock);
+        qemu_co_enter_all(&fr->req.wait_queue, NULL);
+        goto fail;
+    }
+
+    return true;
+
+fail:
+    bdrv_dec_in_flight(bs);
+    g_free(fr);
+    return false;
+}
+
 int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                                        int64_t bytes, BdrvRequestFlags flags)
 {
@@ -40,6 +40,13 @@ typedef struct LuringAIOCB {
      */
     int total_read;
     QEMUIOVector resubmit_qiov;
+
+    /* Only used when submitting on the AioContext's ring, see aio_add_sqe() */
+    CqeHandler cqe_handler;
+
+    /* Completion callback for requests without a coroutine (@co is NULL) */
+    BlockCompletionFunc *cb;
+    void *opaque;
 } LuringAIOCB;
 
 typedef struct LuringQueue {
@@ -60,14 +67,29 @@ struct LuringState {
     QEMUBH *completion_bh;
 };
 
+static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
+{
+    LuringAIOCB *luringcb = opaque;
+
+    *sqe = luringcb->sqeq;
+}
+
 /**
  * luring_resubmit:
  *
  * Resubmit a request by appending it to submit_queue.  The caller must ensure
  * that ioq_submit() is called later so that submit_queue requests are started.
+ *
+ * Requests that were submitted on the AioContext's ring (@s is NULL) are
+ * simply added to that ring again.
  */
 static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
 {
+    if (!s) {
+        aio_add_sqe(luring_prep_sqe, luringcb, &luringcb->cqe_handler);
+        return;
+    }
+
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
 }
@@ -108,6 +130,92 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+/**
+ * luring_complete:
+ * @s: AIO state, or NULL if the request was submitted with aio_add_sqe()
+ * @luringcb: the request
+ * @ret: result from the cqe
+ *
+ * Resubmits the request if necessary, otherwise completes it and wakes up its
+ * coroutine or calls its completion callback.
+ */
+static void luring_complete(LuringState *s, LuringAIOCB *luringcb, int ret)
+{
+    /* total_read is non-zero only for resubmitted read requests */
+    int total_bytes = ret + luringcb->total_read;
+
+    if (ret < 0) {
+        /*
+         * Only writev/readv/fsync requests on regular files or host block
+         * devices are submitted. Therefore -EAGAIN is not expected but it's
+         * known to happen sometimes with Linux SCSI. Submit again and hope
+         * the request completes successfully.
+         *
+         * For more information, see:
+         * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
+         *
+         * If the code is changed to submit other types of requests in the
+         * future, then this workaround may need to be extended to deal with
+         * genuine -EAGAIN results that should not be resubmitted
+         * immediately.
+         */
+        if (ret == -EINTR || ret == -EAGAIN) {
+            luring_resubmit(s, luringcb);
+            return;
+        }
+    } else if (!luringcb->qiov) {
+        goto end;
+    } else if (total_bytes == luringcb->qiov->size) {
+        ret = 0;
+    /* Only read/write */
+    } else {
+        /* Short Read/Write */
+        if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                return;
+            } else {
+                /* Pad with zeroes */
+                qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                  luringcb->qiov->size - total_bytes);
+                ret = 0;
+            }
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+end:
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    if (!luringcb->co) {
+        luringcb->cb(luringcb->opaque, ret);
+        g_free(luringcb);
+        return;
+    }
+
+    /*
+     * If the coroutine is already entered it must be in ioq_submit()
+     * and will notice luringcb->ret has been filled in when it
+     * eventually runs later. Coroutines cannot be entered recursively
+     * so avoid doing that!
+     */
+    assert(!s || luringcb->co->ctx == s->aio_context);
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+}
+
+/* Completion of a request submitted on the AioContext's ring */
+static void luring_cqe_handler(CqeHandler *cqe_handler)
+{
+    LuringAIOCB *luringcb = container_of(cqe_handler, LuringAIOCB,
+                                         cqe_handler);
+
+    trace_luring_process_completion(NULL, luringcb, cqe_handler->cqe.res);
+    luring_complete(NULL, luringcb, cqe_handler->cqe.res);
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -124,7 +232,6 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
-    int total_bytes;
 
     defer_call_begin();
 
@@ -162,63 +269,7 @@ static void luring_process_completions(LuringState *s)
         s->io_q.in_flight--;
         trace_luring_process_completion(s, luringcb, ret);
 
-        /* total_read is non-zero only for resubmitted read requests */
-        total_bytes = ret + luringcb->total_read;
-
-        if (ret < 0) {
-            /*
-             * Only writev/readv/fsync requests on regular files or host block
-             * devices are submitted. Therefore -EAGAIN is not expected but it's
-             * known to happen sometimes with Linux SCSI. Submit again and hope
-             * the request completes successfully.
-             *
-             * For more information, see:
-             * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
-             *
-             * If the code is changed to submit other types of requests in the
-             * future, then this workaround may need to be extended to deal with
-             * genuine -EAGAIN results that should not be resubmitted
-             * immediately.
-             */
-            if (ret == -EINTR || ret == -EAGAIN) {
-                luring_resubmit(s, luringcb);
-                continue;
-            }
-        } else if (!luringcb->qiov) {
-            goto end;
-        } else if (total_bytes == luringcb->qiov->size) {
-            ret = 0;
-        /* Only read/write */
-        } else {
-            /* Short Read/Write */
-            if (luringcb->is_read) {
-                if (ret > 0) {
-                    luring_resubmit_short_read(s, luringcb, ret);
-                    continue;
-                } else {
-                    /* Pad with zeroes */
-                    qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
-                                      luringcb->qiov->size - total_bytes);
-                    ret = 0;
-                }
-            } else {
-                ret = -ENOSPC;
-            }
-        }
-end:
-        luringcb->ret = ret;
-        qemu_iovec_destroy(&luringcb->resubmit_qiov);
-
-        /*
-         * If the coroutine is already entered it must be in ioq_submit()
-         * and will notice luringcb->ret has been filled in when it
-         * eventually runs later. Coroutines cannot be entered recursively
-         * so avoid doing that!
-         */
-        assert(luringcb->co->ctx == s->aio_context);
-        if (!qemu_coroutine_entered(luringcb->co)) {
-            aio_co_wake(luringcb->co);
-        }
+        luring_complete(s, luringcb, ret);
     }
 
     qemu_bh_cancel(s->completion_bh);
@@ -327,7 +378,7 @@ static void luring_deferred_fn(void *opaque)
  * luring_do_submit:
  * @fd: file descriptor for I/O
  * @luringcb: AIO control block
- * @s: AIO state
+ * @s: AIO state, or NULL to submit on the AioContext's ring
  * @offset: offset for request
  * @type: type of request
  *
@@ -363,6 +414,12 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     }
     io_uring_sqe_set_data(sqes, luringcb);
 
+    if (!s) {
+        /* Submitted and completed by the event loop, no batching needed */
+        aio_add_sqe(luring_prep_sqe, luringcb, &luringcb->cqe_handler);
+        return 0;
+    }
+
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
     trace_luring_do_submit(s, s->io_q.blocked, s->io_q.in_queue,
@@ -384,13 +441,23 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
-    LuringState *s = aio_get_linux_io_uring(ctx);
+    LuringState *s = NULL;
     LuringAIOCB luringcb = {
         .co         = qemu_coroutine_self(),
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
+        .cqe_handler.cb = luring_cqe_handler,
     };
+
+    /*
+     * Use the event loop's own ring if it has one.  The separate ring is still
+     * needed for AioContexts that run under the glib main loop.
+     */
+    if (!aio_has_io_uring(ctx)) {
+        s = aio_get_linux_io_uring(ctx);
+    }
+
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
     ret = luring_do_submit(fd, &luringcb, s, offset, type);
@@ -405,6 +472,37 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
     return luringcb.ret;
 }
 
+/**
+ * luring_aio_submit:
+ *
+ * Like luring_co_submit(), but completes the request by calling @cb instead
+ * of waking up a coroutine.  The request is always submitted on the
+ * AioContext's own ring, so this may only be used if aio_has_io_uring() is
+ * true for the current AioContext.  @cb is never called before this function
+ * returns.
+ */
+void luring_aio_submit(BlockDriverState *bs, int fd, uint64_t offset,
+                       QEMUIOVector *qiov, int type,
+                       BlockCompletionFunc *cb, void *opaque)
+{
+    LuringAIOCB *luringcb = g_new(LuringAIOCB, 1);
+
+    assert(aio_has_io_uring(qemu_get_current_aio_context()));
+
+    *luringcb = (LuringAIOCB) {
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+        .cqe_handler.cb = luring_cqe_handler,
+        .cb         = cb,
+        .opaque     = opaque,
+    };
+
+    trace_luring_co_submit(bs, NULL, luringcb, fd, offset,
+                           qiov ? qiov->size : 0, type);
+    luring_do_submit(fd, luringcb, NULL, offset, type);
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd,
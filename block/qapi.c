@@ -491,11 +491,32 @@ bdrv_latency_histogram_stats(BlockLatencyHistogram *hist)
     return info;
 }
 
+static BlockLatencyPercentiles *
+bdrv_latency_percentiles(BlockAcctStats *stats, int queue,
+                         enum BlockAcctType type)
+{
+    BlockAcctPercentiles pct;
+    BlockLatencyPercentiles *info;
+
+    if (!block_acct_latency_percentiles(stats, queue, type, &pct)) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyPercentiles, 1);
+    info->count = pct.count;
+    info->p50 = pct.p50;
+    info->p99 = pct.p99;
+    info->p999 = pct.p999;
+    info->max = pct.max;
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
     BlockLatencyHistogram *hgram;
+    int nb_queues, i;
 
     ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
     ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
@@ -586,6 +607,33 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
         = bdrv_latency_histogram_stats(&hgram[BLOCK_ACCT_ZONE_APPEND]);
     ds->flush_latency_histogram
         = bdrv_latency_histogram_stats(&hgram[BLOCK_ACCT_FLUSH]);
+
+    ds->rd_latency_percentiles =
+        bdrv_latency_percentiles(stats, -1, BLOCK_ACCT_READ);
+    ds->wr_latency_percentiles =
+        bdrv_latency_percentiles(stats, -1, BLOCK_ACCT_WRITE);
+    ds->flush_latency_percentiles =
+        bdrv_latency_percentiles(stats, -1, BLOCK_ACCT_FLUSH);
+
+    nb_queues = block_acct_nb_queues(stats);
+    for (i = nb_queues - 1; i >= 0; i--) {
+        BlockQueueStats *qs = g_new0(BlockQueueStats, 1);
+
+        qs->queue = i;
+        qs->rd_latency_percentiles =
+            bdrv_latency_percentiles(stats, i, BLOCK_ACCT_READ);
+        qs->wr_latency_percentiles =
+            bdrv_latency_percentiles(stats, i, BLOCK_ACCT_WRITE);
+        qs->flush_latency_percentiles =
+            bdrv_latency_percentiles(stats, i, BLOCK_ACCT_FLUSH);
+        if (!qs->rd_latency_percentiles && !qs->wr_latency_percentiles &&
+            !qs->flush_latency_percentiles) {
+            qapi_free_BlockQueueStats(qs);
+            continue;
+        }
+        QAPI_LIST_PREPEND(ds->queue_stats, qs);
+    }
+    ds->has_queue_stats = !!ds->queue_stats;
 }
 
 static BlockStats * GRAPH_RDLOCK
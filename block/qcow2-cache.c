@@ -33,6 +33,7 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    bool     loading;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -44,6 +45,7 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+    CoQueue                 loading_queue;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -134,6 +136,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    qemu_co_queue_init(&c->loading_queue);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
@@ -328,8 +331,8 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     int i;
     int ret;
     int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
+    uint64_t min_lru_counter;
+    int min_lru_index;
 
     assert(offset != 0);
 
@@ -343,11 +346,21 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         return -EIO;
     }
 
+retry:
+    min_lru_counter = UINT64_MAX;
+    min_lru_index = -1;
+
     /* Check if the table is already cached */
     i = lookup_index = (offset / c->table_size * 4) % c->size;
     do {
         const Qcow2CachedTable *t = &c->entries[i];
         if (t->offset == offset) {
+            if (t->loading) {
+                /* Only coroutines load tables, see qcow2_cache_reserve() */
+                assert(qemu_in_coroutine());
+                qemu_co_queue_wait(&c->loading_queue, &s->lock);
+                goto retry;
+            }
             goto found;
         }
         if (t->ref == 0 && t->lru_counter < min_lru_counter) {
@@ -415,6 +428,73 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/*
+ * Reserves a cache entry for the table at @offset without reading it, so
+ * that the caller can load the table with s->lock dropped. Until the caller
+ * completes the entry with qcow2_cache_load_done(), lookups of @offset wait
+ * for it and the entry can't be evicted.
+ *
+ * Nothing is reserved if the table is cached already or if the entry might
+ * be needed by requests running while the lock is dropped.
+ *
+ * Called with s->lock held. Returns 1 and the entry in *table if it has
+ * been reserved, 0 if not and -errno on failure.
+ */
+int coroutine_fn
+qcow2_cache_reserve(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                    void **table)
+{
+    int i, unused = 0;
+    int ret;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].offset == offset) {
+            return 0;
+        }
+        if (c->entries[i].ref == 0) {
+            unused++;
+        }
+    }
+
+    /* A request can hold up to two tables at a time (see l2_allocate()) */
+    if (unused < 3) {
+        return 0;
+    }
+
+    ret = qcow2_cache_get_empty(bs, c, offset, table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    c->entries[qcow2_cache_get_table_idx(c, *table)].loading = true;
+    return 1;
+}
+
+/*
+ * Completes an entry reserved with qcow2_cache_reserve() and releases the
+ * reference to it. If @valid is false, the entry is dropped again instead
+ * of being made visible.
+ *
+ * Called with s->lock held.
+ */
+void coroutine_fn qcow2_cache_load_done(Qcow2Cache *c, void **table,
+                                        bool valid)
+{
+    int i = qcow2_cache_get_table_idx(c, *table);
+
+    assert(c->entries[i].loading);
+    c->entries[i].loading = false;
+    qcow2_cache_put(c, table);
+
+    if (!valid) {
+        assert(c->entries[i].ref == 0);
+        c->entries[i].offset = 0;
+        c->entries[i].lru_counter = 0;
+    }
+
+    qemu_co_queue_restart_all(&c->loading_queue);
+}
+
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
@@ -441,7 +521,11 @@ void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
     int i;
 
     for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
+        /*
+         * Tables that are being loaded are dropped by
+         * qcow2_cache_load_done() if they become invalid
+         */
+        if (c->entries[i].offset == offset && !c->entries[i].loading) {
             return qcow2_cache_get_table_addr(c, i);
         }
     }
@@ -742,6 +742,64 @@ fail:
     return ret;
 }
 
+/*
+ * qcow2_co_prefetch_l2_slice
+ *
+ * Load the L2 slice that maps the guest @offset into the L2 cache, so that
+ * a later qcow2_get_host_offset() for it doesn't have to wait for I/O.
+ * Nothing is done if there is no L2 table for @offset; an invalid L1 entry
+ * is left for qcow2_get_host_offset() to report.
+ *
+ * Called with s->lock held. The lock is dropped while the slice is read,
+ * lookups of the slice wait until it has been loaded.
+ *
+ * Returns 0 on success, -errno in failure case
+ */
+int coroutine_fn
+qcow2_co_prefetch_l2_slice(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, slice_offset, *l2_slice;
+    bool valid;
+    int ret;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return 0;
+    }
+
+    slice_offset = l2_offset + l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    ret = qcow2_cache_reserve(bs, s->l2_table_cache, slice_offset,
+                              (void **)&l2_slice);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    trace_qcow2_prefetch_l2_slice(qemu_coroutine_self(), offset,
+                                  slice_offset);
+
+    qemu_co_mutex_unlock(&s->lock);
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_L2_LOAD);
+    ret = bdrv_co_pread(bs->file, slice_offset,
+                        s->l2_slice_size * l2_entry_size(s), l2_slice, 0);
+    qemu_co_mutex_lock(&s->lock);
+
+    /* The L2 table may have been freed in the meantime */
+    valid = ret >= 0 && l1_index < s->l1_size &&
+            (s->l1_table[l1_index] & L1E_OFFSET_MASK) == l2_offset;
+    qcow2_cache_load_done(s->l2_table_cache, (void **)&l2_slice, valid);
+
+    trace_qcow2_prefetch_l2_slice_done(qemu_coroutine_self(), slice_offset,
+                                       ret);
+    return ret;
+}
+
 /*
  * get_cluster_table
  *
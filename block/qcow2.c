@@ -321,7 +321,7 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, QCOW2_MAX_THREADS, errp);
+                                           bs, cflags, s->max_threads, errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
@@ -1328,6 +1328,14 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     bool update_header = false;
 
+    /*
+     * Compression and encryption are CPU bound, so allow one task per host
+     * CPU. This must be set before the crypto layer is opened because it
+     * allocates one cipher per thread.
+     */
+    s->max_threads = MIN(MAX((int)g_get_num_processors(), QCOW2_MAX_THREADS),
+                         QCOW2_MAX_THREADS_LIMIT);
+
     ret = bdrv_co_pread(bs->file, 0, sizeof(header), &header, 0);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not read qcow2 header");
@@ -1702,7 +1710,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            NULL, NULL, cflags,
-                                           QCOW2_MAX_THREADS, errp);
+                                           s->max_threads, errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
@@ -2369,6 +2377,66 @@ static int coroutine_fn GRAPH_RDLOCK qcow2_co_preadv_task_entry(AioTask *task)
                                 t->qiov, t->qiov_offset);
 }
 
+static void coroutine_fn qcow2_prefetch_l2_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+
+    GRAPH_RDLOCK_GUARD();
+
+    qemu_co_mutex_lock(&s->lock);
+    /* Errors are reported once the guest actually reads from there */
+    qcow2_co_prefetch_l2_slice(bs, s->l2_prefetch_offset);
+    s->l2_prefetch_in_flight = false;
+    qemu_co_mutex_unlock(&s->lock);
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Detect sequential reads and, for those, load the L2 slice following the
+ * one that the request ends in from a separate coroutine, so that the L2
+ * lookup doesn't stall the read stream when it gets there.
+ *
+ * Called with s->lock held.
+ */
+static void coroutine_fn
+qcow2_detect_sequential_read(BlockDriverState *bs, uint64_t offset,
+                             uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t)s->l2_slice_size << s->cluster_bits;
+    uint64_t next_slice;
+    Coroutine *co;
+
+    if (offset != s->seq_read_end) {
+        s->seq_read_count = 0;
+    } else if (s->seq_read_count < QCOW2_SEQ_READ_THRESHOLD) {
+        s->seq_read_count++;
+    }
+    s->seq_read_end = offset + bytes;
+
+    if (s->seq_read_count < QCOW2_SEQ_READ_THRESHOLD ||
+        s->l2_prefetch_in_flight)
+    {
+        return;
+    }
+
+    next_slice = QEMU_ALIGN_DOWN(offset + bytes, slice_bytes) + slice_bytes;
+    if (next_slice == s->l2_prefetch_offset ||
+        next_slice >= bs->total_sectors * BDRV_SECTOR_SIZE)
+    {
+        return;
+    }
+
+    s->l2_prefetch_offset = next_slice;
+    s->l2_prefetch_in_flight = true;
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_prefetch_l2_entry, bs);
+    aio_co_schedule(bdrv_get_aio_context(bs), co);
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                      QEMUIOVector *qiov, size_t qiov_offset,
@@ -2377,21 +2445,50 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     BDRVQcow2State *s = bs->opaque;
     int ret = 0;
     unsigned int cur_bytes; /* number of bytes in current iteration */
-    uint64_t host_offset = 0;
-    QCow2SubclusterType type;
+    unsigned int max_bytes, next_bytes;
+    uint64_t host_offset = 0, next_host_offset;
+    QCow2SubclusterType type, next_type;
     AioTaskPool *aio = NULL;
+    bool first = true;
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
         /* prepare next request */
-        cur_bytes = MIN(bytes, INT_MAX);
+        max_bytes = MIN(bytes, INT_MAX);
         if (s->crypto) {
-            cur_bytes = MIN(cur_bytes,
+            max_bytes = MIN(max_bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
+        cur_bytes = max_bytes;
 
         qemu_co_mutex_lock(&s->lock);
+        if (first) {
+            qcow2_detect_sequential_read(bs, offset, bytes);
+            first = false;
+        }
         ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
                                     &host_offset, &type);
+
+        /*
+         * qcow2_get_host_offset() stops at the end of each L2 slice. If the
+         * data continues contiguously in the image file beyond it, merge the
+         * extents into one request.
+         */
+        while (ret == 0 && type == QCOW2_SUBCLUSTER_NORMAL && !bs->encrypted &&
+               cur_bytes < max_bytes &&
+               offset_to_l2_slice_index(s, offset + cur_bytes) == 0 &&
+               offset_into_cluster(s, offset + cur_bytes) == 0)
+        {
+            next_bytes = max_bytes - cur_bytes;
+            if (qcow2_get_host_offset(bs, offset + cur_bytes, &next_bytes,
+                                      &next_host_offset, &next_type) < 0 ||
+                next_type != QCOW2_SUBCLUSTER_NORMAL ||
+                next_host_offset != host_offset + cur_bytes)
+            {
+                /* Errors are reported by the lookup in the next iteration */
+                break;
+            }
+            cur_bytes += next_bytes;
+        }
         qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto out;
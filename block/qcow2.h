@@ -71,6 +71,12 @@
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
+/*
+ * Number of back-to-back reads after which a read stream is considered
+ * sequential and the next L2 slice is prefetched
+ */
+#define QCOW2_SEQ_READ_THRESHOLD 4
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -324,6 +330,13 @@ typedef struct Qcow2BitmapHeaderExt {
 
 #define QCOW2_MAX_THREADS 4
 
+/*
+ * Upper bound for the number of parallel compression/encryption tasks on
+ * hosts with many CPUs. The actual limit is chosen on open, see
+ * BDRVQcow2State.max_threads.
+ */
+#define QCOW2_MAX_THREADS_LIMIT 64
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -348,6 +361,12 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Sequential read detection and L2 prefetching, protected by lock */
+    uint64_t seq_read_end;
+    unsigned seq_read_count;
+    uint64_t l2_prefetch_offset;
+    bool l2_prefetch_in_flight;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -410,6 +429,11 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    /*
+     * Maximum number of tasks submitted to the thread pool at once, at least
+     * QCOW2_MAX_THREADS and scaled with the number of host CPUs.
+     */
+    int max_threads;
 
     BdrvChild *data_file;
 
@@ -932,6 +956,9 @@ qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
                       QCow2SubclusterType *subcluster_type);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_prefetch_l2_slice(BlockDriverState *bs, uint64_t offset);
+
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                         unsigned int *bytes, uint64_t *host_offset,
@@ -1018,6 +1045,12 @@ int GRAPH_RDLOCK
 qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                       void **table);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_cache_reserve(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                    void **table);
+void coroutine_fn qcow2_cache_load_done(Qcow2Cache *c, void **table,
+                                        bool valid);
+
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
@@ -282,6 +282,25 @@ fail:
     return ret;
 }
 
+static bool GRAPH_RDLOCK
+raw_aio_prwv_fast(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                  QEMUIOVector *qiov, bool is_write,
+                  BlockCompletionFunc *cb, void *opaque)
+{
+    /* Writes to the first sector of probed images need raw_co_pwritev() */
+    if (is_write && bs->probed && offset < BLOCK_PROBE_BUF_SIZE) {
+        return false;
+    }
+
+    /* Let the coroutine path return the error */
+    if (raw_adjust_offset(bs, &offset, bytes, is_write)) {
+        return false;
+    }
+
+    return bdrv_aio_prwv_fast(bs->file, offset, bytes, qiov, 0, is_write,
+                              cb, opaque);
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 raw_co_block_status(BlockDriverState *bs, bool want_zero, int64_t offset,
                     int64_t bytes, int64_t *pnum, int64_t *map,
@@ -648,6 +667,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_create_opts  = &raw_co_create_opts,
     .bdrv_co_preadv       = &raw_co_preadv,
     .bdrv_co_pwritev      = &raw_co_pwritev,
+    .bdrv_aio_prwv_fast   = &raw_aio_prwv_fast,
     .bdrv_co_pwrite_zeroes = &raw_co_pwrite_zeroes,
     .bdrv_co_pdiscard     = &raw_co_pdiscard,
     .bdrv_co_zone_report  = &raw_co_zone_report,
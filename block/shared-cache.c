@@ -0,0 +1,606 @@
+/*
+ * Shared read cache filter block driver
+ *
+ * Copyright (c) 2024 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The filter caches clusters of a read-only node in a shared memory file
+ * (typically a memfd passed in with add-fd, or a file on tmpfs or hugetlbfs)
+ * that several QEMU processes map at the same time. When many VMs boot from
+ * the same base image, only the first one to touch a cluster reads it from
+ * storage, all others copy it from memory.
+ *
+ * Cache entries are keyed by an image identity and the guest offset of the
+ * cluster. The cache is set associative, every slot is protected by a
+ * sequence counter: a writer makes the counter odd while it updates a slot,
+ * and readers retry (or rather, fall back to reading from the image) if the
+ * counter is odd or has changed while they copied the data. No process ever
+ * waits for another one, except for the initialization of a new cache file.
+ *
+ * The header and the slots are accessed with 64-bit atomics by several
+ * processes, which needs them to be lock-free, so the driver is only built
+ * on 64-bit hosts.
+ *
+ * Every process that maps the cache file can change what the others read
+ * from it, and the cached data is not verified against the image, so the
+ * processes that share a cache file must trust each other.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+
+#define SHARED_CACHE_MAGIC 0x5143534843414348ULL /* "QCSHCACH" */
+#define SHARED_CACHE_VERSION 1
+
+#define SHARED_CACHE_WAYS 4
+#define SHARED_CACHE_HEADER_SIZE 4096
+
+/*
+ * How long to wait for another process to initialize the cache before
+ * assuming that it died and taking over
+ */
+#define SHARED_CACHE_INIT_TIMEOUT_US (5 * G_USEC_PER_SEC)
+
+/*
+ * The low bits of the state word hold the state, the others count the
+ * processes that started to initialize the cache, so that a process that
+ * takes over from a dead one can tell whether it is still the owner.
+ */
+enum {
+    SHARED_CACHE_STATE_NEW = 0,
+    SHARED_CACHE_STATE_INITIALIZING,
+    SHARED_CACHE_STATE_READY,
+};
+
+#define SHARED_CACHE_STATE_MASK 3
+#define SHARED_CACHE_OWNER_INC 4
+
+typedef struct SharedCacheHeader {
+    uint32_t state;
+    uint32_t version;
+    uint64_t magic;
+    uint64_t cluster_size;
+    uint64_t nb_sets;
+    uint64_t slots_offset;
+    uint64_t data_offset;
+    uint64_t clock;
+} SharedCacheHeader;
+
+QEMU_BUILD_BUG_ON(sizeof(SharedCacheHeader) > SHARED_CACHE_HEADER_SIZE);
+QEMU_BUILD_BUG_ON(ATOMIC_REG_SIZE < sizeof(uint64_t));
+
+typedef struct SharedCacheSlot {
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t image_id;  /* 0 for an empty slot */
+    uint64_t offset;
+    uint64_t stamp;     /* clock value of last use, for replacement */
+} SharedCacheSlot;
+
+typedef struct BDRVSharedCacheState {
+    int fd;
+    uint8_t *mem;
+    size_t mem_size;
+
+    SharedCacheHeader *header;
+    SharedCacheSlot *slots;
+    uint8_t *data;
+    uint64_t cluster_size;
+    uint64_t nb_sets;
+
+    uint64_t image_id;
+    int64_t image_size;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_CACHE_FILE "cache-file"
+#define SHARED_CACHE_OPT_CACHE_SIZE "cache-size"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+#define SHARED_CACHE_OPT_IMAGE_ID "image-id"
+
+static QemuOptsList runtime_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_CACHE_FILE,
+            .type = QEMU_OPT_STRING,
+            .help = "shared memory file that holds the cache",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cache if the cache file is empty, "
+                "default 256M",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "cache granularity if the cache file is empty, "
+                "default 64k",
+        },
+        {
+            .name = SHARED_CACHE_OPT_IMAGE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "identity of the cached image, shared by all processes "
+                "that use the same image (required)",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* 64-bit FNV-1a */
+static uint64_t shared_cache_hash(const char *str)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (; *str; str++) {
+        h ^= (uint8_t)*str;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static SharedCacheSlot *shared_cache_set(BDRVSharedCacheState *s,
+                                         uint64_t offset)
+{
+    uint64_t key = s->image_id ^ (offset / s->cluster_size);
+    uint64_t set;
+
+    key *= 0x9e3779b97f4a7c15ULL;
+    set = (key >> 32) % s->nb_sets;
+
+    return &s->slots[set * SHARED_CACHE_WAYS];
+}
+
+static uint8_t *shared_cache_slot_data(BDRVSharedCacheState *s,
+                                       SharedCacheSlot *slot)
+{
+    return s->data + (slot - s->slots) * s->cluster_size;
+}
+
+/*
+ * Copy @bytes at @offset_in_cluster from the cached cluster at @offset into
+ * @qiov. Returns true on a cache hit.
+ */
+static bool shared_cache_lookup(BDRVSharedCacheState *s, uint64_t offset,
+                                uint64_t offset_in_cluster, uint64_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheSlot *slot = shared_cache_set(s, offset);
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++, slot++) {
+        uint32_t seq = qatomic_load_acquire(&slot->seq);
+
+        if ((seq & 1) ||
+            qatomic_read(&slot->image_id) != s->image_id ||
+            qatomic_read(&slot->offset) != offset)
+        {
+            continue;
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            shared_cache_slot_data(s, slot) + offset_in_cluster,
+                            bytes);
+
+        smp_rmb();
+        if (qatomic_read(&slot->seq) != seq) {
+            /* Overwritten while we were copying */
+            return false;
+        }
+
+        qatomic_set(&slot->stamp, qatomic_read(&s->header->clock));
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Store the cluster at @offset in the cache, unless another process is busy
+ * with the slot that would be replaced.
+ */
+static void shared_cache_insert(BDRVSharedCacheState *s, uint64_t offset,
+                                const uint8_t *buf)
+{
+    SharedCacheSlot *slot = shared_cache_set(s, offset);
+    SharedCacheSlot *victim = NULL;
+    uint32_t seq;
+    int i;
+
+    /*
+     * Prefer empty slots, otherwise replace the least recently used one.
+     * Skip slots that are being written, a process that died while writing
+     * a slot must not keep the others of the set from being replaced.
+     */
+    for (i = 0; i < SHARED_CACHE_WAYS; i++, slot++) {
+        if (qatomic_read(&slot->seq) & 1) {
+            continue;
+        }
+        if (!qatomic_read(&slot->image_id)) {
+            victim = slot;
+            break;
+        }
+        if (!victim ||
+            qatomic_read(&slot->stamp) < qatomic_read(&victim->stamp)) {
+            victim = slot;
+        }
+    }
+    if (!victim) {
+        return;
+    }
+
+    seq = qatomic_read(&victim->seq);
+    if ((seq & 1) || qatomic_cmpxchg(&victim->seq, seq, seq + 1) != seq) {
+        return;
+    }
+    smp_wmb();
+
+    qatomic_set(&victim->image_id, s->image_id);
+    qatomic_set(&victim->offset, offset);
+    memcpy(shared_cache_slot_data(s, victim), buf, s->cluster_size);
+    qatomic_set(&victim->stamp, qatomic_fetch_inc(&s->header->clock) + 1);
+
+    qatomic_store_release(&victim->seq, seq + 2);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_preadv_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    while (bytes) {
+        uint64_t cluster_offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+        uint64_t offset_in_cluster = offset - cluster_offset;
+        uint64_t n = MIN(bytes, s->cluster_size - offset_in_cluster);
+        uint64_t cluster_bytes;
+
+        if (shared_cache_lookup(s, cluster_offset, offset_in_cluster, n,
+                                qiov, qiov_offset)) {
+            goto next;
+        }
+
+        if (!buf) {
+            buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+            if (!buf) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+
+        /*
+         * Read the whole cluster, but not beyond the end of the image. The
+         * request flags describe @qiov, not the bounce buffer.
+         */
+        cluster_bytes = MIN(s->cluster_size, s->image_size - cluster_offset);
+        ret = bdrv_co_pread(bs->file, cluster_offset, cluster_bytes, buf, 0);
+        if (ret < 0) {
+            break;
+        }
+        memset(buf + cluster_bytes, 0, s->cluster_size - cluster_bytes);
+
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + offset_in_cluster, n);
+        shared_cache_insert(s, cluster_offset, buf);
+
+next:
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Set up an empty cache file, or wait until another process has done so.
+ * If that takes too long, the other process is assumed to have died and the
+ * cache file is set up again.
+ */
+static int shared_cache_init_mem(BDRVSharedCacheState *s,
+                                 uint64_t cluster_size, Error **errp)
+{
+    SharedCacheHeader *h = s->header;
+    uint32_t state, owner;
+    uint64_t nb_slots;
+    int64_t deadline;
+
+    deadline = g_get_monotonic_time() + SHARED_CACHE_INIT_TIMEOUT_US;
+    for (;;) {
+        state = qatomic_load_acquire(&h->state);
+        if ((state & SHARED_CACHE_STATE_MASK) == SHARED_CACHE_STATE_READY) {
+            break;
+        }
+        if ((state & SHARED_CACHE_STATE_MASK) != SHARED_CACHE_STATE_NEW &&
+            g_get_monotonic_time() <= deadline)
+        {
+            g_usleep(1000);
+            continue;
+        }
+
+        /* Whoever takes over first gets another full timeout */
+        deadline = g_get_monotonic_time() + SHARED_CACHE_INIT_TIMEOUT_US;
+        owner = (state & ~SHARED_CACHE_STATE_MASK) + SHARED_CACHE_OWNER_INC +
+                SHARED_CACHE_STATE_INITIALIZING;
+        if (qatomic_cmpxchg(&h->state, state, owner) != state) {
+            continue;
+        }
+
+        nb_slots = (s->mem_size - SHARED_CACHE_HEADER_SIZE) /
+                   (sizeof(SharedCacheSlot) + cluster_size);
+        h->nb_sets = nb_slots / SHARED_CACHE_WAYS;
+        h->cluster_size = cluster_size;
+        h->slots_offset = SHARED_CACHE_HEADER_SIZE;
+        h->data_offset = ROUND_UP(h->slots_offset + h->nb_sets *
+                                  SHARED_CACHE_WAYS * sizeof(SharedCacheSlot),
+                                  qemu_real_host_page_size());
+        /* Rounding up may have taken away the space for the last set */
+        while (h->nb_sets &&
+               h->data_offset + h->nb_sets * SHARED_CACHE_WAYS * cluster_size >
+               s->mem_size)
+        {
+            h->nb_sets--;
+        }
+        h->version = SHARED_CACHE_VERSION;
+        h->magic = SHARED_CACHE_MAGIC;
+
+        /*
+         * The slots are zeroed already: a new cache file reads as zeroes,
+         * and nothing touches them before the cache is ready. This fails if
+         * another process took over in the meantime; it publishes its own
+         * (identical, unless the cluster size differs) geometry then.
+         */
+        smp_wmb();
+        qatomic_cmpxchg(&h->state, owner,
+                        (owner & ~SHARED_CACHE_STATE_MASK) |
+                        SHARED_CACHE_STATE_READY);
+    }
+
+    if (h->magic != SHARED_CACHE_MAGIC) {
+        error_setg(errp, "Cache file is not a shared cache");
+        return -EINVAL;
+    }
+    if (h->version != SHARED_CACHE_VERSION) {
+        error_setg(errp, "Unsupported shared cache version %" PRIu32,
+                   h->version);
+        return -ENOTSUP;
+    }
+    if (!h->nb_sets || h->cluster_size < BDRV_SECTOR_SIZE ||
+        !is_power_of_2(h->cluster_size) ||
+        h->slots_offset < sizeof(*h) ||
+        h->data_offset < h->slots_offset +
+                         h->nb_sets * SHARED_CACHE_WAYS *
+                         sizeof(SharedCacheSlot) ||
+        h->data_offset + h->nb_sets * SHARED_CACHE_WAYS * h->cluster_size >
+        s->mem_size)
+    {
+        error_setg(errp, "Invalid shared cache geometry");
+        return -EINVAL;
+    }
+
+    s->cluster_size = h->cluster_size;
+    s->nb_sets = h->nb_sets;
+    s->slots = (SharedCacheSlot *)(s->mem + h->slots_offset);
+    s->data = s->mem + h->data_offset;
+
+    return 0;
+}
+
+static void shared_cache_free(BDRVSharedCacheState *s)
+{
+    if (s->mem) {
+        munmap(s->mem, s->mem_size);
+        s->mem = NULL;
+    }
+    if (s->fd >= 0) {
+        qemu_close(s->fd);
+        s->fd = -1;
+    }
+}
+
+static int shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *cache_file, *image_id;
+    g_autofree char *id = NULL;
+    uint64_t cache_size, cluster_size;
+    struct stat st;
+    int ret;
+
+    s->fd = -1;
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-cache filter only supports read-only "
+                   "nodes");
+        return -EINVAL;
+    }
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache_file = qemu_opt_get(opts, SHARED_CACHE_OPT_CACHE_FILE);
+    if (!cache_file) {
+        error_setg(errp, "Parameter '%s' is required",
+                   SHARED_CACHE_OPT_CACHE_FILE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    cache_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CACHE_SIZE,
+                                   256 * MiB);
+    cluster_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                                     64 * KiB);
+    if (cluster_size < BDRV_SECTOR_SIZE || cluster_size > 2 * MiB ||
+        !is_power_of_2(cluster_size))
+    {
+        error_setg(errp, "Cluster size must be a power of two between %llu "
+                   "and 2M", BDRV_SECTOR_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /*
+     * Nothing that QEMU can see tells whether two processes use the same
+     * image content: the same file name may refer to different files, and
+     * file names, inodes and modification times are not shared across hosts
+     * or preserved by copies. So leave it to the user.
+     */
+    image_id = qemu_opt_get(opts, SHARED_CACHE_OPT_IMAGE_ID);
+    if (!image_id) {
+        error_setg(errp, "Parameter '%s' is required",
+                   SHARED_CACHE_OPT_IMAGE_ID);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->image_size = bdrv_getlength(bs->file->bs);
+    if (s->image_size < 0) {
+        error_setg_errno(errp, -s->image_size, "Could not get image size");
+        ret = s->image_size;
+        goto fail;
+    }
+
+    /* At least catch a reused identity if the image size differs */
+    id = g_strdup_printf("%s:%" PRId64, image_id, s->image_size);
+    s->image_id = shared_cache_hash(id) ?: 1;
+
+    s->fd = qemu_open(cache_file, O_RDWR, errp);
+    if (s->fd < 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat cache file");
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        if (ftruncate(s->fd, cache_size) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not resize cache file");
+            goto fail;
+        }
+        if (fstat(s->fd, &st) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not stat cache file");
+            goto fail;
+        }
+    }
+    if (st.st_size < SHARED_CACHE_HEADER_SIZE) {
+        error_setg(errp, "Cache file is too small");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->mem_size = st.st_size;
+    s->mem = mmap(NULL, s->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    if (s->mem == MAP_FAILED) {
+        s->mem = NULL;
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map cache file");
+        goto fail;
+    }
+    s->header = (SharedCacheHeader *)s->mem;
+
+    ret = shared_cache_init_mem(s, cluster_size, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_opts_del(opts);
+    return 0;
+
+fail:
+    qemu_opts_del(opts);
+    shared_cache_free(s);
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    shared_cache_free(bs->opaque);
+}
+
+static int shared_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                       BlockReopenQueue *queue, Error **errp)
+{
+    if (reopen_state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-cache filter only supports read-only "
+                   "nodes");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+shared_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                    BdrvChildRole role,
+                                    BlockReopenQueue *reopen_queue,
+                                    uint64_t perm, uint64_t shared,
+                                    uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                       nperm, nshared);
+
+    /* Cached data must not change under our feet */
+    *nperm |= BLK_PERM_CONSISTENT_READ;
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static BlockDriver bdrv_shared_cache = {
+    .format_name                        = "shared-cache",
+    .instance_size                      = sizeof(BDRVSharedCacheState),
+
+    .bdrv_open                          = shared_cache_open,
+    .bdrv_close                         = shared_cache_close,
+    .bdrv_reopen_prepare                = shared_cache_reopen_prepare,
+    .bdrv_child_perm                    = shared_cache_child_perm,
+
+    .bdrv_co_getlength                  = shared_cache_co_getlength,
+    .bdrv_co_preadv_part                = shared_cache_co_preadv_part,
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache);
+}
+
+block_init(bdrv_shared_cache_init);
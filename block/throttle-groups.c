@@ -39,6 +39,12 @@ static void throttle_group_obj_init(Object *obj);
 static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
 static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction);
 
+/* Time slice worth of I/O that a member reserves in advance when the group
+ * is not throttled, so that its next requests don't need to take the group
+ * lock.
+ */
+#define THROTTLE_GROUP_CREDIT_NS (1 * SCALE_MS)
+
 /* The ThrottleGroup structure (with its ThrottleState) is shared
  * among different ThrottleGroupMembers and it's independent from
  * AioContext, so in order to use it from different threads it needs
@@ -62,6 +68,11 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * To keep the lock out of the I/O path, a member that finds the group
+ * unthrottled reserves a short time slice worth of I/O in advance (see
+ * throttle_reserve()).  Its following requests consume that credit without
+ * taking the lock, until it runs out or the configuration changes.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -77,6 +88,9 @@ struct ThrottleGroup {
     bool any_timer_armed[THROTTLE_MAX];
     QEMUClockType clock_type;
 
+    /* Incremented under the lock to invalidate the members' credit */
+    unsigned credit_gen;
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 };
@@ -350,6 +364,75 @@ static void coroutine_mixed_fn schedule_next_request(ThrottleGroupMember *tgm,
     }
 }
 
+/* Consume reserved credit for an I/O request, if the member has enough.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @direction: the ThrottleDirection
+ * @ret:       whether the request can be performed right away
+ */
+static bool throttle_group_use_credit(ThrottleGroupMember *tgm,
+                                      int64_t bytes,
+                                      ThrottleDirection direction)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    double units = 1.0;
+
+    if (tgm->credit_gen != qatomic_read(&tg->credit_gen) ||
+        qatomic_read(&tgm->pending_reqs[direction])) {
+        return false;
+    }
+
+    if (tgm->credit_op_size && bytes > tgm->credit_op_size) {
+        units = (double) bytes / tgm->credit_op_size;
+    }
+    if (tgm->credit_bytes[direction] < bytes ||
+        tgm->credit_units[direction] < units) {
+        return false;
+    }
+
+    tgm->credit_bytes[direction] -= bytes;
+    tgm->credit_units[direction] -= units;
+    return true;
+}
+
+/* Reserve credit for the next requests of a ThrottleGroupMember if nobody
+ * in the group is waiting for a timer.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_refill_credit(ThrottleGroupMember *tgm,
+                                         ThrottleDirection direction)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    uint64_t bytes;
+    double units;
+
+    if (tgm->credit_gen != tg->credit_gen) {
+        memset(tgm->credit_bytes, 0, sizeof(tgm->credit_bytes));
+        memset(tgm->credit_units, 0, sizeof(tgm->credit_units));
+        tgm->credit_op_size = ts->cfg.op_size;
+        tgm->credit_gen = tg->credit_gen;
+    }
+
+    if (tg->any_timer_armed[direction] || tgm->pending_reqs[direction] ||
+        qatomic_read(&tgm->io_limits_disabled)) {
+        return;
+    }
+
+    if (throttle_reserve(ts, direction, THROTTLE_GROUP_CREDIT_NS,
+                         &bytes, &units)) {
+        tgm->credit_bytes[direction] =
+            bytes > UINT64_MAX - tgm->credit_bytes[direction] ?
+            UINT64_MAX : tgm->credit_bytes[direction] + bytes;
+        tgm->credit_units[direction] += units;
+    }
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -369,6 +452,10 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     assert(bytes >= 0);
     assert(direction < THROTTLE_MAX);
 
+    if (throttle_group_use_credit(tgm, bytes, direction)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -393,6 +480,8 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, direction);
 
+    throttle_group_refill_credit(tgm, direction);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -478,6 +567,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    qatomic_inc(&tg->credit_gen);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -551,6 +641,10 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
     qatomic_set(&tgm->restart_pending, 0);
+    memset(tgm->credit_bytes, 0, sizeof(tgm->credit_bytes));
+    memset(tgm->credit_units, 0, sizeof(tgm->credit_units));
+    tgm->credit_op_size = 0;
+    tgm->credit_gen = tg->credit_gen;
 
     QEMU_LOCK_GUARD(&tg->lock);
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
@@ -903,6 +997,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
         goto unlock;
     }
     throttle_config(&tg->ts, tg->clock_type, &cfg);
+    qatomic_inc(&tg->credit_gen);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
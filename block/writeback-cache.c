@@ -0,0 +1,1165 @@
+/*
+ * Write-back cache filter block driver
+ *
+ * Copyright (c) 2024 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The filter completes guest writes as soon as they are persisted in a
+ * journal on fast local storage, and writes them back to its (slow, usually
+ * remote) file child in the background. Guest flushes only flush the
+ * journal. Reads return the newest data, taking journalled writes that have
+ * not been written back yet into account.
+ *
+ * The journal is a ring buffer of records, each consisting of one header
+ * block followed by the data of the write. Records carry an increasing
+ * sequence number and a checksum of their data, so that after a crash the
+ * journal can be replayed from the last written back record to the first one
+ * that was not completely written. Records are written back strictly in
+ * order, and their space is only reused after the file child has been
+ * flushed and the new start of the journal has been persisted.
+ *
+ * Every time the journal is opened, it gets a new journal ID, so that records
+ * that an earlier session wrote after the end of what could be recovered are
+ * never mistaken for records of the current session.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+
+/* Disk format, all fields are big-endian */
+
+#define WB_CACHE_MAGIC      0x51574243 /* "QWBC" */
+#define WB_CACHE_REC_MAGIC  0x51574252 /* "QWBR" */
+#define WB_CACHE_VERSION    1
+
+typedef struct QEMU_PACKED WBCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t journal_id;
+    uint64_t block_size;
+    uint64_t tail_offset;   /* position of the oldest record */
+    uint64_t tail_seq;      /* sequence number of the oldest record */
+    uint64_t prev_journal_id; /* also valid while switching journal IDs */
+    uint32_t header_crc;    /* of all fields above */
+} WBCacheHeader;
+
+typedef struct QEMU_PACKED WBCacheRecordHeader {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t journal_id;
+    uint64_t seq;
+    uint64_t offset;
+    uint64_t bytes;
+    uint32_t flags;
+    uint32_t data_crc;
+} WBCacheRecordHeader;
+
+enum {
+    WB_CACHE_RECORD_NONE,       /* padding left by failed appends */
+    WB_CACHE_RECORD_WRITE,
+    WB_CACHE_RECORD_ZERO,
+    WB_CACHE_RECORD_DISCARD,
+};
+
+/* End of disk format */
+
+#define WB_CACHE_MIN_RING_SIZE (1 * MiB)
+
+/* Maximum number of records written back before the file child is flushed */
+#define WB_CACHE_BATCH 64
+
+/* Delay before retrying a failed write back */
+#define WB_CACHE_RETRY_NS (1 * NANOSECONDS_PER_SECOND)
+
+typedef struct WBCacheRecord {
+    uint64_t seq;
+    int type;
+    int64_t offset;
+    int64_t bytes;
+    BdrvRequestFlags flags;
+
+    uint64_t jpos;      /* offset of the record in the journal */
+    uint64_t jlen;      /* length of header block and data */
+    uint64_t skip;      /* unused space before @jpos at the end of the ring */
+
+    bool committed;     /* completely written to the journal */
+    int refs;           /* number of readers using the journalled data */
+
+    QTAILQ_ENTRY(WBCacheRecord) next;
+} WBCacheRecord;
+
+typedef struct BDRVWBCacheState {
+    BlockDriverState *bs;
+    BdrvChild *journal;
+
+    uint64_t journal_id;
+    uint64_t prev_journal_id;
+    uint64_t block_size;
+    uint64_t ring_start;
+    uint64_t ring_end;     /* 0 until the journal is opened */
+
+    /* Protects all fields below, except for @flusher_running */
+    CoMutex lock;
+
+    /* Records that are not written back yet, in journal order */
+    QTAILQ_HEAD(, WBCacheRecord) records;
+    uint64_t head;      /* position of the next record */
+    uint64_t used;      /* bytes used by @records, including skipped space */
+    uint64_t next_seq;
+
+    CoQueue space_queue;    /* appends waiting for space in the journal */
+    CoQueue commit_queue;   /* flushes waiting for records to be committed */
+    CoQueue reclaim_queue;  /* write back waiting for readers to finish */
+
+    bool write_back_failed;
+    bool journal_failed;    /* a failed append could not be undone */
+    bool write_back_all;    /* write back even when drained, don't retry */
+    bool flusher_running;
+} BDRVWBCacheState;
+
+static void wb_cache_kick_flusher(BlockDriverState *bs);
+
+static uint64_t wb_cache_ring_size(BDRVWBCacheState *s)
+{
+    return s->ring_end - s->ring_start;
+}
+
+static uint64_t wb_cache_new_journal_id(void)
+{
+    return ((uint64_t)g_random_int() << 32) | g_random_int();
+}
+
+static uint32_t wb_cache_header_crc(const WBCacheHeader *h)
+{
+    return crc32c(0xffffffff, (const uint8_t *)h,
+                  offsetof(WBCacheHeader, header_crc));
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wb_cache_write_header(BDRVWBCacheState *s, uint64_t tail_offset,
+                      uint64_t tail_seq)
+{
+    uint8_t *buf;
+    WBCacheHeader *h;
+    int ret;
+
+    buf = qemu_try_blockalign0(s->journal->bs, s->block_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    h = (WBCacheHeader *)buf;
+    *h = (WBCacheHeader) {
+        .magic          = cpu_to_be32(WB_CACHE_MAGIC),
+        .version        = cpu_to_be32(WB_CACHE_VERSION),
+        .journal_id     = cpu_to_be64(s->journal_id),
+        .block_size     = cpu_to_be64(s->block_size),
+        .tail_offset    = cpu_to_be64(tail_offset),
+        .tail_seq       = cpu_to_be64(tail_seq),
+    };
+    h->header_crc = cpu_to_be32(wb_cache_header_crc(h));
+
+    ret = bdrv_co_pwrite(s->journal, 0, s->block_size, buf, 0);
+    if (ret == 0) {
+        ret = bdrv_co_flush(s->journal->bs);
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Reserve space for @rec in the journal and assign it a sequence number,
+ * waiting for write back if the journal is full. Called with s->lock held.
+ */
+static void coroutine_fn wb_cache_reserve(BlockDriverState *bs,
+                                          WBCacheRecord *rec)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    uint64_t skip;
+
+    assert(rec->jlen <= wb_cache_ring_size(s));
+
+    for (;;) {
+        if (!s->used) {
+            s->head = s->ring_start;
+        }
+        skip = s->head + rec->jlen > s->ring_end ? s->ring_end - s->head : 0;
+        if (s->used + skip + rec->jlen <= wb_cache_ring_size(s)) {
+            break;
+        }
+        wb_cache_kick_flusher(bs);
+        qemu_co_queue_wait(&s->space_queue, &s->lock);
+    }
+
+    rec->skip = skip;
+    rec->jpos = skip ? s->ring_start : s->head;
+    rec->seq = s->next_seq++;
+
+    s->head = rec->jpos + rec->jlen;
+    s->used += skip + rec->jlen;
+    QTAILQ_INSERT_TAIL(&s->records, rec, next);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wb_cache_co_append(BlockDriverState *bs, int type, int64_t offset,
+                   int64_t bytes, QEMUIOVector *qiov, size_t qiov_offset,
+                   BdrvRequestFlags flags)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    uint64_t data_len = 0;
+    uint32_t crc = 0;
+    WBCacheRecordHeader *h;
+    WBCacheRecord *rec;
+    uint8_t *buf;
+    int ret;
+
+    if (qatomic_read(&s->journal_failed)) {
+        return -EIO;
+    }
+
+    if (type == WB_CACHE_RECORD_WRITE) {
+        data_len = ROUND_UP(bytes, s->block_size);
+    }
+
+    buf = qemu_try_blockalign(s->journal->bs, s->block_size + data_len);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    memset(buf, 0, s->block_size);
+    if (type == WB_CACHE_RECORD_WRITE) {
+        uint8_t *data = buf + s->block_size;
+
+        qemu_iovec_to_buf(qiov, qiov_offset, data, bytes);
+        memset(data + bytes, 0, data_len - bytes);
+        crc = crc32c(0xffffffff, data, bytes);
+    }
+
+    rec = g_new0(WBCacheRecord, 1);
+    *rec = (WBCacheRecord) {
+        .type   = type,
+        .offset = offset,
+        .bytes  = bytes,
+        .flags  = flags,
+        .jlen   = s->block_size + data_len,
+    };
+
+    qemu_co_mutex_lock(&s->lock);
+    wb_cache_reserve(bs, rec);
+    qemu_co_mutex_unlock(&s->lock);
+
+    h = (WBCacheRecordHeader *)buf;
+    *h = (WBCacheRecordHeader) {
+        .magic      = cpu_to_be32(WB_CACHE_REC_MAGIC),
+        .type       = cpu_to_be32(type),
+        .journal_id = cpu_to_be64(s->journal_id),
+        .seq        = cpu_to_be64(rec->seq),
+        .offset     = cpu_to_be64(offset),
+        .bytes      = cpu_to_be64(bytes),
+        .flags      = cpu_to_be32(flags),
+        .data_crc   = cpu_to_be32(crc),
+    };
+
+    ret = bdrv_co_pwrite(s->journal, rec->jpos, rec->jlen, buf, 0);
+    if (ret < 0) {
+        /*
+         * The record keeps its place in the journal so that the sequence
+         * numbers stay contiguous, but it has no effect. Recovery stops at
+         * the first invalid record, so the slot must become valid padding;
+         * if even that fails, no later record could ever be recovered.
+         */
+        *h = (WBCacheRecordHeader) {
+            .magic      = cpu_to_be32(WB_CACHE_REC_MAGIC),
+            .type       = cpu_to_be32(WB_CACHE_RECORD_NONE),
+            .journal_id = cpu_to_be64(s->journal_id),
+            .seq        = cpu_to_be64(rec->seq),
+            .bytes      = cpu_to_be64(data_len),
+        };
+        if (bdrv_co_pwrite(s->journal, rec->jpos, s->block_size, buf, 0) < 0) {
+            error_report("Failed to write to the journal of '%s', failing all "
+                         "further writes", bdrv_get_node_name(bs));
+            qatomic_set(&s->journal_failed, true);
+        }
+    }
+    qemu_vfree(buf);
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        rec->type = WB_CACHE_RECORD_NONE;
+    }
+    rec->committed = true;
+    qemu_co_queue_restart_all(&s->commit_queue);
+    wb_cache_kick_flusher(bs);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wb_cache_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset,
+                         BdrvRequestFlags flags)
+{
+    return wb_cache_co_append(bs, WB_CACHE_RECORD_WRITE, offset, bytes,
+                              qiov, qiov_offset, 0);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wb_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          BdrvRequestFlags flags)
+{
+    return wb_cache_co_append(bs, WB_CACHE_RECORD_ZERO, offset, bytes,
+                              NULL, 0, flags & BDRV_REQ_MAY_UNMAP);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wb_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    return wb_cache_co_append(bs, WB_CACHE_RECORD_DISCARD, offset, bytes,
+                              NULL, 0, 0);
+}
+
+static bool wb_cache_record_overlaps(WBCacheRecord *rec, int64_t offset,
+                                     int64_t bytes)
+{
+    return rec->committed &&
+           (rec->type == WB_CACHE_RECORD_WRITE ||
+            rec->type == WB_CACHE_RECORD_ZERO) &&
+           rec->offset < offset + bytes && offset < rec->offset + rec->bytes;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wb_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                        QEMUIOVector *qiov, size_t qiov_offset,
+                        BdrvRequestFlags flags)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    g_autoptr(GPtrArray) overlays = g_ptr_array_new();
+    WBCacheRecord *rec;
+    unsigned int first = 0;
+    unsigned int i;
+    bool covered = false;
+    int ret = 0;
+
+    /*
+     * Take references to the journalled writes that overlap the request so
+     * that their space is not reused while we read from it.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    QTAILQ_FOREACH(rec, &s->records, next) {
+        if (!wb_cache_record_overlaps(rec, offset, bytes)) {
+            continue;
+        }
+        /* Nothing older than a record that covers everything matters */
+        if (rec->offset <= offset &&
+            rec->offset + rec->bytes >= offset + bytes) {
+            first = overlays->len;
+            covered = true;
+        }
+        rec->refs++;
+        g_ptr_array_add(overlays, rec);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    /*
+     * Anything that is not in the journal any more has been written back, so
+     * reading the file child first and the journal afterwards gives the
+     * newest data.
+     */
+    if (!covered) {
+        ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                  flags);
+    }
+
+    for (i = first; ret >= 0 && i < overlays->len; i++) {
+        int64_t start, end;
+
+        rec = overlays->pdata[i];
+        start = MAX(rec->offset, offset);
+        end = MIN(rec->offset + rec->bytes, offset + bytes);
+
+        if (rec->type == WB_CACHE_RECORD_ZERO) {
+            qemu_iovec_memset(qiov, qiov_offset + start - offset, 0,
+                              end - start);
+        } else {
+            ret = bdrv_co_preadv_part(s->journal,
+                                      rec->jpos + s->block_size +
+                                      start - rec->offset,
+                                      end - start, qiov,
+                                      qiov_offset + start - offset, 0);
+        }
+    }
+
+    if (overlays->len) {
+        qemu_co_mutex_lock(&s->lock);
+        for (i = 0; i < overlays->len; i++) {
+            rec = overlays->pdata[i];
+            rec->refs--;
+        }
+        qemu_co_queue_restart_all(&s->reclaim_queue);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK wb_cache_co_flush(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheRecord *rec;
+    uint64_t seq;
+
+    /*
+     * A record can only be found on recovery if all records before it are
+     * valid, so wait until everything up to now has reached the journal.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    seq = s->next_seq;
+retry:
+    QTAILQ_FOREACH(rec, &s->records, next) {
+        if (rec->seq >= seq) {
+            break;
+        }
+        if (!rec->committed) {
+            qemu_co_queue_wait(&s->commit_queue, &s->lock);
+            goto retry;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* Records after a broken slot would not be found on recovery */
+    if (qatomic_read(&s->journal_failed)) {
+        return -EIO;
+    }
+
+    return bdrv_co_flush(s->journal->bs);
+}
+
+/*
+ * Write back the records in @batch to the file child, and persist the new
+ * start of the journal.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+wb_cache_write_back(BlockDriverState *bs, WBCacheRecord **batch, int n)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheRecord *last = batch[n - 1];
+    uint64_t tail_offset;
+    uint8_t *buf = NULL;
+    int64_t buf_size = 0;
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < n && ret >= 0; i++) {
+        WBCacheRecord *rec = batch[i];
+
+        switch (rec->type) {
+        case WB_CACHE_RECORD_WRITE:
+            if (rec->bytes > buf_size) {
+                qemu_vfree(buf);
+                buf_size = rec->bytes;
+                buf = qemu_try_blockalign(bs, buf_size);
+                if (!buf) {
+                    ret = -ENOMEM;
+                    break;
+                }
+            }
+            ret = bdrv_co_pread(s->journal, rec->jpos + s->block_size,
+                                rec->bytes, buf, 0);
+            if (ret < 0) {
+                break;
+            }
+            ret = bdrv_co_pwrite(bs->file, rec->offset, rec->bytes, buf, 0);
+            break;
+        case WB_CACHE_RECORD_ZERO:
+            ret = bdrv_co_pwrite_zeroes(bs->file, rec->offset, rec->bytes,
+                                        rec->flags);
+            break;
+        case WB_CACHE_RECORD_DISCARD:
+            /* Discard is only a hint, ignore failures */
+            bdrv_co_pdiscard(bs->file, rec->offset, rec->bytes);
+            break;
+        default:
+            break;
+        }
+    }
+    qemu_vfree(buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * The next record is either right after the last one, or at the start of
+     * the ring if it did not fit; recovery checks both places.
+     */
+    tail_offset = last->jpos + last->jlen;
+    if (tail_offset >= s->ring_end) {
+        tail_offset = s->ring_start;
+    }
+
+    return wb_cache_write_header(s, tail_offset, last->seq + 1);
+}
+
+/*
+ * Remove written back records and release their space in the journal.
+ * Called with s->lock held.
+ */
+static void coroutine_fn wb_cache_reclaim(BDRVWBCacheState *s,
+                                          WBCacheRecord **batch, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        WBCacheRecord *rec = batch[i];
+
+        while (rec->refs) {
+            qemu_co_queue_wait(&s->reclaim_queue, &s->lock);
+        }
+
+        assert(QTAILQ_FIRST(&s->records) == rec);
+        QTAILQ_REMOVE(&s->records, rec, next);
+        s->used -= rec->skip + rec->jlen;
+        g_free(rec);
+    }
+
+    qemu_co_queue_restart_all(&s->space_queue);
+}
+
+/* Called with s->lock held */
+static bool wb_cache_can_write_back(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheRecord *rec = QTAILQ_FIRST(&s->records);
+
+    /*
+     * Stop when drained, the journal keeps the data safe. Appends that wait
+     * for space must still finish, though, or the drain would never end.
+     */
+    return rec && rec->committed &&
+           (s->write_back_all || !qatomic_read(&bs->quiesce_counter) ||
+            !qemu_co_queue_empty(&s->space_queue));
+}
+
+static void coroutine_fn wb_cache_flusher_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheRecord *batch[WB_CACHE_BATCH];
+    WBCacheRecord *rec;
+    int ret = 0;
+    int n;
+
+    qemu_co_mutex_lock(&s->lock);
+    for (;;) {
+        if (!wb_cache_can_write_back(bs)) {
+            qatomic_set(&s->flusher_running, false);
+            /* Pairs with the quiesce_counter update before drain_end */
+            smp_mb();
+            if (!wb_cache_can_write_back(bs) ||
+                qatomic_xchg(&s->flusher_running, true)) {
+                break;
+            }
+        }
+
+        n = 0;
+        QTAILQ_FOREACH(rec, &s->records, next) {
+            if (!rec->committed || n == WB_CACHE_BATCH) {
+                break;
+            }
+            batch[n++] = rec;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
+        WITH_GRAPH_RDLOCK_GUARD() {
+            ret = wb_cache_write_back(bs, batch, n);
+        }
+
+        qemu_co_mutex_lock(&s->lock);
+        if (ret < 0) {
+            if (!s->write_back_failed) {
+                error_report("Failed to write back cached data to '%s': %s",
+                             bdrv_get_node_name(bs->file->bs),
+                             strerror(-ret));
+                s->write_back_failed = true;
+            }
+            if (s->write_back_all) {
+                qatomic_set(&s->flusher_running, false);
+                break;
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, WB_CACHE_RETRY_NS);
+            qemu_co_mutex_lock(&s->lock);
+            continue;
+        }
+
+        s->write_back_failed = false;
+        wb_cache_reclaim(s, batch, n);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    bdrv_dec_in_flight(bs);
+}
+
+static void wb_cache_kick_flusher(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    Coroutine *co;
+
+    if (qatomic_xchg(&s->flusher_running, true)) {
+        return;
+    }
+
+    co = qemu_coroutine_create(wb_cache_flusher_entry, bs);
+    bdrv_inc_in_flight(bs);
+    aio_co_schedule(bdrv_get_aio_context(bs), co);
+}
+
+static void wb_cache_drain_end(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+
+    if (!QTAILQ_EMPTY(&s->records)) {
+        wb_cache_kick_flusher(bs);
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wb_cache_co_block_status(BlockDriverState *bs, bool want_zero, int64_t offset,
+                         int64_t bytes, int64_t *pnum, int64_t *map,
+                         BlockDriverState **file)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheRecord *rec;
+    bool cached = false;
+
+    /*
+     * Report the range up to the first change between journalled and not
+     * journalled data
+     */
+    *pnum = bytes;
+    qemu_co_mutex_lock(&s->lock);
+    QTAILQ_FOREACH(rec, &s->records, next) {
+        if (!wb_cache_record_overlaps(rec, offset, *pnum)) {
+            continue;
+        }
+        if (rec->offset <= offset) {
+            cached = true;
+            *pnum = rec->offset + rec->bytes - offset;
+            break;
+        }
+        *pnum = rec->offset - offset;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (cached) {
+        *pnum = MIN(*pnum, bytes);
+        return BDRV_BLOCK_DATA;
+    }
+
+    *map = offset;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+/*
+ * Read the record with sequence number @seq at @pos, or at the start of the
+ * ring. Returns 1 and adds the record to the journal if it is valid, 0 if it
+ * is not found.
+ */
+static int GRAPH_RDLOCK
+wb_cache_recover_record(BDRVWBCacheState *s, uint64_t pos, uint64_t seq,
+                        uint8_t *hbuf, Error **errp)
+{
+    WBCacheRecordHeader *h = (WBCacheRecordHeader *)hbuf;
+    WBCacheRecord *rec;
+    uint64_t jpos, jlen, bytes, id;
+    uint8_t *data;
+    uint32_t type;
+    bool valid;
+    int ret;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        jpos = i ? s->ring_start : pos;
+        if ((i && pos == s->ring_start) ||
+            jpos + s->block_size > s->ring_end) {
+            continue;
+        }
+
+        ret = bdrv_pread(s->journal, jpos, s->block_size, hbuf, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read journal");
+            return ret;
+        }
+
+        type = be32_to_cpu(h->type);
+        bytes = be64_to_cpu(h->bytes);
+        id = be64_to_cpu(h->journal_id);
+        if (be32_to_cpu(h->magic) != WB_CACHE_REC_MAGIC ||
+            (id != s->journal_id &&
+             (!s->prev_journal_id || id != s->prev_journal_id)) ||
+            be64_to_cpu(h->seq) != seq ||
+            type > WB_CACHE_RECORD_DISCARD ||
+            bytes > wb_cache_ring_size(s))
+        {
+            continue;
+        }
+
+        jlen = s->block_size;
+        if (type == WB_CACHE_RECORD_WRITE || type == WB_CACHE_RECORD_NONE) {
+            jlen += ROUND_UP(bytes, s->block_size);
+        }
+        if (jpos + jlen > s->ring_end) {
+            continue;
+        }
+
+        if (type == WB_CACHE_RECORD_WRITE) {
+            data = qemu_blockalign(s->journal->bs, bytes);
+            ret = bdrv_pread(s->journal, jpos + s->block_size, bytes, data, 0);
+            if (ret < 0) {
+                qemu_vfree(data);
+                error_setg_errno(errp, -ret, "Could not read journal");
+                return ret;
+            }
+            valid = crc32c(0xffffffff, data, bytes) ==
+                    be32_to_cpu(h->data_crc);
+            qemu_vfree(data);
+            if (!valid) {
+                continue;
+            }
+        }
+
+        rec = g_new0(WBCacheRecord, 1);
+        *rec = (WBCacheRecord) {
+            .seq        = seq,
+            .type       = type,
+            .offset     = be64_to_cpu(h->offset),
+            .bytes      = bytes,
+            .flags      = be32_to_cpu(h->flags) & BDRV_REQ_MAY_UNMAP,
+            .jpos       = jpos,
+            .jlen       = jlen,
+            .skip       = i ? s->ring_end - pos : 0,
+            .committed  = true,
+        };
+        QTAILQ_INSERT_TAIL(&s->records, rec, next);
+        s->used += rec->skip + rec->jlen;
+        s->head = jpos + jlen;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Switch to a new journal ID. The recovered records are switched over first;
+ * until that is complete, the header keeps the old ID as @prev_journal_id so
+ * that recovery accepts records with either ID.
+ */
+static int GRAPH_RDLOCK
+wb_cache_switch_journal_id(BDRVWBCacheState *s, uint64_t tail_offset,
+                           uint64_t tail_seq, uint8_t *hbuf, Error **errp)
+{
+    WBCacheRecordHeader *rh = (WBCacheRecordHeader *)hbuf;
+    WBCacheRecord *rec;
+    WBCacheHeader h;
+    int ret;
+
+    /*
+     * If an earlier switch was interrupted, no records were written with the
+     * new ID yet apart from the recovered ones, so it can be reused.
+     */
+    if (!s->prev_journal_id) {
+        s->prev_journal_id = s->journal_id;
+        s->journal_id = wb_cache_new_journal_id();
+    }
+
+    h = (WBCacheHeader) {
+        .magic          = cpu_to_be32(WB_CACHE_MAGIC),
+        .version        = cpu_to_be32(WB_CACHE_VERSION),
+        .journal_id     = cpu_to_be64(s->journal_id),
+        .block_size     = cpu_to_be64(s->block_size),
+        .tail_offset    = cpu_to_be64(tail_offset),
+        .tail_seq       = cpu_to_be64(tail_seq),
+    };
+
+    if (!QTAILQ_EMPTY(&s->records)) {
+        h.prev_journal_id = cpu_to_be64(s->prev_journal_id);
+        h.header_crc = cpu_to_be32(wb_cache_header_crc(&h));
+        ret = bdrv_pwrite_sync(s->journal, 0, sizeof(h), &h, 0);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        QTAILQ_FOREACH(rec, &s->records, next) {
+            ret = bdrv_pread(s->journal, rec->jpos, s->block_size, hbuf, 0);
+            if (ret < 0) {
+                goto fail;
+            }
+            if (be64_to_cpu(rh->journal_id) == s->journal_id) {
+                continue;
+            }
+            rh->journal_id = cpu_to_be64(s->journal_id);
+            ret = bdrv_pwrite(s->journal, rec->jpos, s->block_size, hbuf, 0);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+        ret = bdrv_flush(s->journal->bs);
+        if (ret < 0) {
+            goto fail;
+        }
+        h.prev_journal_id = 0;
+    }
+
+    h.header_crc = cpu_to_be32(wb_cache_header_crc(&h));
+    ret = bdrv_pwrite_sync(s->journal, 0, sizeof(h), &h, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->prev_journal_id = 0;
+    return 0;
+
+fail:
+    error_setg_errno(errp, -ret, "Could not update journal");
+    return ret;
+}
+
+static int GRAPH_RDLOCK
+wb_cache_open_journal(BlockDriverState *bs, Error **errp)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheHeader h;
+    uint64_t tail_offset, tail_seq, seq;
+    int64_t len;
+    uint8_t *hbuf;
+    int ret;
+
+    ret = bdrv_pread(s->journal, 0, sizeof(h), &h, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read journal header");
+        return ret;
+    }
+
+    if (buffer_is_zero(&h, sizeof(h))) {
+        /* A new journal, format it */
+        s->block_size = MAX(BDRV_SECTOR_SIZE,
+                            s->journal->bs->bl.request_alignment);
+        s->journal_id = wb_cache_new_journal_id();
+        s->ring_start = s->block_size;
+
+        h = (WBCacheHeader) {
+            .magic          = cpu_to_be32(WB_CACHE_MAGIC),
+            .version        = cpu_to_be32(WB_CACHE_VERSION),
+            .journal_id     = cpu_to_be64(s->journal_id),
+            .block_size     = cpu_to_be64(s->block_size),
+            .tail_offset    = cpu_to_be64(s->ring_start),
+            .tail_seq       = cpu_to_be64(1),
+        };
+        h.header_crc = cpu_to_be32(wb_cache_header_crc(&h));
+        ret = bdrv_pwrite_sync(s->journal, 0, sizeof(h), &h, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not initialize journal");
+            return ret;
+        }
+        tail_offset = s->ring_start;
+        seq = 1;
+    } else {
+        if (be32_to_cpu(h.magic) != WB_CACHE_MAGIC) {
+            error_setg(errp, "Journal is not a write-back cache journal");
+            return -EINVAL;
+        }
+        if (be32_to_cpu(h.version) != WB_CACHE_VERSION) {
+            error_setg(errp, "Unsupported journal version %" PRIu32,
+                       be32_to_cpu(h.version));
+            return -ENOTSUP;
+        }
+        if (be32_to_cpu(h.header_crc) != wb_cache_header_crc(&h)) {
+            error_setg(errp, "Journal header is corrupted");
+            return -EINVAL;
+        }
+        s->journal_id = be64_to_cpu(h.journal_id);
+        s->prev_journal_id = be64_to_cpu(h.prev_journal_id);
+        s->block_size = be64_to_cpu(h.block_size);
+        if (s->block_size < BDRV_SECTOR_SIZE || s->block_size > 64 * KiB ||
+            !is_power_of_2(s->block_size))
+        {
+            error_setg(errp, "Invalid journal block size %" PRIu64,
+                       s->block_size);
+            return -EINVAL;
+        }
+        s->ring_start = s->block_size;
+        tail_offset = be64_to_cpu(h.tail_offset);
+        seq = be64_to_cpu(h.tail_seq);
+    }
+
+    len = bdrv_getlength(s->journal->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get journal size");
+        return len;
+    }
+    s->ring_end = QEMU_ALIGN_DOWN(len, s->block_size);
+    if (s->ring_end < s->ring_start + WB_CACHE_MIN_RING_SIZE) {
+        error_setg(errp, "The journal must be at least %" PRIu64 " bytes",
+                   s->ring_start + WB_CACHE_MIN_RING_SIZE);
+        return -EINVAL;
+    }
+    if (tail_offset < s->ring_start || tail_offset >= s->ring_end ||
+        !QEMU_IS_ALIGNED(tail_offset, s->block_size))
+    {
+        error_setg(errp, "Invalid journal start offset %" PRIu64,
+                   tail_offset);
+        return -EINVAL;
+    }
+
+    /* Replay everything that was not written back before */
+    s->head = tail_offset;
+    tail_seq = seq;
+    hbuf = qemu_blockalign(s->journal->bs, s->block_size);
+    while ((ret = wb_cache_recover_record(s, s->head, seq, hbuf, errp)) > 0) {
+        seq++;
+    }
+    if (ret == 0) {
+        ret = wb_cache_switch_journal_id(s, tail_offset, tail_seq, hbuf, errp);
+    }
+    qemu_vfree(hbuf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->next_seq = seq;
+    return 0;
+}
+
+static void wb_cache_free_records(BDRVWBCacheState *s)
+{
+    WBCacheRecord *rec, *next;
+
+    QTAILQ_FOREACH_SAFE(rec, &s->records, next, next) {
+        QTAILQ_REMOVE(&s->records, rec, next);
+        g_free(rec);
+    }
+}
+
+static int wb_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    int ret;
+
+    if (!(flags & BDRV_O_RDWR)) {
+        error_setg(errp, "The writeback-cache filter requires write access");
+        return -EINVAL;
+    }
+
+    s->bs = bs;
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->space_queue);
+    qemu_co_queue_init(&s->commit_queue);
+    qemu_co_queue_init(&s->reclaim_queue);
+    QTAILQ_INIT(&s->records);
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->journal = bdrv_open_child(NULL, options, "journal", bs, &child_of_bds,
+                                 BDRV_CHILD_METADATA, false, errp);
+    if (!s->journal) {
+        return -EINVAL;
+    }
+
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
+
+    /*
+     * Opening the journal writes to it, so for an incoming migration, wait
+     * until the source has written everything back in wb_cache_inactivate().
+     */
+    if (flags & BDRV_O_INACTIVE) {
+        return 0;
+    }
+
+    bdrv_graph_rdlock_main_loop();
+    ret = wb_cache_open_journal(bs, errp);
+    bdrv_graph_rdunlock_main_loop();
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (!QTAILQ_EMPTY(&s->records)) {
+        wb_cache_kick_flusher(bs);
+    }
+
+    return 0;
+
+fail:
+    wb_cache_free_records(s);
+    bdrv_graph_wrlock();
+    bdrv_unref_child(bs, s->journal);
+    s->journal = NULL;
+    bdrv_graph_wrunlock();
+    return ret;
+}
+
+/* Write back as much as possible, giving up on the first error */
+static void wb_cache_write_back_all(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+
+    s->write_back_all = true;
+    if (!QTAILQ_EMPTY(&s->records)) {
+        wb_cache_kick_flusher(bs);
+    }
+    BDRV_POLL_WHILE(bs, qatomic_read(&s->flusher_running));
+    s->write_back_all = false;
+}
+
+static void wb_cache_close(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+
+    /* Leave the file child up to date if possible */
+    wb_cache_write_back_all(bs);
+
+    if (!QTAILQ_EMPTY(&s->records)) {
+        warn_report("Cached data for '%s' could not be written back, it will "
+                    "be written back when the journal is opened again",
+                    bdrv_get_node_name(bs->file->bs));
+    }
+
+    wb_cache_free_records(s);
+
+    bdrv_graph_wrlock();
+    bdrv_unref_child(bs, s->journal);
+    s->journal = NULL;
+    bdrv_graph_wrunlock();
+}
+
+/*
+ * Whoever takes over the image, like the destination of a migration, cannot
+ * see the journal, so everything must be written back.
+ */
+static int GRAPH_RDLOCK wb_cache_inactivate(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+
+    wb_cache_write_back_all(bs);
+
+    if (!QTAILQ_EMPTY(&s->records)) {
+        error_report("Cached data for '%s' could not be written back",
+                     bdrv_get_node_name(bs->file->bs));
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+wb_cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    int ret;
+
+    /* Nothing to do if we were active before, the journal is empty */
+    if (s->ring_end) {
+        return;
+    }
+
+    ret = wb_cache_open_journal(bs, errp);
+    if (ret < 0) {
+        wb_cache_free_records(s);
+        s->used = 0;
+        s->ring_end = 0;
+        return;
+    }
+
+    if (!QTAILQ_EMPTY(&s->records)) {
+        wb_cache_kick_flusher(bs);
+    }
+}
+
+static int wb_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    if (!(reopen_state->flags & BDRV_O_RDWR)) {
+        error_setg(errp, "The writeback-cache filter requires write access");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void wb_cache_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    uint64_t max_transfer;
+
+    /*
+     * Keep records small compared to the journal so that it never stalls.
+     * The journal of an inactive node is not opened yet, but it cannot be
+     * smaller than the minimum.
+     */
+    max_transfer = s->ring_end ? wb_cache_ring_size(s) :
+                                 WB_CACHE_MIN_RING_SIZE;
+    max_transfer = MIN(max_transfer / 8, INT_MAX);
+    max_transfer = QEMU_ALIGN_DOWN(max_transfer,
+                                   MAX(bs->bl.request_alignment,
+                                       s->block_size));
+    bs->bl.max_transfer = MIN_NON_ZERO(bs->bl.max_transfer, max_transfer);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+wb_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static BlockDriver bdrv_writeback_cache = {
+    .format_name                        = "writeback-cache",
+    .instance_size                      = sizeof(BDRVWBCacheState),
+
+    .bdrv_open                          = wb_cache_open,
+    .bdrv_close                         = wb_cache_close,
+    .bdrv_reopen_prepare                = wb_cache_reopen_prepare,
+    .bdrv_child_perm                    = bdrv_default_perms,
+    .bdrv_refresh_limits                = wb_cache_refresh_limits,
+    .bdrv_drain_end                     = wb_cache_drain_end,
+    .bdrv_inactivate                    = wb_cache_inactivate,
+    .bdrv_co_invalidate_cache           = wb_cache_co_invalidate_cache,
+
+    .bdrv_co_getlength                  = wb_cache_co_getlength,
+    .bdrv_co_preadv_part                = wb_cache_co_preadv_part,
+    .bdrv_co_pwritev_part               = wb_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = wb_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = wb_cache_co_pdiscard,
+    .bdrv_co_flush                      = wb_cache_co_flush,
+    .bdrv_co_block_status               = wb_cache_co_block_status,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_writeback_cache_init(void)
+{
+    bdrv_register(&bdrv_writeback_cache);
+}
+
+block_init(bdrv_writeback_cache_init);
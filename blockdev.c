@@ -2652,6 +2652,9 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         if (backup->x_perf->has_max_chunk) {
             perf.max_chunk = backup->x_perf->max_chunk;
         }
+        if (backup->x_perf->has_auto_tune) {
+            perf.auto_tune = backup->x_perf->auto_tune;
+        }
     }
 
     if ((backup->sync == MIRROR_SYNC_MODE_BITMAP) ||
@@ -243,6 +243,7 @@ bool blkconf_apply_backend_options(BlockConf *conf, bool readonly,
 
     blk_set_enable_write_cache(blk, wce);
     blk_set_on_error(blk, rerror, werror);
+    blk_set_coalesce_requests(blk, conf->coalesce_requests);
 
     block_acct_setup(blk_get_stats(blk), conf->account_invalid,
                      conf->account_failed);
@@ -599,6 +599,25 @@ static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
     }
 }
 
+static void virtio_net_apply_queue_coal(VirtIONet *n, int index)
+{
+    virtio_queue_set_notification_coalescing(n->vqs[index].rx_vq,
+                                             n->rx_coal_max_packets,
+                                             n->rx_coal_usecs);
+    virtio_queue_set_notification_coalescing(n->vqs[index].tx_vq,
+                                             n->tx_coal_max_packets,
+                                             n->tx_coal_usecs);
+}
+
+static void virtio_net_apply_coal(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        virtio_net_apply_queue_coal(n, i);
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -631,6 +650,13 @@ static void virtio_net_reset(VirtIODevice *vdev)
     for (i = 0;  i < n->max_queue_pairs; i++) {
         flush_or_purge_queued_packets(qemu_get_subqueue(n->nic, i));
     }
+
+    /* Notification coalescing is disabled after reset */
+    n->rx_coal_usecs = 0;
+    n->rx_coal_max_packets = 0;
+    n->tx_coal_usecs = 0;
+    n->tx_coal_max_packets = 0;
+    virtio_net_apply_coal(n);
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -827,10 +853,17 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_USO6);
     }
 
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_NOTF_COAL);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
 
+    /* vhost injects interrupts itself, so QEMU cannot coalesce them */
+    virtio_clear_feature(&features, VIRTIO_NET_F_NOTF_COAL);
+
     if (!ebpf_rss_is_loaded(&n->ebpf_rss)) {
         virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
     }
@@ -1129,6 +1162,40 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
     }
 }
 
+static int virtio_net_handle_coal(VirtIONet *n, uint8_t cmd,
+                                  struct iovec *iov, unsigned int iov_cnt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_ctrl_coal coal;
+    size_t s;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_NOTF_COAL)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    /* struct virtio_net_ctrl_coal_rx/tx have the same layout */
+    s = iov_to_buf(iov, iov_cnt, 0, &coal, sizeof(coal));
+    if (s != sizeof(coal)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_NOTF_COAL_TX_SET:
+        n->tx_coal_max_packets = virtio_ldl_p(vdev, &coal.max_packets);
+        n->tx_coal_usecs = virtio_ldl_p(vdev, &coal.max_usecs);
+        break;
+    case VIRTIO_NET_CTRL_NOTF_COAL_RX_SET:
+        n->rx_coal_max_packets = virtio_ldl_p(vdev, &coal.max_packets);
+        n->rx_coal_usecs = virtio_ldl_p(vdev, &coal.max_usecs);
+        break;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+
+    virtio_net_apply_coal(n);
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
                                  struct iovec *iov, unsigned int iov_cnt)
 {
@@ -1612,6 +1679,8 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
         status = virtio_net_handle_mq(n, ctrl.cmd, iov, out_num);
     } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
         status = virtio_net_handle_offloads(n, ctrl.cmd, iov, out_num);
+    } else if (ctrl.class == VIRTIO_NET_CTRL_NOTF_COAL) {
+        status = virtio_net_handle_coal(n, ctrl.cmd, iov, out_num);
     }
 
     s = iov_from_buf(in_sg, in_num, 0, &status, sizeof(status));
@@ -1935,7 +2004,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
-    size_t lens[VIRTQUEUE_MAX_SIZE];
+    unsigned int lens[VIRTQUEUE_MAX_SIZE];
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
@@ -2067,13 +2136,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
+    /* signal other side */
+    virtqueue_push_batch(q->rx_vq, elems, lens, i);
     for (j = 0; j < i; j++) {
-        /* signal other side */
-        virtqueue_fill(q->rx_vq, elems[j], lens[j], j);
         g_free(elems[j]);
     }
-
-    virtqueue_flush(q->rx_vq, i);
     virtio_notify(vdev, q->rx_vq);
 
     return size;
@@ -2733,12 +2800,38 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     }
 }
 
+/* Maximum number of transmitted packets returned to the guest at once */
+#define VIRTIO_NET_TX_PUSH_BATCH 64
+
+/* Return the sent packets to the guest with a single used index update */
+static void virtio_net_tx_push_batch(VirtIONetQueue *q,
+                                     VirtQueueElement **elems,
+                                     unsigned int *num_elems)
+{
+    static const unsigned int lens[VIRTIO_NET_TX_PUSH_BATCH];
+    unsigned int i;
+
+    if (!*num_elems) {
+        return;
+    }
+
+    virtqueue_push_batch(q->tx_vq, elems, lens, *num_elems);
+    virtio_notify(VIRTIO_DEVICE(q->n), q->tx_vq);
+
+    for (i = 0; i < *num_elems; i++) {
+        g_free(elems[i]);
+    }
+    *num_elems = 0;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
+    VirtQueueElement *sent[VIRTIO_NET_TX_PUSH_BATCH];
+    unsigned int num_sent = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -2767,6 +2860,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
             g_free(elem);
+            virtio_net_tx_push_batch(q, sent, &num_sent);
             return -EINVAL;
         }
 
@@ -2776,6 +2870,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
                 g_free(elem);
+                virtio_net_tx_push_batch(q, sent, &num_sent);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -2814,18 +2909,21 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            virtio_net_tx_push_batch(q, sent, &num_sent);
             return -EBUSY;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        sent[num_sent++] = elem;
+        if (num_sent == ARRAY_SIZE(sent)) {
+            virtio_net_tx_push_batch(q, sent, &num_sent);
+        }
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_push_batch(q, sent, &num_sent);
     return num_packets;
 }
 
@@ -3005,6 +3103,7 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    virtio_net_apply_queue_coal(n, index);
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -3329,6 +3428,35 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_coal_needed(void *opaque)
+{
+    VirtIONet *n = VIRTIO_NET(opaque);
+
+    return n->rx_coal_usecs || n->tx_coal_usecs ||
+           n->rx_coal_max_packets || n->tx_coal_max_packets;
+}
+
+static int virtio_net_coal_post_load(void *opaque, int version_id)
+{
+    virtio_net_apply_coal(VIRTIO_NET(opaque));
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_coal = {
+    .name      = "virtio-net-device/coal",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_coal_needed,
+    .post_load = virtio_net_coal_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(rx_coal_usecs, VirtIONet),
+        VMSTATE_UINT32(rx_coal_max_packets, VirtIONet),
+        VMSTATE_UINT32(tx_coal_usecs, VirtIONet),
+        VMSTATE_UINT32(tx_coal_max_packets, VirtIONet),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static bool virtio_net_rss_needed(void *opaque)
 {
     return VIRTIO_NET(opaque)->rss_data.enabled;
@@ -3407,6 +3535,7 @@ static const VMStateDescription vmstate_virtio_net_device = {
     },
     .subsections = (const VMStateDescription * const []) {
         &vmstate_virtio_net_rss,
+        &vmstate_virtio_net_coal,
         NULL
     }
 };
@@ -3986,6 +4115,8 @@ static Property virtio_net_properties[] = {
                     VIRTIO_NET_F_RSS, false),
     DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
                     VIRTIO_NET_F_HASH_REPORT, false),
+    DEFINE_PROP_BIT64("notf_coal", VirtIONet, host_features,
+                    VIRTIO_NET_F_NOTF_COAL, false),
     DEFINE_PROP_ARRAY("ebpf-rss-fds", VirtIONet, nr_ebpf_rss_fds,
                       ebpf_rss_fds, qdev_prop_string, char*),
     DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
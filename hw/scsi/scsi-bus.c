@@ -89,6 +89,7 @@ SCSIDevice *scsi_device_get(SCSIBus *bus, int channel, int id, int lun)
  * Invoke @fn() for each enqueued request in device @s. Must be called from the
  * main loop thread while the guest is stopped. This is only suitable for
  * vmstate ->put(), use scsi_device_for_each_req_async() for other cases.
+ * @fn() must not add or remove requests.
  */
 static void scsi_device_for_each_req_sync(SCSIDevice *s,
                                           void (*fn)(SCSIRequest *, void *),
@@ -100,13 +101,14 @@ static void scsi_device_for_each_req_sync(SCSIDevice *s,
     assert(!runstate_is_running());
     assert(qemu_in_main_thread());
 
+    QEMU_LOCK_GUARD(&s->requests_lock);
     QTAILQ_FOREACH_SAFE(req, &s->requests, next, next_req) {
         fn(req, opaque);
     }
 }
 
 typedef struct {
-    SCSIDevice *s;
+    SCSIRequest *req;
     void (*fn)(SCSIRequest *, void *);
     void *fn_opaque;
 } SCSIDeviceForEachReqAsyncData;
@@ -114,29 +116,26 @@ typedef struct {
 static void scsi_device_for_each_req_async_bh(void *opaque)
 {
     g_autofree SCSIDeviceForEachReqAsyncData *data = opaque;
-    SCSIDevice *s = data->s;
-    AioContext *ctx;
-    SCSIRequest *req;
-    SCSIRequest *next;
+    SCSIRequest *req = data->req;
+    SCSIDevice *s = req->dev;
 
-    /*
-     * The BB cannot have changed contexts between this BH being scheduled and
-     * now: BBs' AioContexts, when they have a node attached, can only be
-     * changed via bdrv_try_change_aio_context(), in a drained section.  While
-     * we have the in-flight counter incremented, that drain must block.
-     */
-    ctx = blk_get_aio_context(s->conf.blk);
-    assert(ctx == qemu_get_current_aio_context());
+    /* Requests are only processed in the AioContext that submitted them */
+    assert(req->ctx == qemu_get_current_aio_context());
 
-    QTAILQ_FOREACH_SAFE(req, &s->requests, next, next) {
+    /* The request may have completed since the BH was scheduled */
+    if (req->enqueued) {
         data->fn(req, data->fn_opaque);
     }
 
+    /* Keep the device alive until blk_dec_in_flight() */
+    object_ref(OBJECT(s));
+
     /* Drop the reference taken by scsi_device_for_each_req_async() */
-    object_unref(OBJECT(s));
+    scsi_req_unref(req);
 
     /* Paired with blk_inc_in_flight() in scsi_device_for_each_req_async() */
     blk_dec_in_flight(s->conf.blk);
+    object_unref(OBJECT(s));
 }
 
 /*
@@ -145,30 +144,37 @@ static void scsi_device_for_each_req_async_bh(void *opaque)
  * Keeps the BlockBackend's in-flight counter incremented until everything is
  * done, so draining it will settle all scheduled @fn() calls.
  */
-static void scsi_device_for_each_req_async(SCSIDevice *s,
-                                           void (*fn)(SCSIRequest *, void *),
-                                           void *opaque)
+void scsi_device_for_each_req_async(SCSIDevice *s,
+                                    void (*fn)(SCSIRequest *, void *),
+                                    void *opaque)
 {
+    SCSIRequest *req;
+
     assert(qemu_in_main_thread());
 
-    SCSIDeviceForEachReqAsyncData *data =
-        g_new(SCSIDeviceForEachReqAsyncData, 1);
+    QEMU_LOCK_GUARD(&s->requests_lock);
+    QTAILQ_FOREACH(req, &s->requests, next) {
+        SCSIDeviceForEachReqAsyncData *data =
+            g_new(SCSIDeviceForEachReqAsyncData, 1);
 
-    data->s = s;
-    data->fn = fn;
-    data->fn_opaque = opaque;
+        data->req = req;
+        data->fn = fn;
+        data->fn_opaque = opaque;
 
-    /*
-     * Hold a reference to the SCSIDevice until
-     * scsi_device_for_each_req_async_bh() finishes.
-     */
-    object_ref(OBJECT(s));
+        /*
+         * Hold a reference to the request (and thereby the SCSIDevice)
+         * until scsi_device_for_each_req_async_bh() finishes.
+         */
+        scsi_req_ref(req);
 
-    /* Paired with blk_dec_in_flight() in scsi_device_for_each_req_async_bh() */
-    blk_inc_in_flight(s->conf.blk);
-    aio_bh_schedule_oneshot(blk_get_aio_context(s->conf.blk),
-                            scsi_device_for_each_req_async_bh,
-                            data);
+        /*
+         * Paired with blk_dec_in_flight() in
+         * scsi_device_for_each_req_async_bh()
+         */
+        blk_inc_in_flight(s->conf.blk);
+        aio_bh_schedule_oneshot(req->ctx, scsi_device_for_each_req_async_bh,
+                                data);
+    }
 }
 
 static void scsi_device_realize(SCSIDevice *s, Error **errp)
@@ -349,6 +355,7 @@ static void scsi_qdev_realize(DeviceState *qdev, Error **errp)
         dev->lun = lun;
     }
 
+    qemu_mutex_init(&dev->requests_lock);
     QTAILQ_INIT(&dev->requests);
     scsi_device_realize(dev, &local_err);
     if (local_err) {
@@ -370,6 +377,7 @@ static void scsi_qdev_unrealize(DeviceState *qdev)
     scsi_device_purge_requests(dev, SENSE_CODE(NO_SENSE));
 
     scsi_device_unrealize(dev);
+    qemu_mutex_destroy(&dev->requests_lock);
 
     blockdev_mark_auto_del(dev->conf.blk);
 }
@@ -783,6 +791,7 @@ SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
     req->status = -1;
     req->host_status = -1;
     req->ops = reqops;
+    req->ctx = qemu_get_current_aio_context();
     object_ref(OBJECT(d));
     object_ref(OBJECT(qbus->parent));
     notifier_list_init(&req->cancel_notifiers);
@@ -955,7 +964,10 @@ static void scsi_req_enqueue_internal(SCSIRequest *req)
         req->sg = NULL;
     }
     req->enqueued = true;
-    QTAILQ_INSERT_TAIL(&req->dev->requests, req, next);
+
+    WITH_QEMU_LOCK_GUARD(&req->dev->requests_lock) {
+        QTAILQ_INSERT_TAIL(&req->dev->requests, req, next);
+    }
 }
 
 int32_t scsi_req_enqueue(SCSIRequest *req)
@@ -975,7 +987,9 @@ static void scsi_req_dequeue(SCSIRequest *req)
     trace_scsi_req_dequeue(req->dev->id, req->lun, req->tag);
     req->retry = false;
     if (req->enqueued) {
-        QTAILQ_REMOVE(&req->dev->requests, req, next);
+        WITH_QEMU_LOCK_GUARD(&req->dev->requests_lock) {
+            QTAILQ_REMOVE(&req->dev->requests, req, next);
+        }
         req->enqueued = false;
         scsi_req_unref(req);
     }
@@ -25,6 +25,7 @@
 #include "sysemu/block-backend.h"
 #include "sysemu/dma.h"
 #include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
 #include "hw/scsi/scsi.h"
 #include "scsi/constants.h"
 #include "hw/virtio/virtio-bus.h"
@@ -137,13 +138,14 @@ static void virtio_scsi_complete_req_bh(void *opaque)
 static void virtio_scsi_complete_req_from_main_loop(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
+    AioContext *ctx = s->vq_aio_context ? s->vq_aio_context[0] : NULL;
 
-    if (!s->ctx || s->ctx == qemu_get_aio_context()) {
+    if (!ctx || ctx == qemu_get_aio_context()) {
         /* No need to schedule a BH when there is no IOThread */
         virtio_scsi_complete_req(req);
     } else {
         /* Run request completion in the IOThread */
-        aio_wait_bh_oneshot(s->ctx, virtio_scsi_complete_req_bh, req);
+        aio_wait_bh_oneshot(ctx, virtio_scsi_complete_req_bh, req);
     }
 }
 
@@ -312,8 +314,80 @@ static void virtio_scsi_cancel_notify(Notifier *notifier, void *data)
 
 static inline void virtio_scsi_ctx_check(VirtIOSCSI *s, SCSIDevice *d)
 {
+    /* With iothread-vq-mapping requests are submitted from several threads */
+    if (s->parent_obj.conf.iothread_vq_mapping_list) {
+        return;
+    }
     if (s->dataplane_started && d && blk_is_available(d->conf.blk)) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+        assert(blk_get_aio_context(d->conf.blk) == s->vq_aio_context[0]);
+    }
+}
+
+typedef struct {
+    VirtIOSCSIReq *tmf_req;
+    bool found; /* for QUERY TASK and QUERY TASK SET */
+} VirtIOSCSITMFData;
+
+/* Context: the AioContext that submitted @r */
+static void virtio_scsi_tmf_req_fn(SCSIRequest *r, void *opaque)
+{
+    VirtIOSCSITMFData *data = opaque;
+    VirtIOSCSIReq *tmf_req = data->tmf_req;
+    VirtIOSCSIReq *cmd_req = r->hba_private;
+
+    /* The request has already been completed */
+    if (!cmd_req) {
+        return;
+    }
+
+    switch (tmf_req->req.tmf.subtype) {
+    case VIRTIO_SCSI_T_TMF_ABORT_TASK:
+    case VIRTIO_SCSI_T_TMF_QUERY_TASK:
+        if (cmd_req->req.cmd.tag != tmf_req->req.tmf.tag) {
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    switch (tmf_req->req.tmf.subtype) {
+    case VIRTIO_SCSI_T_TMF_QUERY_TASK:
+    case VIRTIO_SCSI_T_TMF_QUERY_TASK_SET:
+        qatomic_set(&data->found, true);
+        break;
+    default:
+        /* Completion is awaited by blk_drain() in virtio_scsi_do_one_tmf_bh */
+        scsi_req_cancel_async(r, NULL);
+        break;
+    }
+}
+
+/*
+ * With iothread-vq-mapping the requests of @d may be spread across several
+ * IOThreads. Visit each of them in the AioContext that submitted it and wait
+ * for cancellation to finish by draining the BlockBackend.
+ */
+static void virtio_scsi_do_tmf_in_aio_contexts(VirtIOSCSIReq *req,
+                                               SCSIDevice *d)
+{
+    VirtIOSCSITMFData data = {
+        .tmf_req = req,
+    };
+
+    GLOBAL_STATE_CODE();
+
+    scsi_device_for_each_req_async(d, virtio_scsi_tmf_req_fn, &data);
+
+    /* Settles all callbacks scheduled above and the cancelled requests */
+    blk_drain(d->conf.blk);
+
+    if (qatomic_read(&data.found)) {
+        /*
+         * "If the specified command is present in the task set, then return a
+         * service response set to FUNCTION SUCCEEDED".
+         */
+        req->resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_SUCCEEDED;
     }
 }
 
@@ -325,6 +399,22 @@ static void virtio_scsi_do_one_tmf_bh(VirtIOSCSIReq *req)
     int target;
 
     switch (req->req.tmf.subtype) {
+    case VIRTIO_SCSI_T_TMF_ABORT_TASK:
+    case VIRTIO_SCSI_T_TMF_QUERY_TASK:
+    case VIRTIO_SCSI_T_TMF_ABORT_TASK_SET:
+    case VIRTIO_SCSI_T_TMF_CLEAR_TASK_SET:
+    case VIRTIO_SCSI_T_TMF_QUERY_TASK_SET:
+        if (!d) {
+            req->resp.tmf.response = VIRTIO_SCSI_S_BAD_TARGET;
+            goto out;
+        }
+        if (d->lun != virtio_scsi_get_lun(req->req.tmf.lun)) {
+            req->resp.tmf.response = VIRTIO_SCSI_S_INCORRECT_LUN;
+            goto out;
+        }
+        virtio_scsi_do_tmf_in_aio_contexts(req, d);
+        break;
+
     case VIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET:
         if (!d) {
             req->resp.tmf.response = VIRTIO_SCSI_S_BAD_TARGET;
@@ -450,6 +540,25 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
     trace_virtio_scsi_tmf_req(virtio_scsi_get_lun(req->req.tmf.lun),
                               req->req.tmf.tag, req->req.tmf.subtype);
 
+    /*
+     * With iothread-vq-mapping the requests live in several IOThreads, so all
+     * TMFs that look at the task set are handled from the main loop.
+     */
+    if (s->parent_obj.conf.iothread_vq_mapping_list) {
+        switch (req->req.tmf.subtype) {
+        case VIRTIO_SCSI_T_TMF_ABORT_TASK:
+        case VIRTIO_SCSI_T_TMF_QUERY_TASK:
+        case VIRTIO_SCSI_T_TMF_ABORT_TASK_SET:
+        case VIRTIO_SCSI_T_TMF_CLEAR_TASK_SET:
+        case VIRTIO_SCSI_T_TMF_QUERY_TASK_SET:
+            virtio_scsi_defer_tmf_to_bh(req);
+            object_unref(OBJECT(d));
+            return -EINPROGRESS;
+        default:
+            break;
+        }
+    }
+
     switch (req->req.tmf.subtype) {
     case VIRTIO_SCSI_T_TMF_ABORT_TASK:
     case VIRTIO_SCSI_T_TMF_QUERY_TASK:
@@ -626,7 +735,7 @@ static void virtio_scsi_handle_ctrl_vq(VirtIOSCSI *s, VirtQueue *vq)
  */
 static bool virtio_scsi_defer_to_dataplane(VirtIOSCSI *s)
 {
-    if (!s->ctx || s->dataplane_started) {
+    if (!s->vq_aio_context || s->dataplane_started) {
         return false;
     }
 
@@ -1065,11 +1174,17 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
     SCSIDevice *sd = SCSI_DEVICE(dev);
     int ret;
 
-    if (s->ctx && !s->dataplane_fenced) {
+    if (s->vq_aio_context && !s->dataplane_fenced) {
+        /*
+         * With iothread-vq-mapping the BlockBackend is accessed from several
+         * AioContexts, it just needs a home AioContext.
+         */
+        AioContext *ctx = s->vq_aio_context[VIRTIO_SCSI_VQ_NUM_FIXED];
+
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
-        ret = blk_set_aio_context(sd->conf.blk, s->ctx, errp);
+        ret = blk_set_aio_context(sd->conf.blk, ctx, errp);
         if (ret < 0) {
             return;
         }
@@ -1107,7 +1222,7 @@ static void virtio_scsi_hotunplug(HotplugHandler *hotplug_dev, DeviceState *dev,
 
     qdev_simple_device_unplug_cb(hotplug_dev, dev, errp);
 
-    if (s->ctx) {
+    if (s->vq_aio_context) {
         /* If other users keep the BlockBackend in the iothread, that's ok */
         blk_set_aio_context(sd->conf.blk, qemu_get_aio_context(), NULL);
     }
@@ -1141,7 +1256,7 @@ static void virtio_scsi_drained_begin(SCSIBus *bus)
 
     for (uint32_t i = 0; i < total_queues; i++) {
         VirtQueue *vq = virtio_get_queue(vdev, i);
-        virtio_queue_aio_detach_host_notifier(vq, s->ctx);
+        virtio_queue_aio_detach_host_notifier(vq, s->vq_aio_context[i]);
     }
 }
 
@@ -1167,10 +1282,12 @@ static void virtio_scsi_drained_end(SCSIBus *bus)
 
     for (uint32_t i = 0; i < total_queues; i++) {
         VirtQueue *vq = virtio_get_queue(vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
+
         if (vq == vs->event_vq) {
-            virtio_queue_aio_attach_host_notifier_no_poll(vq, s->ctx);
+            virtio_queue_aio_attach_host_notifier_no_poll(vq, ctx);
         } else {
-            virtio_queue_aio_attach_host_notifier(vq, s->ctx);
+            virtio_queue_aio_attach_host_notifier(vq, ctx);
         }
     }
 }
@@ -1282,6 +1399,7 @@ static void virtio_scsi_device_unrealize(DeviceState *dev)
     virtio_scsi_reset_tmf_bh(s);
 
     qbus_set_hotplug_handler(BUS(&s->bus), NULL);
+    virtio_scsi_dataplane_cleanup(s);
     virtio_scsi_common_unrealize(dev);
     qemu_mutex_destroy(&s->tmf_bh_lock);
 }
@@ -1303,6 +1421,8 @@ static Property virtio_scsi_properties[] = {
                                                 VIRTIO_SCSI_F_CHANGE, true),
     DEFINE_PROP_LINK("iothread", VirtIOSCSI, parent_obj.conf.iothread,
                      TYPE_IOTHREAD, IOThread *),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIOSCSI,
+            parent_obj.conf.iothread_vq_mapping_list),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -27,6 +27,7 @@ static const int feature_bits[] = {
     VIRTIO_RING_F_INDIRECT_DESC,
     VIRTIO_RING_F_EVENT_IDX,
     VIRTIO_F_RING_RESET,
+    VIRTIO_F_IN_ORDER,
     VIRTIO_SCMI_F_P2A_CHANNELS,
     VHOST_INVALID_FEATURE_BIT
 };
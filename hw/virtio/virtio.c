@@ -151,6 +151,19 @@ struct VirtQueue
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
     bool host_notifier_enabled;
+
+    /* Notification coalescing, see virtio_queue_set_notification_coalescing */
+    uint32_t coal_max_used;
+    uint32_t coal_usecs;
+    uint32_t coal_used; /* used elements flushed since the last notification */
+    bool coal_pending;  /* a notification has been deferred */
+    bool coal_irqfd;    /* the deferred notification goes through the irqfd */
+    QEMUTimer *coal_timer;
+    AioContext *coal_ctx; /* where coal_timer runs */
+
+    /* Userspace polling statistics while attached to an AioContext */
+    AioPollStats poll_stats;
+
     QLIST_ENTRY(VirtQueue) node;
 };
 
@@ -413,6 +426,34 @@ static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
     address_space_cache_invalidate(&caches->used, pa, sizeof(VRingUsedElem));
 }
 
+/*
+ * Write @n consecutive used ring elements starting at ring[i] with a single
+ * access. The caller ensures that the range does not wrap.
+ *
+ * Called within rcu_read_lock().
+ */
+static inline void vring_used_write_batch(VirtQueue *vq,
+                                          VRingUsedElem *uelems,
+                                          int i, unsigned int n)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    hwaddr pa = offsetof(VRingUsed, ring[i]);
+    unsigned int j;
+
+    if (!caches) {
+        return;
+    }
+
+    for (j = 0; j < n; j++) {
+        virtio_tswap32s(vq->vdev, &uelems[j].id);
+        virtio_tswap32s(vq->vdev, &uelems[j].len);
+    }
+    address_space_write_cached(&caches->used, pa, uelems,
+                               n * sizeof(VRingUsedElem));
+    address_space_cache_invalidate(&caches->used, pa,
+                                   n * sizeof(VRingUsedElem));
+}
+
 /* Called within rcu_read_lock(). */
 static inline uint16_t vring_used_flags(VirtQueue *vq)
 {
@@ -769,6 +810,9 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
                          elem->out_sg[i].iov_len);
 }
 
+static bool virtqueue_ordered_detach(VirtQueue *vq,
+                                     const VirtQueueElement *elem);
+
 /* virtqueue_detach_element:
  * @vq: The #VirtQueue
  * @elem: The #VirtQueueElement
@@ -781,7 +825,11 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len)
 {
-    vq->inuse -= elem->ndescs;
+    /* An in-order element stays in flight until it has been flushed */
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER) ||
+        !virtqueue_ordered_detach(vq, elem)) {
+        vq->inuse -= elem->ndescs;
+    }
     virtqueue_unmap_sg(vq, elem, len);
 }
 
@@ -818,7 +866,12 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
         virtqueue_split_rewind(vq, 1);
     }
 
-    virtqueue_detach_element(vq, elem, len);
+    /*
+     * Not virtqueue_detach_element(): with VIRTIO_F_IN_ORDER, the next pop
+     * records the element again
+     */
+    vq->inuse -= elem->ndescs;
+    virtqueue_unmap_sg(vq, elem, len);
 }
 
 /* virtqueue_rewind:
@@ -864,6 +917,110 @@ static void virtqueue_split_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
+/*
+ * Write @count used elements starting at used_idx. The used ring is
+ * contiguous apart from the wrap at the end, so this takes at most two
+ * accesses. Called within rcu_read_lock().
+ */
+static void virtqueue_split_write_used(VirtQueue *vq, VRingUsedElem *uelems,
+                                       unsigned int count)
+{
+    unsigned int first = vq->used_idx % vq->vring.num;
+    unsigned int chunk = MIN(count, vq->vring.num - first);
+
+    assert(count <= vq->vring.num);
+
+    vring_used_write_batch(vq, uelems, first, chunk);
+    if (chunk < count) {
+        vring_used_write_batch(vq, uelems + chunk, 0, count - chunk);
+    }
+}
+
+/*
+ * With VIRTIO_F_IN_ORDER the elements are returned in the order in which
+ * they were popped. Remember each popped element in used_elems[], indexed by
+ * its position in the ring, so that completions can be reordered.
+ */
+static void virtqueue_ordered_record(VirtQueue *vq,
+                                     const VirtQueueElement *elem,
+                                     unsigned int idx)
+{
+    vq->used_elems[idx].index = elem->index;
+    vq->used_elems[idx].len = 0;
+    vq->used_elems[idx].ndescs = elem->ndescs;
+    vq->used_elems[idx].in_order_filled = false;
+}
+
+/*
+ * Return the position in used_elems[] of the record of @elem, which must still
+ * be in flight, or -1 if there is none
+ */
+static int virtqueue_ordered_find(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    unsigned int i = vq->used_idx % vq->vring.num;
+    unsigned int steps = 0;
+
+    while (steps < vq->inuse) {
+        VirtQueueElement *used = &vq->used_elems[i];
+
+        if (unlikely(!used->ndescs)) {
+            break; /* not recorded, don't loop forever */
+        }
+
+        if (used->index == elem->index && !used->in_order_filled) {
+            return i;
+        }
+
+        steps += used->ndescs;
+        i += used->ndescs;
+        if (i >= vq->vring.num) {
+            i -= vq->vring.num;
+        }
+    }
+    return -1;
+}
+
+/* Mark @elem as completed, it is published once all older ones are done */
+static void virtqueue_ordered_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                   unsigned int len)
+{
+    int i = virtqueue_ordered_find(vq, elem);
+
+    if (i < 0) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: %s cannot fill buffer id %u\n",
+                      __func__, vq->vdev->name, elem->index);
+        return;
+    }
+
+    vq->used_elems[i].len = len;
+    vq->used_elems[i].in_order_filled = true;
+}
+
+/*
+ * A detached element is never filled, so its record would hold back all later
+ * completions. Return it to the guest empty instead, in order.
+ *
+ * Returns true if the element stays in flight until it is flushed.
+ */
+static bool virtqueue_ordered_detach(VirtQueue *vq,
+                                     const VirtQueueElement *elem)
+{
+    int i;
+
+    if (unlikely(!vq->vring.num)) {
+        return false;
+    }
+
+    i = virtqueue_ordered_find(vq, elem);
+    if (i < 0) {
+        return false;
+    }
+
+    vq->used_elems[i].len = 0;
+    vq->used_elems[i].in_order_filled = true;
+    return true;
+}
+
 static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
                                   unsigned int len, unsigned int idx)
 {
@@ -922,7 +1079,9 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         return;
     }
 
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_fill(vq, elem, len);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         virtqueue_packed_fill(vq, elem, len, idx);
     } else {
         virtqueue_split_fill(vq, elem, len, idx);
@@ -973,14 +1132,90 @@ static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
     }
 }
 
+/*
+ * Publish the completed elements at the head of used_elems[], stopping at the
+ * first one that is still in flight. Called within rcu_read_lock().
+ */
+static void virtqueue_ordered_flush(VirtQueue *vq)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    VRingUsedElem uelems[VIRTQUEUE_MAX_SIZE];
+    unsigned int first = vq->used_idx % vq->vring.num;
+    unsigned int i = first;
+    unsigned int count = 0;
+    unsigned int ndescs = 0;
+
+    if (packed ? unlikely(!vq->vring.desc) : unlikely(!vq->vring.used)) {
+        return;
+    }
+
+    while (vq->used_elems[i].in_order_filled && vq->used_elems[i].ndescs &&
+           ndescs < vq->inuse) {
+        VirtQueueElement *used = &vq->used_elems[i];
+
+        if (packed) {
+            /* The first descriptor is written last, see below */
+            if (ndescs) {
+                virtqueue_packed_fill_desc(vq, used, ndescs, false);
+            }
+        } else {
+            uelems[count].id = used->index;
+            uelems[count].len = used->len;
+        }
+        used->in_order_filled = false;
+        count++;
+        ndescs += used->ndescs;
+        i += used->ndescs;
+        if (i >= vq->vring.num) {
+            i -= vq->vring.num;
+        }
+    }
+
+    if (!count) {
+        return;
+    }
+
+    trace_virtqueue_flush(vq, count);
+
+    if (packed) {
+        /* Make the whole batch visible to the guest at once */
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[first], 0, true);
+        vq->inuse -= ndescs;
+        vq->used_idx += ndescs;
+        if (vq->used_idx >= vq->vring.num) {
+            vq->used_idx -= vq->vring.num;
+            vq->used_wrap_counter ^= 1;
+            vq->signalled_used_valid = false;
+        }
+    } else {
+        uint16_t old = vq->used_idx;
+        uint16_t new = old + count;
+
+        virtqueue_split_write_used(vq, uelems, count);
+
+        /* Make sure buffer is written before we update index. */
+        smp_wmb();
+        vring_used_idx_set(vq, new);
+        vq->inuse -= count;
+        if (unlikely((int16_t)(new - vq->signalled_used) <
+                     (uint16_t)(new - old))) {
+            vq->signalled_used_valid = false;
+        }
+    }
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
+    vq->coal_used += count;
+
     if (virtio_device_disabled(vq->vdev)) {
         vq->inuse -= count;
         return;
     }
 
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_flush(vq);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         virtqueue_packed_flush(vq, count);
     } else {
         virtqueue_split_flush(vq, count);
@@ -995,6 +1230,58 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/* Called within rcu_read_lock().  */
+static void virtqueue_split_fill_batch(VirtQueue *vq,
+                                       VirtQueueElement *const *elems,
+                                       const unsigned int *lens,
+                                       unsigned int count)
+{
+    VRingUsedElem uelems[VIRTQUEUE_MAX_SIZE];
+    unsigned int i;
+
+    if (unlikely(!vq->vring.used)) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        uelems[i].id = elems[i]->index;
+        uelems[i].len = lens[i];
+    }
+    virtqueue_split_write_used(vq, uelems, count);
+}
+
+/*
+ * Return @count elements to the guest and publish them with a single used
+ * index update. @lens[i] is the number of bytes written into @elems[i].
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    if (virtio_device_disabled(vq->vdev) ||
+        virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED) ||
+        virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        for (i = 0; i < count; i++) {
+            virtqueue_fill(vq, elems[i], lens[i], i);
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            trace_virtqueue_fill(vq, elems[i], lens[i], i);
+            virtqueue_unmap_sg(vq, elems[i], lens[i]);
+        }
+        virtqueue_split_fill_batch(vq, elems, lens, count);
+    }
+
+    virtqueue_flush(vq, count);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1495,9 +1782,16 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/*
+ * Map the descriptor chain starting at @head, which has already been consumed
+ * from the avail ring.
+ *
+ * Called within rcu_read_lock().
+ */
+static void *virtqueue_split_pop_head(VirtQueue *vq, size_t sz,
+                                      unsigned int head)
 {
-    unsigned int i, head, max;
+    unsigned int i, max;
     VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
@@ -1512,32 +1806,10 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
     max = vq->vring.num;
-
-    if (vq->inuse >= vq->vring.num) {
-        virtio_error(vdev, "Virtqueue size exceeded");
-        goto done;
-    }
-
-    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
-        goto done;
-    }
-
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
     caches = vring_get_region_caches(vq);
@@ -1621,6 +1893,11 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         elem->in_sg[i] = iov[out_num + i];
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_record(vq, elem,
+                                 (vq->last_avail_idx - 1) % vq->vring.num);
+    }
+
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
@@ -1634,6 +1911,112 @@ err_undo_map:
     goto done;
 }
 
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int head;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        return NULL;
+    }
+
+    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
+        return NULL;
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return virtqueue_split_pop_head(vq, sz, head);
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingMemoryRegionCaches *caches;
+    uint16_t heads[VIRTQUEUE_MAX_SIZE];
+    unsigned int num_heads, first, chunk, i;
+    unsigned int count = 0;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return 0;
+    }
+    /*
+     * A single barrier covers all heads fetched below, see comment in
+     * virtqueue_num_heads().
+     */
+    smp_rmb();
+
+    num_heads = (uint16_t)(vq->shadow_avail_idx - vq->last_avail_idx);
+    if (num_heads > vq->vring.num) {
+        virtio_error(vdev, "Guest moved used index from %u to %u",
+                     vq->last_avail_idx, vq->shadow_avail_idx);
+        return 0;
+    }
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        return 0;
+    }
+
+    num_heads = MIN(num_heads, max);
+    num_heads = MIN(num_heads, vq->vring.num - vq->inuse);
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        virtio_error(vdev, "Region caches not initialized");
+        return 0;
+    }
+
+    /* Fetch all heads at once, the avail ring is contiguous until it wraps */
+    first = vq->last_avail_idx % vq->vring.num;
+    chunk = MIN(num_heads, vq->vring.num - first);
+    address_space_read_cached(&caches->avail, offsetof(VRingAvail, ring[first]),
+                              heads, chunk * sizeof(heads[0]));
+    if (chunk < num_heads) {
+        address_space_read_cached(&caches->avail, offsetof(VRingAvail, ring),
+                                  heads + chunk,
+                                  (num_heads - chunk) * sizeof(heads[0]));
+    }
+
+    for (i = 0; i < num_heads; i++) {
+        unsigned int head = virtio_lduw_p(vdev, &heads[i]);
+        void *elem;
+
+        vq->last_avail_idx++;
+
+        /* If their number is silly, that's a fatal mistake. */
+        if (head >= vq->vring.num) {
+            virtio_error(vdev, "Guest says index %u is available", head);
+            break;
+        }
+
+        elem = virtqueue_split_pop_head(vq, sz, head);
+        if (!elem) {
+            break;
+        }
+        elems[count++] = elem;
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return count;
+}
+
 static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, max;
@@ -1749,6 +2132,9 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     elem->index = id;
     elem->ndescs = (desc_cache == &indirect_desc_cache) ? 1 : elem_entries;
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_record(vq, elem, vq->last_avail_idx);
+    }
     vq->last_avail_idx += elem->ndescs;
     vq->inuse += elem->ndescs;
 
@@ -1784,6 +2170,37 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+/*
+ * Pop up to @max elements into @elems and return how many were popped.
+ *
+ * For split virtqueues the avail ring entries are fetched with one access
+ * and one memory barrier for the whole batch. Packed virtqueues fall back to
+ * popping one element at a time.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int count = 0;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        while (count < max) {
+            void *elem = virtqueue_packed_pop(vq, sz);
+
+            if (!elem) {
+                break;
+            }
+            elems[count++] = elem;
+        }
+        return count;
+    }
+
+    return virtqueue_split_pop_batch(vq, sz, elems, max);
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -1821,6 +2238,11 @@ static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
                                                vq->vring.num, &idx, false)) {
             ++elem.ndescs;
         }
+        /* Account for the element like virtqueue_packed_pop() does */
+        if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+            virtqueue_ordered_record(vq, &elem, vq->last_avail_idx);
+        }
+        vq->inuse += elem.ndescs;
         /*
          * immediately push the element, nothing to unmap
          * as both in_num and out_num are set to 0.
@@ -1840,9 +2262,10 @@ static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
 {
     unsigned int dropped = 0;
-    VirtQueueElement elem = {};
+    VirtQueueElement elem = { .ndescs = 1 };
     VirtIODevice *vdev = vq->vdev;
     bool fEventIdx = virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+    bool in_order = virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER);
 
     while (!virtio_queue_empty(vq) && vq->inuse < vq->vring.num) {
         /* works similar to virtqueue_pop but does not map buffers
@@ -1851,6 +2274,10 @@ static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
         if (!virtqueue_get_head(vq, vq->last_avail_idx, &elem.index)) {
             break;
         }
+        if (in_order) {
+            virtqueue_ordered_record(vq, &elem,
+                                     vq->last_avail_idx % vq->vring.num);
+        }
         vq->inuse++;
         vq->last_avail_idx++;
         if (fEventIdx) {
@@ -1921,6 +2348,7 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -2087,6 +2515,15 @@ static void __virtio_queue_reset(VirtIODevice *vdev, uint32_t i)
     vdev->vq[i].notification = true;
     vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
     vdev->vq[i].inuse = 0;
+    if (vdev->vq[i].coal_timer) {
+        timer_del(vdev->vq[i].coal_timer);
+    }
+    vdev->vq[i].coal_used = 0;
+    vdev->vq[i].coal_pending = false;
+    if (vdev->vq[i].used_elems) {
+        memset(vdev->vq[i].used_elems, 0,
+               vdev->vq[i].vring.num_default * sizeof(VirtQueueElement));
+    }
     virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
 }
 
@@ -2316,6 +2753,18 @@ void virtio_queue_set_vector(VirtIODevice *vdev, int n, uint16_t vector)
     }
 }
 
+static void virtio_queue_init_poll_stats(VirtQueue *vq, int n)
+{
+    g_autofree char *path = object_get_canonical_path(OBJECT(vq->vdev));
+
+    g_free(vq->poll_stats.name);
+    vq->poll_stats.name = g_strdup_printf("%s/vq%d",
+                                          path ?: vq->vdev->name, n);
+    stat64_init(&vq->poll_stats.hits, 0);
+    stat64_init(&vq->poll_stats.misses, 0);
+    stat64_init(&vq->poll_stats.wasted_ns, 0);
+}
+
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             VirtIOHandleOutput handle_output)
 {
@@ -2334,6 +2783,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].used_elems = g_new0(VirtQueueElement, queue_size);
+    virtio_queue_init_poll_stats(&vdev->vq[i], i);
 
     return &vdev->vq[i];
 }
@@ -2345,6 +2795,12 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    timer_free(vq->coal_timer);
+    vq->coal_timer = NULL;
+    vq->coal_ctx = NULL;
+    vq->coal_pending = false;
+    g_free(vq->poll_stats.name);
+    vq->poll_stats.name = NULL;
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2456,7 +2912,7 @@ static void virtio_notify_irqfd_deferred_fn(void *opaque)
     event_notifier_set(notifier);
 }
 
-void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_notify_irqfd_now(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
         if (!virtio_should_notify(vdev, vq)) {
@@ -2491,7 +2947,7 @@ static void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_notify_now(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
         if (!virtio_should_notify(vdev, vq)) {
@@ -2503,6 +2959,159 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     virtio_irq(vq);
 }
 
+/*
+ * Set the notification coalescing parameters of @vq. A notification is
+ * delayed by at most @usecs microseconds, unless @max_used used elements
+ * have been returned to the guest in the meantime. Either limit can be 0 to
+ * only apply the other one, and both being 0 disables coalescing. Note that
+ * with @usecs == 0, the guest is not notified until @max_used elements have
+ * been returned.
+ */
+static void virtio_queue_coalesce_timer_cb(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    vq->coal_used = 0;
+    vq->coal_pending = false;
+    if (vq->coal_irqfd) {
+        virtio_notify_irqfd_now(vq->vdev, vq);
+    } else {
+        virtio_notify_now(vq->vdev, vq);
+    }
+}
+
+/*
+ * Create the coalescing timer of @vq in @ctx, which processes @vq from now on.
+ * A notification that is still deferred in the old AioContext is sent first,
+ * so that it doesn't get lost with the old timer.
+ */
+static void virtio_queue_coalesce_bind(VirtQueue *vq, AioContext *ctx)
+{
+    if (vq->coal_timer) {
+        timer_del(vq->coal_timer);
+        if (vq->coal_pending) {
+            virtio_queue_coalesce_timer_cb(vq);
+        }
+        if (vq->coal_ctx == ctx) {
+            return;
+        }
+        timer_free(vq->coal_timer);
+    }
+
+    vq->coal_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_US,
+                                   virtio_queue_coalesce_timer_cb, vq);
+    vq->coal_ctx = ctx;
+}
+
+void virtio_queue_set_notification_coalescing(VirtQueue *vq,
+                                              uint32_t max_used,
+                                              uint32_t usecs)
+{
+    /* Queues without ioeventfd are processed in the main loop */
+    if (!vq->coal_timer) {
+        virtio_queue_coalesce_bind(vq, qemu_get_aio_context());
+    }
+
+    qatomic_set(&vq->coal_max_used, max_used);
+    qatomic_set(&vq->coal_usecs, usecs);
+}
+
+/*
+ * Returns true if the notification has been deferred. Only the AioContext
+ * that owns the coalescing timer of @vq can defer notifications, see
+ * virtio_queue_coalesce_bind().
+ */
+static bool virtio_queue_coalesce_notify(VirtQueue *vq, bool irqfd)
+{
+    uint32_t usecs = qatomic_read(&vq->coal_usecs);
+    uint32_t max_used = qatomic_read(&vq->coal_max_used);
+
+    if (!usecs && !max_used) {
+        return false;
+    }
+
+    if (vq->coal_ctx != qemu_get_current_aio_context()) {
+        return false;
+    }
+
+    /*
+     * Nothing may be deferred past the point where the device state is saved,
+     * see virtio_queue_coalesce_flush_all()
+     */
+    if (!vq->vdev->vm_running) {
+        return false;
+    }
+
+    if (max_used && vq->coal_used >= max_used) {
+        vq->coal_used = 0;
+        vq->coal_pending = false;
+        timer_del(vq->coal_timer);
+        return false;
+    }
+
+    vq->coal_irqfd = irqfd;
+    vq->coal_pending = true;
+
+    /* Without a delay, only the number of used elements counts */
+    if (usecs && !timer_pending(vq->coal_timer)) {
+        timer_mod(vq->coal_timer,
+                  qemu_clock_get_us(QEMU_CLOCK_REALTIME) + usecs);
+    }
+    return true;
+}
+
+/*
+ * Send a deferred notification right away, e.g. because @vq is about to move
+ * to another AioContext. Only the AioContext in which the notification was
+ * deferred can do this.
+ */
+static void virtio_queue_coalesce_flush(VirtQueue *vq)
+{
+    if (!vq->coal_ctx || vq->coal_ctx != qemu_get_current_aio_context()) {
+        return;
+    }
+
+    timer_del(vq->coal_timer);
+    if (vq->coal_pending) {
+        virtio_queue_coalesce_timer_cb(vq);
+    }
+}
+
+/*
+ * Send the notifications that are deferred in the main loop before the VM
+ * stops or the device state is saved, otherwise they would fire after the
+ * state has been migrated and the destination would never see them. Queues
+ * processed in an iothread have already flushed theirs when their host
+ * notifiers were detached from it.
+ */
+static void virtio_queue_coalesce_flush_all(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num == 0) {
+            break;
+        }
+        virtio_queue_coalesce_flush(&vdev->vq[i]);
+    }
+}
+
+void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (virtio_queue_coalesce_notify(vq, true)) {
+        return;
+    }
+    virtio_notify_irqfd_now(vdev, vq);
+}
+
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (virtio_queue_coalesce_notify(vq, false)) {
+        return;
+    }
+    virtio_notify_now(vdev, vq);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -2569,6 +3178,13 @@ static bool virtio_extra_state_needed(void *opaque)
         k->has_extra_state(qbus->parent);
 }
 
+static bool virtio_in_order_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER);
+}
+
 static bool virtio_broken_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -2711,6 +3327,147 @@ static const VMStateDescription vmstate_virtio_extra_state = {
     }
 };
 
+/*
+ * With VIRTIO_F_IN_ORDER, used_elems[] holds the order of the elements in
+ * flight and whether they have already been completed. Elements that a device
+ * migrates itself cannot be completed on the destination without their
+ * records, and completed ones that wait for older elements would be lost.
+ */
+static int get_in_order_state(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field)
+{
+    VirtIODevice *vdev = pv;
+    uint32_t num = qemu_get_be32(f);
+    uint32_t i, j;
+
+    if (num > VIRTIO_QUEUE_MAX) {
+        error_report("Invalid number of in-order virtqueues: 0x%x", num);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < num; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        uint32_t count = qemu_get_be32(f);
+
+        if (!vq->used_elems || count > vq->vring.num) {
+            error_report("VQ %u: invalid number of in-order elements 0x%x",
+                         i, count);
+            return -EINVAL;
+        }
+
+        for (j = 0; j < count; j++) {
+            uint16_t pos = qemu_get_be16(f);
+            VirtQueueElement *used;
+
+            if (pos >= vq->vring.num) {
+                error_report("VQ %u: invalid in-order element position 0x%x",
+                             i, pos);
+                return -EINVAL;
+            }
+
+            used = &vq->used_elems[pos];
+            used->index = qemu_get_be32(f);
+            used->len = qemu_get_be32(f);
+            used->ndescs = qemu_get_be32(f);
+            used->in_order_filled = qemu_get_byte(f);
+            if (!used->ndescs || used->ndescs > vq->vring.num) {
+                error_report("VQ %u: invalid in-order element size 0x%x",
+                             i, used->ndescs);
+                return -EINVAL;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Call @fn for each element in flight, oldest first */
+static void virtqueue_ordered_foreach(VirtQueue *vq,
+                                      void (*fn)(VirtQueue *vq,
+                                                 unsigned int pos,
+                                                 void *opaque),
+                                      void *opaque)
+{
+    unsigned int i = vq->used_idx % vq->vring.num;
+    unsigned int steps = 0;
+
+    while (steps < vq->inuse && vq->used_elems[i].ndescs) {
+        fn(vq, i, opaque);
+
+        steps += vq->used_elems[i].ndescs;
+        i += vq->used_elems[i].ndescs;
+        if (i >= vq->vring.num) {
+            i -= vq->vring.num;
+        }
+    }
+}
+
+static void count_in_order_elem(VirtQueue *vq, unsigned int pos, void *opaque)
+{
+    uint32_t *count = opaque;
+
+    (*count)++;
+}
+
+static void put_in_order_elem(VirtQueue *vq, unsigned int pos, void *opaque)
+{
+    QEMUFile *f = opaque;
+    VirtQueueElement *used = &vq->used_elems[pos];
+
+    qemu_put_be16(f, pos);
+    qemu_put_be32(f, used->index);
+    qemu_put_be32(f, used->len);
+    qemu_put_be32(f, used->ndescs);
+    qemu_put_byte(f, used->in_order_filled);
+}
+
+static int put_in_order_state(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field, JSONWriter *vmdesc)
+{
+    VirtIODevice *vdev = pv;
+    uint32_t num, i;
+
+    for (num = 0; num < VIRTIO_QUEUE_MAX; num++) {
+        if (vdev->vq[num].vring.num == 0) {
+            break;
+        }
+    }
+
+    qemu_put_be32(f, num);
+    for (i = 0; i < num; i++) {
+        uint32_t count = 0;
+
+        virtqueue_ordered_foreach(&vdev->vq[i], count_in_order_elem, &count);
+        qemu_put_be32(f, count);
+        virtqueue_ordered_foreach(&vdev->vq[i], put_in_order_elem, f);
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_in_order_state = {
+    .name = "virtqueue_in_order_state",
+    .get = get_in_order_state,
+    .put = put_in_order_state,
+};
+
+static const VMStateDescription vmstate_virtio_in_order = {
+    .name = "virtio/in_order",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_in_order_needed,
+    .fields = (const VMStateField[]) {
+        {
+            .name         = "in_order_state",
+            .version_id   = 0,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &vmstate_info_in_order_state,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_virtio_device_endian = {
     .name = "virtio/device_endian",
     .version_id = 1,
@@ -2783,6 +3540,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_started,
         &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_disabled,
+        &vmstate_virtio_in_order,
         NULL
     }
 };
@@ -2795,6 +3553,8 @@ int virtio_save(VirtIODevice *vdev, QEMUFile *f)
     uint32_t guest_features_lo = (vdev->guest_features & 0xffffffff);
     int i;
 
+    virtio_queue_coalesce_flush_all(vdev);
+
     if (k->save_config) {
         k->save_config(qbus->parent, f);
     }
@@ -3201,6 +3961,10 @@ static void virtio_vmstate_change(void *opaque, bool running, RunState state)
     if (!backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
+
+    if (!running) {
+        virtio_queue_coalesce_flush_all(vdev);
+    }
 }
 
 void virtio_instance_init_common(Object *proxy_obj, void *data,
@@ -3613,6 +4377,11 @@ void virtio_queue_aio_attach_host_notifier(VirtQueue *vq, AioContext *ctx)
     aio_set_event_notifier_poll(ctx, &vq->host_notifier,
                                 virtio_queue_host_notifier_aio_poll_begin,
                                 virtio_queue_host_notifier_aio_poll_end);
+    aio_set_event_notifier_poll_stats(ctx, &vq->host_notifier,
+                                      &vq->poll_stats);
+
+    /* Deferred notifications are sent from ctx from now on */
+    virtio_queue_coalesce_bind(vq, ctx);
 
     /*
      * We will have ignored notifications about new requests from the guest
@@ -3639,6 +4408,9 @@ void virtio_queue_aio_attach_host_notifier_no_poll(VirtQueue *vq, AioContext *ct
                            virtio_queue_host_notifier_read,
                            NULL, NULL);
 
+    /* See virtio_queue_aio_attach_host_notifier() */
+    virtio_queue_coalesce_bind(vq, ctx);
+
     /*
      * See virtio_queue_aio_attach_host_notifier().
      * Note that this may be unnecessary for the type of virtqueues this
@@ -3652,6 +4424,9 @@ void virtio_queue_aio_detach_host_notifier(VirtQueue *vq, AioContext *ctx)
 {
     aio_set_event_notifier(ctx, &vq->host_notifier, NULL, NULL, NULL);
 
+    /* Don't leave a coalesced notification behind in the old AioContext */
+    virtio_queue_coalesce_flush(vq);
+
     /*
      * aio_set_event_notifier_poll() does not guarantee whether io_poll_end()
      * will run after io_poll_begin(), so by removing the notifier, we do not
@@ -3792,6 +4567,7 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
             break;
         }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+        g_free(vdev->vq[i].poll_stats.name);
     }
     g_free(vdev->vq);
 }
@@ -79,6 +79,35 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: values below
+ * 2^BLOCK_ACCT_HDR_SUB_BITS have their own bucket, larger values are split
+ * into 2^BLOCK_ACCT_HDR_SUB_BITS buckets per power of two, which keeps the
+ * relative error of reported percentiles below 1/2^BLOCK_ACCT_HDR_SUB_BITS.
+ */
+#define BLOCK_ACCT_HDR_SUB_BITS 4
+#define BLOCK_ACCT_HDR_BUCKETS \
+    ((64 - BLOCK_ACCT_HDR_SUB_BITS + 1) << BLOCK_ACCT_HDR_SUB_BITS)
+
+typedef struct BlockAcctHdrHistogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[BLOCK_ACCT_HDR_BUCKETS];
+} BlockAcctHdrHistogram;
+
+/* Latency statistics of one device queue */
+typedef struct BlockAcctQueueStats {
+    BlockAcctHdrHistogram *latency_hdr[BLOCK_MAX_IOTYPE];
+} BlockAcctQueueStats;
+
+typedef struct BlockAcctPercentiles {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} BlockAcctPercentiles;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -92,12 +121,16 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    /* Allocated on first use */
+    BlockAcctHdrHistogram *latency_hdr[BLOCK_MAX_IOTYPE];
+    GPtrArray *queues; /* of BlockAcctQueueStats, indexed by queue */
 };
 
 typedef struct BlockAcctCookie {
     int64_t bytes;
     int64_t start_time_ns;
     enum BlockAcctType type;
+    int queue; /* device queue of the request, or -1 */
 } BlockAcctCookie;
 
 void block_acct_init(BlockAcctStats *stats);
@@ -109,6 +142,9 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
                                               BlockAcctTimedStats *s);
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type);
+void block_acct_start_queue(BlockAcctStats *stats, BlockAcctCookie *cookie,
+                            int64_t bytes, enum BlockAcctType type,
+                            int queue);
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
@@ -120,5 +156,9 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+unsigned block_acct_nb_queues(BlockAcctStats *stats);
+bool block_acct_latency_percentiles(BlockAcctStats *stats, int queue,
+                                    enum BlockAcctType type,
+                                    BlockAcctPercentiles *pct);
 
 #endif
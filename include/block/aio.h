@@ -20,6 +20,7 @@
 #include "qemu/coroutine-core.h"
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
+#include "qemu/stats64.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "block/graph-lock.h"
@@ -57,6 +58,25 @@ struct ThreadPool;
 struct LinuxAioState;
 typedef struct LuringState LuringState;
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * A request submitted with aio_add_sqe().  The caller embeds this in its own
+ * request struct and is called back with the cqe once the request completes.
+ */
+typedef struct CqeHandler CqeHandler;
+typedef void CqeHandlerFunc(CqeHandler *cqe_handler);
+
+struct CqeHandler {
+    CqeHandlerFunc *cb;
+
+    /* Filled in by the AioContext before ->cb() is invoked */
+    struct io_uring_cqe cqe;
+
+    /* Used internally, do not access */
+    QSIMPLEQ_ENTRY(CqeHandler) next;
+};
+#endif /* CONFIG_LINUX_IO_URING */
+
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
 
@@ -105,6 +125,19 @@ typedef struct {
      * Returns: true if ->wait() should be called, false otherwise.
      */
     bool (*need_wait)(AioContext *ctx);
+
+    /*
+     * dispatch:
+     * @ctx: the AioContext
+     *
+     * Optional.  Invoke completion callbacks of requests that the file
+     * descriptor monitoring implementation collected in ->wait().
+     *
+     * Called with ctx->list_lock incremented but not locked.
+     *
+     * Returns: true if progress was made, false otherwise.
+     */
+    bool (*dispatch)(AioContext *ctx);
 } FDMonOps;
 
 /*
@@ -217,6 +250,12 @@ struct AioContext {
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+    AioHandlerList fdmon_io_uring_ready_list; /* reaped outside ->wait() */
+    bool fdmon_io_uring_multishot; /* is IORING_POLL_ADD_MULTI supported? */
+
+    /* Requests submitted with aio_add_sqe() */
+    unsigned cqe_handlers_in_flight;
+    QSIMPLEQ_HEAD(, CqeHandler) cqe_handler_ready_list;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -227,8 +266,10 @@ struct AioContext {
     /* Number of AioHandlers without .io_poll() */
     int poll_disable_cnt;
 
-    /* Polling mode parameters */
-    int64_t poll_ns;        /* current polling time in nanoseconds */
+    /*
+     * Polling mode parameters.  The current polling time is tracked per
+     * AioHandler, see AioPolledEvent.
+     */
     int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
@@ -494,6 +535,38 @@ void aio_set_event_notifier_poll(AioContext *ctx,
                                  EventNotifierHandler *io_poll_begin,
                                  EventNotifierHandler *io_poll_end);
 
+/*
+ * Userspace polling statistics of an event source.  The memory is owned by the
+ * caller so that the statistics survive the handler being removed and added
+ * again, e.g. around drained sections.
+ */
+typedef struct AioPollStats {
+    char *name;         /* reported by query-iothreads, may be NULL */
+    Stat64 hits;        /* events detected by userspace polling */
+    Stat64 misses;      /* events that arrived after polling gave up */
+    Stat64 wasted_ns;   /* polling time during which no event was detected */
+} AioPollStats;
+
+/*
+ * Attach polling statistics to an event notifier that has already been
+ * registered with aio_set_event_notifier.  Do nothing if the event notifier is
+ * not registered.  @stats must stay valid until the notifier is removed.
+ */
+void aio_set_event_notifier_poll_stats(AioContext *ctx,
+                                       EventNotifier *notifier,
+                                       AioPollStats *stats);
+
+typedef void AioPollStatsFn(const AioPollStats *stats, int64_t poll_ns,
+                            void *opaque);
+
+/*
+ * Call @fn for each handler of @ctx that is registered with polling
+ * statistics, together with its current adaptive polling time in nanoseconds.
+ * May be called from any thread.
+ */
+void aio_context_foreach_poll_stats(AioContext *ctx, AioPollStatsFn *fn,
+                                    void *opaque);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -513,6 +586,36 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_has_io_uring:
+ * @ctx: the aio context
+ *
+ * Returns: true if @ctx monitors its file descriptors with io_uring, in which
+ * case aio_add_sqe() can be used to submit requests on the same ring.
+ */
+bool aio_has_io_uring(AioContext *ctx);
+
+/**
+ * aio_add_sqe:
+ * @prep_sqe: function to fill in the sqe
+ * @opaque: data for @prep_sqe
+ * @cqe_handler: called with the cqe when the request completes
+ *
+ * Submit an io_uring request on the current AioContext's event loop ring.  The
+ * sqe is submitted together with the next file descriptor monitoring update
+ * and its completion is dispatched by aio_poll() like a ready fd handler,
+ * without the eventfd wakeup and extra io_uring_enter(2) of a separate ring.
+ *
+ * The user_data field of the sqe is reserved and must not be set by
+ * @prep_sqe.  Only call this from the AioContext's home thread and only when
+ * aio_has_io_uring() is true.
+ */
+void aio_add_sqe(void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, CqeHandler *cqe_handler);
+#endif /* CONFIG_LINUX_IO_URING */
+
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
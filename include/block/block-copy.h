@@ -24,6 +24,17 @@ typedef void (*BlockCopyAsyncCallbackFunc)(void *opaque);
 typedef struct BlockCopyState BlockCopyState;
 typedef struct BlockCopyCallState BlockCopyCallState;
 
+typedef struct BlockCopyStats {
+    /* Current maximum request length */
+    int64_t chunk_size;
+    /* Current maximum number of parallel requests of auto-tuned calls */
+    int max_workers;
+    /* Smoothed request latency, 0 if no request has finished yet */
+    uint64_t latency_ns;
+    /* Bytes per second, measured over the last tuning window */
+    uint64_t throughput;
+} BlockCopyStats;
+
 BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      const BdrvDirtyBitmap *bitmap,
                                      Error **errp);
@@ -33,6 +44,14 @@ void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
                               bool compress);
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm);
 
+/*
+ * Let block_copy_async() calls adapt chunk size and number of parallel
+ * requests to the latency and throughput of the target, within the limits
+ * given by @max_chunk and @max_workers. Calls of block_copy() are never
+ * limited, but their requests are taken into account.
+ */
+void block_copy_set_auto_tune(BlockCopyState *s, bool auto_tune);
+
 void block_copy_state_free(BlockCopyState *s);
 
 void block_copy_reset(BlockCopyState *s, int64_t offset, int64_t bytes);
@@ -96,6 +115,7 @@ void block_copy_call_cancel(BlockCopyCallState *call_state);
 
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 int64_t block_copy_cluster_size(BlockCopyState *s);
+void block_copy_get_stats(BlockCopyState *s, BlockCopyStats *stats);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
 #endif /* BLOCK_COPY_H */
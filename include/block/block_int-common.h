@@ -513,6 +513,19 @@ struct BlockDriver {
         BlockDriverState *bs, int64_t offset, int bytes,
         BlockCompletionFunc *cb, void *opaque);
 
+    /*
+     * Optional fast path for plain reads and writes that bypasses coroutines,
+     * see bdrv_aio_prwv_fast().  The generic block layer has already checked
+     * alignment and bounds and tracks the request.
+     *
+     * Returns false without side effects if the request must take the
+     * coroutine path instead.  Otherwise @cb is called with 0 or -errno once
+     * the request completes, but never before this function returns.
+     */
+    bool GRAPH_RDLOCK_PTR (*bdrv_aio_prwv_fast)(BlockDriverState *bs,
+        int64_t offset, int64_t bytes, QEMUIOVector *qiov, bool is_write,
+        BlockCompletionFunc *cb, void *opaque);
+
     int coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_readv)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 
@@ -29,6 +29,12 @@ typedef struct BlockExportDriver {
      */
     size_t instance_size;
 
+    /*
+     * True if the driver can process requests in several iothreads at once
+     * and therefore accepts the iothreads option.
+     */
+    bool supports_multi_iothread;
+
     /* Creates and starts a new block export */
     int (*create)(BlockExport *, BlockExportOptions *, Error **);
 
@@ -73,6 +79,14 @@ struct BlockExport {
     /* The AioContext whose lock protects this BlockExport object. */
     AioContext *ctx;
 
+    /*
+     * The AioContexts of the iothreads given in the iothreads option, or
+     * NULL if the export runs only in @ctx. Drivers that support multiple
+     * iothreads distribute their work across these.
+     */
+    AioContext **iothread_ctxs;
+    size_t num_iothread_ctxs;
+
     /* The block device to export */
     BlockBackend *blk;
 
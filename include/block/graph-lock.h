@@ -156,6 +156,23 @@ bdrv_graph_co_rdlock(void);
 void coroutine_fn TSA_RELEASE_SHARED(graph_lock) TSA_NO_TSA
 bdrv_graph_co_rdunlock(void);
 
+/*
+ * bdrv_graph_rdlock_nowait:
+ * Like bdrv_graph_co_rdlock(), but for callers outside of coroutine context,
+ * which cannot wait for a writer. Returns false without taking the lock if a
+ * writer is modifying the graph or waiting to do so.
+ *
+ * The lock may be released from a callback that runs later in the same
+ * AioContext, for example on I/O completion.
+ */
+bool TSA_NO_TSA bdrv_graph_rdlock_nowait(void);
+
+/*
+ * bdrv_graph_rdunlock_nowait:
+ * Release the lock taken with bdrv_graph_rdlock_nowait().
+ */
+void TSA_NO_TSA bdrv_graph_rdunlock_nowait(void);
+
 /*
  * bdrv_graph_rd{un}lock_main_loop:
  * Just a placeholder to mark where the graph rdlock should be taken
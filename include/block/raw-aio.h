@@ -71,6 +71,10 @@ void luring_cleanup(LuringState *s);
 /* luring_co_submit: submit I/O requests in the thread's current AioContext. */
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
                                   QEMUIOVector *qiov, int type);
+/* luring_aio_submit: callback-based submission on the AioContext's ring. */
+void luring_aio_submit(BlockDriverState *bs, int fd, uint64_t offset,
+                       QEMUIOVector *qiov, int type,
+                       BlockCompletionFunc *cb, void *opaque);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 #endif
@@ -57,6 +57,16 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[THROTTLE_MAX];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /* I/O that was already accounted in the group in advance and that can
+     * be performed without taking the group lock.  Only accessed from
+     * aio_context.  The credit is dropped when credit_gen no longer matches
+     * the group's.
+     */
+    uint64_t       credit_bytes[THROTTLE_MAX];
+    double         credit_units[THROTTLE_MAX];
+    uint64_t       credit_op_size;
+    unsigned       credit_gen;
+
 } ThrottleGroupMember;
 
 #define TYPE_THROTTLE_GROUP "throttle-group"
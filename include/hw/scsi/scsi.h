@@ -34,6 +34,9 @@ struct SCSIRequest {
     SCSICommand       cmd;
     NotifierList      cancel_notifiers;
 
+    /* The AioContext that submitted the request and processes it */
+    AioContext        *ctx;
+
     /* Note:
      * - fields before sense are initialized by scsi_req_alloc;
      * - sense[] is uninitialized;
@@ -77,9 +80,11 @@ struct SCSIDevice
     uint32_t sense_len;
 
     /*
-     * The requests list is only accessed from the AioContext that executes
-     * requests or from the main loop when IOThread processing is stopped.
+     * Requests may be submitted from several AioContexts if the HBA maps its
+     * queues to different IOThreads, so the requests list is protected by
+     * requests_lock. Each request itself is only accessed from req->ctx.
      */
+    QemuMutex requests_lock;
     QTAILQ_HEAD(, SCSIRequest) requests;
 
     uint32_t channel;
@@ -231,6 +236,9 @@ void scsi_req_retry(SCSIRequest *req);
 void scsi_device_drained_begin(SCSIDevice *sdev);
 void scsi_device_drained_end(SCSIDevice *sdev);
 void scsi_device_purge_requests(SCSIDevice *sdev, SCSISense sense);
+void scsi_device_for_each_req_async(SCSIDevice *s,
+                                    void (*fn)(SCSIRequest *, void *),
+                                    void *opaque);
 void scsi_device_set_ua(SCSIDevice *sdev, SCSISense sense);
 void scsi_device_report_change(SCSIDevice *dev, SCSISense sense);
 void scsi_device_unit_attention_reported(SCSIDevice *dev);
@@ -227,6 +227,11 @@ struct VirtIONet {
     struct EBPFRSSContext ebpf_rss;
     uint32_t nr_ebpf_rss_fds;
     char **ebpf_rss_fds;
+    /* VIRTIO_NET_F_NOTF_COAL parameters */
+    uint32_t rx_coal_usecs;
+    uint32_t rx_coal_max_packets;
+    uint32_t tx_coal_usecs;
+    uint32_t tx_coal_max_packets;
 };
 
 size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
@@ -49,6 +49,8 @@ struct QIOChannelSocket {
     socklen_t remoteAddrLen;
     ssize_t zero_copy_queued;
     ssize_t zero_copy_sent;
+    /* See qio_channel_socket_enable_zero_copy() */
+    bool zero_copy_fallback;
 };
 
 
@@ -262,4 +264,49 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Enable MSG_ZEROCOPY on a connected socket so that writes
+ * can use QIO_CHANNEL_WRITE_FLAG_ZERO_COPY. Sockets created
+ * with qio_channel_socket_connect_sync() try to do this
+ * automatically; this is for other sockets, e.g. accepted
+ * client connections.
+ *
+ * Unlike on sockets set up by qio_channel_socket_connect_sync(),
+ * a zero copy write that fails because the process cannot lock
+ * enough memory (ENOBUFS) is retried as a normal, copying write.
+ * Completions of zero copy writes that are still outstanding
+ * are also collected whenever a read would block, since they
+ * make the socket report an error condition, which would
+ * otherwise wake up the reader over and over.
+ *
+ * Returns: 0 on success, -1 if zero copy is not supported
+ * for this socket
+ */
+int qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc,
+                                        Error **errp);
+
+
+/**
+ * qio_channel_socket_poll_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Collect the completion notifications of zero copy writes
+ * that are already available and update @ioc->zero_copy_sent
+ * accordingly. Unlike qio_channel_flush(), this never blocks,
+ * so it is suitable for use from coroutines and event loop
+ * callbacks. A buffer written with QIO_CHANNEL_WRITE_FLAG_ZERO_COPY
+ * may be reused once @ioc->zero_copy_sent reaches the value of
+ * @ioc->zero_copy_queued right after the write.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_socket_poll_zero_copy(QIOChannelSocket *ioc,
+                                      Error **errp);
+
+
 #endif /* QIO_CHANNEL_SOCKET_H */
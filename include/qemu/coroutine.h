@@ -281,6 +281,35 @@ void qemu_coroutine_inc_pool_size(unsigned int additional_pool_size);
  */
 void qemu_coroutine_dec_pool_size(unsigned int additional_pool_size);
 
+/**
+ * Return the coroutine pool size requested by users of coroutines
+ */
+unsigned int qemu_coroutine_get_pool_max_size(void);
+
+/**
+ * Return the number of coroutines in the pool shared between threads
+ */
+unsigned int qemu_coroutine_get_release_pool_size(void);
+
+typedef struct CoroutinePoolStats {
+    int thread_id;
+    uint64_t hits;              /* coroutines reused from the pool */
+    uint64_t misses;            /* coroutines allocated, pool was empty */
+    uint64_t frees;             /* terminated coroutines freed, pool was full */
+    unsigned int pool_size;     /* coroutines currently in the thread's pool */
+    unsigned int peak_demand;   /* recent maximum the thread's pool needed */
+} CoroutinePoolStats;
+
+typedef void CoroutinePoolStatsFn(const CoroutinePoolStats *stats,
+                                  void *opaque);
+
+/**
+ * Call @fn with the coroutine pool statistics of each thread that has used
+ * coroutines.  @fn must not create or delete coroutines.
+ */
+void qemu_coroutine_pool_foreach_thread(CoroutinePoolStatsFn *fn,
+                                        void *opaque);
+
 #include "qemu/lockable.h"
 
 /**
@@ -16,6 +16,7 @@
 #include "io/channel-file.h"
 #include "io/net-listener.h"
 #include "qapi/error.h"
+#include "qemu/thread.h"
 #include "standard-headers/linux/virtio_blk.h"
 
 /* A kick fd that we monitor on behalf of libvhost-user */
@@ -24,6 +25,7 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    bool enabled; /* false while the fd is not monitored */
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -32,6 +34,11 @@ typedef struct VuFdWatch {
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
  * callbacks and virtqueue kicks run in the given AioContext.
+ *
+ * If virtqueue AioContexts are given, the kicks of virtqueue n are processed
+ * in vq_ctxs[n % num_vq_ctxs] instead.  vq_locks[i] is held while vq_ctxs[i]
+ * accesses the virtqueues or guest memory, and vhost-user message processing
+ * takes all of them because it may change either.
  */
 typedef struct {
     QIONetListener *listener;
@@ -40,12 +47,20 @@ typedef struct {
     int max_queues;
     const VuDevIface *vu_iface;
 
+    AioContext **vq_ctxs;
+    QemuRecMutex *vq_locks;
+    unsigned int num_vq_ctxs;
+
     unsigned int in_flight; /* atomic */
 
+    /* Serialises wait_idle with the last in-flight request across threads */
+    QemuMutex wait_idle_lock;
+
     /* Protected by ctx lock */
     bool in_qio_channel_yield;
     bool wait_idle;
     bool quiescing;
+    bool vqs_locked; /* all vq_locks are held for a vhost-user message */
     VuDev vu_dev;
     QIOChannel *ioc; /* The I/O channel with the client */
     QIOChannelSocket *sioc; /* The underlying data channel with the client */
@@ -57,16 +72,27 @@ typedef struct {
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
+                             AioContext **vq_ctxs,
+                             unsigned int num_vq_ctxs,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp);
 
 void vhost_user_server_stop(VuServer *server);
+void vhost_user_server_cleanup(VuServer *server);
 
 void vhost_user_server_inc_in_flight(VuServer *server);
 void vhost_user_server_dec_in_flight(VuServer *server);
 bool vhost_user_server_has_in_flight(VuServer *server);
 
+/*
+ * Must be held around accesses to virtqueue @vq_index from outside its kick
+ * handler, e.g. when completing requests.  No-op without virtqueue
+ * AioContexts.
+ */
+void vhost_user_server_lock_vq(VuServer *server, int vq_index);
+void vhost_user_server_unlock_vq(VuServer *server, int vq_index);
+
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
 void vhost_user_server_detach_aio_context(VuServer *server);
 
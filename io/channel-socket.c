@@ -498,6 +498,11 @@ static void qio_channel_socket_copy_fds(struct msghdr *msg,
 }
 
 
+#ifdef QEMU_MSG_ZEROCOPY
+static int qio_channel_socket_reap_zero_copy(QIOChannelSocket *sioc,
+                                             bool wait, Error **errp);
+#endif
+
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
                                         size_t niov,
@@ -533,6 +538,17 @@ static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
     ret = recvmsg(sioc->fd, &msg, sflags);
     if (ret < 0) {
         if (errno == EAGAIN) {
+#ifdef QEMU_MSG_ZEROCOPY
+            /*
+             * Pending zero copy completions make the socket poll as
+             * G_IO_ERR, which wakes up a reader waiting for G_IO_IN
+             * without anything to read. Collect them so it can sleep.
+             */
+            if (sioc->zero_copy_fallback &&
+                qio_channel_socket_reap_zero_copy(sioc, false, errp) < 0) {
+                return -1;
+            }
+#endif
             return QIO_CHANNEL_ERR_BLOCK;
         }
         if (errno == EINTR) {
@@ -566,6 +582,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     size_t fdsize = sizeof(int) * nfds;
     struct cmsghdr *cmsg;
     int sflags = 0;
+    bool zero_copy = false;
 
     memset(control, 0, CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS));
 
@@ -593,6 +610,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
 #ifdef QEMU_MSG_ZEROCOPY
         sflags = MSG_ZEROCOPY;
+        zero_copy = true;
 #else
         /*
          * We expect QIOChannel class entry point to have
@@ -611,7 +629,13 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
         case EINTR:
             goto retry;
         case ENOBUFS:
-            if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+            if (zero_copy) {
+                if (sioc->zero_copy_fallback) {
+                    /* Not enough locked memory, copy the data instead */
+                    sflags = 0;
+                    zero_copy = false;
+                    goto retry;
+                }
                 error_setg_errno(errp, errno,
                                  "Process can't lock enough memory for using MSG_ZEROCOPY");
                 return -1;
@@ -624,7 +648,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
         return -1;
     }
 
-    if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+    if (zero_copy) {
         sioc->zero_copy_queued++;
     }
 
@@ -725,10 +749,18 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 
 
 #ifdef QEMU_MSG_ZEROCOPY
-static int qio_channel_socket_flush(QIOChannel *ioc,
-                                    Error **errp)
+/*
+ * Process zero copy completion notifications from the socket error queue.
+ * If @wait is true, block until all queued writes have completed; otherwise
+ * only process the notifications that are already available.
+ *
+ * Returns -1 on error, 0 if any write completed using zero copy and 1 if
+ * the kernel had to copy the data of all completed writes.
+ */
+static int qio_channel_socket_reap_zero_copy(QIOChannelSocket *sioc,
+                                             bool wait, Error **errp)
 {
-    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
     struct msghdr msg = {};
     struct sock_extended_err *serr;
     struct cmsghdr *cm;
@@ -747,10 +779,14 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
     ret = 1;
 
     while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
-        received = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
+        received = recvmsg(sioc->fd, &msg,
+                           MSG_ERRQUEUE | (wait ? 0 : MSG_DONTWAIT));
         if (received < 0) {
             switch (errno) {
             case EAGAIN:
+                if (!wait) {
+                    return ret;
+                }
                 /* Nothing on errqueue, wait until something is available */
                 qio_channel_wait(ioc, G_IO_ERR);
                 continue;
@@ -800,8 +836,46 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
     return ret;
 }
 
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    return qio_channel_socket_reap_zero_copy(QIO_CHANNEL_SOCKET(ioc), true,
+                                             errp);
+}
+
 #endif /* QEMU_MSG_ZEROCOPY */
 
+int qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc,
+                                        Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) < 0) {
+        error_setg_errno(errp, errno, "Unable to enable zero copy on socket");
+        return -1;
+    }
+
+    qio_channel_set_feature(QIO_CHANNEL(ioc),
+                            QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+    ioc->zero_copy_fallback = true;
+    return 0;
+#else
+    error_setg(errp, "Zero copy is not supported on this host");
+    return -1;
+#endif
+}
+
+int qio_channel_socket_poll_zero_copy(QIOChannelSocket *ioc,
+                                      Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    return qio_channel_socket_reap_zero_copy(ioc, false, errp) < 0 ? -1 : 0;
+#else
+    return 0;
+#endif
+}
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
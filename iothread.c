@@ -339,11 +339,28 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+static void query_one_poll_handler(const AioPollStats *stats, int64_t poll_ns,
+                                   void *opaque)
+{
+    IOThreadPollHandlerInfoList ***tail = opaque;
+    IOThreadPollHandlerInfo *info;
+
+    info = g_new0(IOThreadPollHandlerInfo, 1);
+    info->name = g_strdup(stats->name);
+    info->poll_ns = poll_ns;
+    info->poll_hits = stat64_get(&stats->hits);
+    info->poll_misses = stat64_get(&stats->misses);
+    info->poll_wasted_ns = stat64_get(&stats->wasted_ns);
+
+    QAPI_LIST_APPEND(*tail, info);
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***tail = opaque;
     IOThreadInfo *info;
     IOThread *iothread;
+    IOThreadPollHandlerInfoList **poll_tail;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -358,6 +375,12 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_shrink = iothread->poll_shrink;
     info->aio_max_batch = iothread->parent_obj.aio_max_batch;
 
+    poll_tail = &info->poll_handlers;
+    if (iothread->ctx) {
+        aio_context_foreach_poll_stats(iothread->ctx, query_one_poll_handler,
+                                       &poll_tail);
+    }
+
     QAPI_LIST_APPEND(*tail, info);
     return 0;
 }
@@ -217,6 +217,7 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
     IOThreadInfoList *info;
     IOThreadInfo *value;
+    IOThreadPollHandlerInfoList *handler;
 
     for (info = info_list; info; info = info->next) {
         value = info->value;
@@ -227,6 +228,15 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
         monitor_printf(mon, "  aio-max-batch=%" PRId64 "\n",
                        value->aio_max_batch);
+        for (handler = value->poll_handlers; handler;
+             handler = handler->next) {
+            IOThreadPollHandlerInfo *h = handler->value;
+
+            monitor_printf(mon, "  %s: poll-ns=%" PRId64 " hits=%" PRIu64
+                           " misses=%" PRIu64 " wasted-ns=%" PRIu64 "\n",
+                           h->name ?: "(unnamed)", h->poll_ns, h->poll_hits,
+                           h->poll_misses, h->poll_wasted_ns);
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -14,6 +14,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/coroutine.h"
 #include "qemu/sockets.h"
 #include "monitor-internal.h"
 #include "monitor/qdev.h"
@@ -41,6 +42,34 @@ NameInfo *qmp_query_name(Error **errp)
     return info;
 }
 
+static void query_one_coroutine_pool_thread(const CoroutinePoolStats *stats,
+                                            void *opaque)
+{
+    CoroutinePoolThreadInfoList ***tail = opaque;
+    CoroutinePoolThreadInfo *info = g_new0(CoroutinePoolThreadInfo, 1);
+
+    info->thread_id = stats->thread_id;
+    info->hits = stats->hits;
+    info->misses = stats->misses;
+    info->frees = stats->frees;
+    info->pool_size = stats->pool_size;
+    info->peak_demand = stats->peak_demand;
+
+    QAPI_LIST_APPEND(*tail, info);
+}
+
+CoroutinePoolInfo *qmp_query_coroutine_pool(Error **errp)
+{
+    CoroutinePoolInfo *info = g_new0(CoroutinePoolInfo, 1);
+    CoroutinePoolThreadInfoList **tail = &info->threads;
+
+    info->max_size = qemu_coroutine_get_pool_max_size();
+    info->release_pool_size = qemu_coroutine_get_release_pool_size();
+    qemu_coroutine_pool_foreach_thread(query_one_coroutine_pool_thread,
+                                       &tail);
+    return info;
+}
+
 void qmp_quit(Error **errp)
 {
     shutdown_action = SHUTDOWN_ACTION_POWEROFF;
@@ -83,8 +83,31 @@ struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
     bool complete;
+    /*
+     * Non-zero if @data may still be referenced by zero copy writes: the
+     * value of sioc->zero_copy_queued after the reply was sent
+     */
+    ssize_t zero_copy_seq;
+    uint64_t zero_copy_len;
 };
 
+/*
+ * A read buffer whose data was sent with MSG_ZEROCOPY. It must not be freed
+ * before the kernel has completed the zero copy write.
+ */
+typedef struct NBDZeroCopyBuffer {
+    uint8_t *data;
+    uint64_t len;
+    ssize_t seq;
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuffer) next;
+} NBDZeroCopyBuffer;
+
+/*
+ * Maximum number of bytes of read replies that may be pending zero copy
+ * completion per client. Beyond this limit data is copied as usual.
+ */
+#define NBD_ZERO_COPY_MAX_PENDING (64 * MiB)
+
 struct NBDExport {
     BlockExport common;
 
@@ -95,12 +118,20 @@ struct NBDExport {
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 
+    /*
+     * Index into common.iothread_ctxs of the iothread that will serve the
+     * next client connection (only accessed from the main loop thread)
+     */
+    size_t next_iothread_ctx;
+
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
 
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    bool zero_copy;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -128,6 +159,11 @@ struct NBDClient {
     QemuMutex lock;
 
     NBDExport *exp;
+    /*
+     * The AioContext in which requests are processed if the export runs in
+     * multiple iothreads, or NULL to follow the export's AioContext.
+     */
+    AioContext *ctx;
     QCryptoTLSCreds *tlscreds;
     char *tlsauthz;
     QIOChannelSocket *sioc; /* The underlying data channel */
@@ -147,6 +183,14 @@ struct NBDClient {
 
     uint32_t check_align; /* If non-zero, check for aligned client requests */
 
+    /*
+     * True if read data is sent with MSG_ZEROCOPY. The buffers are only
+     * accessed from the client AioContext.
+     */
+    bool zero_copy;
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) zero_copy_bufs;
+    uint64_t zero_copy_pending;
+
     NBDMode mode;
     NBDMetaContexts contexts; /* Negotiated meta contexts */
 
@@ -157,6 +201,12 @@ struct NBDClient {
 
 static void nbd_client_receive_next_request(NBDClient *client);
 
+/* Returns the AioContext in which @client's requests are processed */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    return client->ctx ?: client->exp->common.ctx;
+}
+
 /* Basic flow for negotiation
 
    Server         Client
@@ -1510,6 +1560,31 @@ static int coroutine_fn nbd_receive_request(NBDClient *client, NBDRequest *reque
 
 #define MAX_NBD_REQUESTS 16
 
+/*
+ * Frees the zero copy read buffers for which the kernel has signalled
+ * completion, or all of them if @all is true (when the connection is gone).
+ */
+static void nbd_zero_copy_free_buffers(NBDClient *client, bool all)
+{
+    NBDZeroCopyBuffer *buf;
+
+    if (!all &&
+        qio_channel_socket_poll_zero_copy(client->sioc, NULL) < 0) {
+        /* Keep the buffers, the connection is about to fail anyway */
+        return;
+    }
+
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_bufs)) != NULL) {
+        if (!all && buf->seq > client->sioc->zero_copy_sent) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_bufs, next);
+        client->zero_copy_pending -= buf->len;
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+}
+
 /* Runs in export AioContext and main loop thread */
 void nbd_client_get(NBDClient *client)
 {
@@ -1532,6 +1607,7 @@ void nbd_client_put(NBDClient *client)
             object_unref(OBJECT(client->tlscreds));
         }
         g_free(client->tlsauthz);
+        nbd_zero_copy_free_buffers(client, true);
         if (client->exp) {
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             blk_exp_unref(&client->exp->common);
@@ -1609,11 +1685,25 @@ static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    if (req->data && req->zero_copy_seq) {
+        NBDZeroCopyBuffer *buf = g_new(NBDZeroCopyBuffer, 1);
+
+        *buf = (NBDZeroCopyBuffer) {
+            .data   = req->data,
+            .len    = req->zero_copy_len,
+            .seq    = req->zero_copy_seq,
+        };
+        QSIMPLEQ_INSERT_TAIL(&client->zero_copy_bufs, buf, next);
+        client->zero_copy_pending += buf->len;
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_free(req);
 
+    if (client->zero_copy) {
+        nbd_zero_copy_free_buffers(client, false);
+    }
+
     client->nb_requests--;
 
     if (client->quiescing && client->nb_requests == 0) {
@@ -1683,7 +1773,7 @@ static void nbd_drained_end(void *opaque)
     }
 }
 
-/* Runs in export AioContext */
+/* Runs in the client AioContext */
 static void nbd_wake_read_bh(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1704,12 +1794,12 @@ static bool nbd_drained_poll(void *opaque)
                  * If there's a coroutine waiting for a request on nbd_read_eof()
                  * enter it here so we don't depend on the client to wake it up.
                  *
-                 * Schedule a BH in the export AioContext to avoid missing the
+                 * Schedule a BH in the client AioContext to avoid missing the
                  * wake up due to the race between qio_channel_wake_read() and
                  * qio_channel_yield().
                  */
                 if (client->recv_coroutine != NULL && client->read_yielding) {
-                    aio_bh_schedule_oneshot(nbd_export_aio_context(client->exp),
+                    aio_bh_schedule_oneshot(nbd_client_aio_context(client),
                                             nbd_wake_read_bh, client);
                 }
 
@@ -1887,6 +1977,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1982,6 +2073,7 @@ static void nbd_export_delete(BlockExport *blk_exp)
 const BlockExportDriver blk_exp_nbd = {
     .type               = BLOCK_EXPORT_TYPE_NBD,
     .instance_size      = sizeof(NBDExport),
+    .supports_multi_iothread = true,
     .create             = nbd_export_create,
     .delete             = nbd_export_delete,
     .request_shutdown   = nbd_export_request_shutdown,
@@ -2004,6 +2096,53 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Like nbd_co_send_iov(), but the last element of @iov is read data from the
+ * request buffer, which is sent with MSG_ZEROCOPY if the client supports it.
+ * If it was, *@zero_copy_seq is set to the zero copy write sequence number
+ * that must be reached before the buffer can be freed, and nbd_request_put()
+ * keeps the buffer around until then.
+ */
+static int coroutine_fn nbd_co_send_iov_data(NBDClient *client,
+                                             struct iovec *iov,
+                                             unsigned niov,
+                                             ssize_t *zero_copy_seq,
+                                             Error **errp)
+{
+    ssize_t queued;
+    int ret;
+
+    assert(niov >= 2);
+    if (!client->zero_copy ||
+        client->zero_copy_pending >= NBD_ZERO_COPY_MAX_PENDING) {
+        return nbd_co_send_iov(client, iov, niov, errp);
+    }
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    /* The headers live on the stack and must be copied */
+    ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+    if (ret == 0) {
+        queued = client->sioc->zero_copy_queued;
+        ret = qio_channel_writev_full_all(client->ioc, &iov[niov - 1], 1,
+                                          NULL, 0,
+                                          QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                                          errp);
+
+        /* The socket copies the data if it runs out of locked memory */
+        if (client->sioc->zero_copy_queued != queued) {
+            *zero_copy_seq = client->sioc->zero_copy_queued;
+        }
+    }
+    ret = ret < 0 ? -EIO : 0;
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2017,6 +2156,7 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                                  uint32_t error,
                                                  void *data,
                                                  uint64_t len,
+                                                 ssize_t *zero_copy_seq,
                                                  Error **errp)
 {
     NBDSimpleReply reply;
@@ -2035,6 +2175,9 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
+    if (len) {
+        return nbd_co_send_iov_data(client, iov, 2, zero_copy_seq, errp);
+    }
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
@@ -2100,6 +2243,7 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                                                void *data,
                                                uint64_t size,
                                                bool final,
+                                               ssize_t *zero_copy_seq,
                                                Error **errp)
 {
     NBDReply hdr;
@@ -2116,7 +2260,7 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 3, errp);
+    return nbd_co_send_iov_data(client, iov, 3, zero_copy_seq, errp);
 }
 
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
@@ -2154,6 +2298,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                                                 uint64_t offset,
                                                 uint8_t *data,
                                                 uint64_t size,
+                                                ssize_t *zero_copy_seq,
                                                 Error **errp)
 {
     int ret = 0;
@@ -2203,7 +2348,8 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                 break;
             }
             ret = nbd_co_send_chunk_read(client, request, offset + progress,
-                                         data + progress, pnum, final, errp);
+                                         data + progress, pnum, final,
+                                         zero_copy_seq, errp);
         }
 
         if (ret < 0) {
@@ -2790,15 +2936,17 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
         return nbd_co_send_chunk_done(client, request, errp);
     } else {
         return nbd_co_send_simple_reply(client, request, ret < 0 ? -ret : 0,
-                                        NULL, 0, errp);
+                                        NULL, 0, NULL, errp);
     }
 }
 
 /* Handle NBD_CMD_READ request.
  * Return -errno if sending fails. Other errors are reported directly to the
- * client as an error reply. */
+ * client as an error reply. *@zero_copy_seq is set if @data was sent with
+ * zero copy, see nbd_co_send_iov_data(). */
 static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
-                                        uint8_t *data, Error **errp)
+                                        uint8_t *data, ssize_t *zero_copy_seq,
+                                        Error **errp)
 {
     int ret;
     NBDExport *exp = client->exp;
@@ -2819,7 +2967,8 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         !(request->flags & NBD_CMD_FLAG_DF) && request->len)
     {
         return nbd_co_send_sparse_read(client, request, request->from,
-                                       data, request->len, errp);
+                                       data, request->len, zero_copy_seq,
+                                       errp);
     }
 
     ret = blk_co_pread(exp->common.blk, request->from, request->len, data, 0);
@@ -2831,13 +2980,15 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
     if (client->mode >= NBD_MODE_STRUCTURED) {
         if (request->len) {
             return nbd_co_send_chunk_read(client, request, request->from, data,
-                                          request->len, true, errp);
+                                          request->len, true, zero_copy_seq,
+                                          errp);
         } else {
             return nbd_co_send_chunk_done(client, request, errp);
         }
     } else {
         return nbd_co_send_simple_reply(client, request, 0,
-                                        data, request->len, errp);
+                                        data, request->len, zero_copy_seq,
+                                        errp);
     }
 }
 
@@ -2869,7 +3020,9 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
  * client as an error reply. */
 static coroutine_fn int nbd_handle_request(NBDClient *client,
                                            NBDRequest *request,
-                                           uint8_t *data, Error **errp)
+                                           uint8_t *data,
+                                           ssize_t *zero_copy_seq,
+                                           Error **errp)
 {
     int ret;
     int flags;
@@ -2882,7 +3035,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         return nbd_do_cmd_cache(client, request, errp);
 
     case NBD_CMD_READ:
-        return nbd_do_cmd_read(client, request, data, errp);
+        return nbd_do_cmd_read(client, request, data, zero_copy_seq, errp);
 
     case NBD_CMD_WRITE:
         flags = 0;
@@ -3086,7 +3239,11 @@ static coroutine_fn void nbd_trip(void *opaque)
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
-        ret = nbd_handle_request(client, &request, req->data, &local_err);
+        ret = nbd_handle_request(client, &request, req->data,
+                                 &req->zero_copy_seq, &local_err);
+        if (req->zero_copy_seq) {
+            req->zero_copy_len = request.len;
+        }
     }
     if (request.contexts && request.contexts != &client->contexts) {
         assert(request.type == NBD_CMD_BLOCK_STATUS);
@@ -3147,7 +3304,7 @@ static void nbd_client_receive_next_request(NBDClient *client)
         !client->quiescing) {
         nbd_client_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, client);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client), client->recv_coroutine);
     }
 }
 
@@ -3166,6 +3323,21 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    /* TLS channels copy the data anyway */
+    if (client->exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        client->zero_copy =
+            qio_channel_socket_enable_zero_copy(client->sioc, NULL) == 0;
+    }
+
+    if (client->exp->common.num_iothread_ctxs) {
+        NBDExport *exp = client->exp;
+
+        /* Distribute connections across the export's iothreads */
+        client->ctx = exp->common.iothread_ctxs[exp->next_iothread_ctx];
+        exp->next_iothread_ctx = (exp->next_iothread_ctx + 1) %
+                                 exp->common.num_iothread_ctxs;
+    }
+
     WITH_QEMU_LOCK_GUARD(&client->lock) {
         nbd_client_receive_next_request(client);
     }
@@ -3186,6 +3358,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
 
     client = g_new0(NBDClient, 1);
     qemu_mutex_init(&client->lock);
+    QSIMPLEQ_INIT(&client->zero_copy_bufs);
     client->refcount = 1;
     client->tlscreds = tlscreds;
     if (tlscreds) {
@@ -1664,7 +1664,7 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_COROUTINES 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -2251,6 +2251,7 @@ static int img_convert(int argc, char **argv)
     int64_t ret = -EINVAL;
     bool force_share = false;
     bool explict_min_sparse = false;
+    bool explicit_num_coroutines = false;
     bool bitmaps = false;
     bool skip_broken = false;
     int64_t rate_limit = 0;
@@ -2370,6 +2371,7 @@ static int img_convert(int argc, char **argv)
                              " coroutines is between 1 and %d", MAX_COROUTINES);
                 goto fail_getopt;
             }
+            explicit_num_coroutines = true;
             break;
         case 'W':
             s.wr_in_order = false;
@@ -2779,6 +2781,17 @@ static int img_convert(int argc, char **argv)
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    /*
+     * Compression is CPU bound and the format driver offloads it to the
+     * thread pool, so keep enough requests in flight to occupy all host CPUs
+     * unless a specific number of coroutines was requested.
+     */
+    if (s.compressed && !explicit_num_coroutines) {
+        s.num_coroutines = MIN(MAX(s.num_coroutines,
+                                   2 * (long)g_get_num_processors()),
+                               MAX_COROUTINES);
+    }
+
     if (rate_limit) {
         set_rate_limit(s.target, rate_limit);
     }
@@ -76,6 +76,16 @@ VduseDev *vduse_queue_get_dev(VduseVirtq *vq);
  */
 int vduse_queue_get_fd(VduseVirtq *vq);
 
+/**
+ * vduse_queue_get_index:
+ * @vq: specified virtqueue
+ *
+ * Get the index of the virtqueue in its VDUSE device.
+ *
+ * Returns: the virtqueue index.
+ */
+int vduse_queue_get_index(VduseVirtq *vq);
+
 /**
  * vduse_queue_pop:
  * @vq: specified virtqueue
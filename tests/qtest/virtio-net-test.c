@@ -312,6 +312,29 @@ static void large_tx(void *obj, void *data, QGuestAllocator *t_alloc)
     guest_free(t_alloc, req_addr);
 }
 
+/* Packets sent while the link is down are dropped, but still completed */
+static void tx_link_down(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *dev = obj;
+    QVirtQueue *vq = dev->queues[1];
+    QTestState *qts = global_qtest;
+    uint64_t req_addr;
+    uint32_t free_head;
+    int i;
+
+    qtest_qmp_assert_success(qts, "{ 'execute': 'set_link',"
+                             " 'arguments': { 'name': 'hs0', 'up': false } }");
+
+    req_addr = guest_alloc(t_alloc, 64);
+    for (i = 0; i < 3; i++) {
+        free_head = qvirtqueue_add(qts, vq, req_addr, 64, false, false);
+        qvirtqueue_kick(qts, dev->vdev, vq, free_head);
+        qvirtio_wait_used_elem(qts, dev->vdev, vq, free_head, NULL,
+                               QVIRTIO_NET_TIMEOUT_US);
+    }
+    guest_free(t_alloc, req_addr);
+}
+
 static void *virtio_net_test_setup_nosocket(GString *cmd_line, void *arg)
 {
     g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
@@ -336,6 +359,11 @@ static void register_virtio_net_test(void)
     qos_add_test("large_tx/uint_max", "virtio-net", large_tx, &opts);
     opts.arg = (gpointer)NET_BUFSIZE;
     qos_add_test("large_tx/net_bufsize", "virtio-net", large_tx, &opts);
+
+    opts.arg = NULL;
+    qos_add_test("tx_link_down/default", "virtio-net", tx_link_down, &opts);
+    opts.edge.extra_device_opts = "in_order=on";
+    qos_add_test("tx_link_down/in_order", "virtio-net", tx_link_down, &opts);
 }
 
 libqos_init(register_virtio_net_test);
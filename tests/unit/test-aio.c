@@ -825,6 +825,73 @@ static void test_worker_thread_co_enter(void)
     g_assert(!aio_poll(ctx, false));
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct {
+    CqeHandler cqe_handler;
+    int *done;
+} NopTestData;
+
+static void nop_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
+{
+    io_uring_prep_nop(sqe);
+}
+
+static void nop_cqe_cb(CqeHandler *cqe_handler)
+{
+    NopTestData *data = container_of(cqe_handler, NopTestData, cqe_handler);
+
+    g_assert_cmpint(cqe_handler->cqe.res, ==, 0);
+    (*data->done)++;
+}
+
+static void *add_sqe_many_thread(void *opaque)
+{
+    /* More than both the sq and the cq ring can hold */
+    enum { NUM_REQUESTS = 16384 };
+    g_autofree NopTestData *data = g_new0(NopTestData, NUM_REQUESTS);
+    AioContext *uring_ctx = aio_context_new(&error_abort);
+    bool *skipped = opaque;
+    int done = 0;
+    int i;
+
+    qemu_set_current_aio_context(uring_ctx);
+
+    if (!aio_has_io_uring(uring_ctx)) {
+        *skipped = true;
+        goto out;
+    }
+
+    for (i = 0; i < NUM_REQUESTS; i++) {
+        data[i].cqe_handler.cb = nop_cqe_cb;
+        data[i].done = &done;
+        aio_add_sqe(nop_prep_sqe, NULL, &data[i].cqe_handler);
+    }
+
+    while (done < NUM_REQUESTS) {
+        aio_poll(uring_ctx, true);
+    }
+
+out:
+    aio_context_unref(uring_ctx);
+    return NULL;
+}
+
+static void test_add_sqe_many(void)
+{
+    QemuThread thread;
+    bool skipped = false;
+
+    /* aio_add_sqe() only works from the AioContext's home thread */
+    qemu_thread_create(&thread, "add_sqe_many", add_sqe_many_thread,
+                       &skipped, QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+
+    if (skipped) {
+        g_test_skip("io_uring is not available");
+    }
+}
+#endif
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -850,6 +917,9 @@ int main(int argc, char **argv)
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/aio/io-uring/add-sqe-many",   test_add_sqe_many);
+#endif
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
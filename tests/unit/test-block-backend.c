@@ -24,9 +24,11 @@
 
 #include "qemu/osdep.h"
 #include "block/block.h"
+#include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 
 static void test_drain_aio_error_flush_cb(void *opaque, int ret)
 {
@@ -70,6 +72,206 @@ static void test_drain_all_aio_error(void)
     blk_unref(blk);
 }
 
+/*
+ * A driver that supports the coroutine-free fast path. Fast path requests
+ * complete from a BH, so that they are still in flight when the test submits
+ * the next request.
+ */
+typedef struct BDRVFastTestState {
+    int fast_requests;
+    int fast_in_flight;
+    int co_requests;
+} BDRVFastTestState;
+
+typedef struct FastTestRequest {
+    BDRVFastTestState *s;
+    BlockCompletionFunc *cb;
+    void *opaque;
+} FastTestRequest;
+
+static void fast_test_complete_bh(void *opaque)
+{
+    FastTestRequest *req = opaque;
+
+    req->s->fast_in_flight--;
+    req->cb(req->opaque, 0);
+    g_free(req);
+}
+
+static bool fast_test_aio_prwv_fast(BlockDriverState *bs, int64_t offset,
+                                    int64_t bytes, QEMUIOVector *qiov,
+                                    bool is_write, BlockCompletionFunc *cb,
+                                    void *opaque)
+{
+    BDRVFastTestState *s = bs->opaque;
+    FastTestRequest *req = g_new(FastTestRequest, 1);
+
+    *req = (FastTestRequest) {
+        .s      = s,
+        .cb     = cb,
+        .opaque = opaque,
+    };
+    s->fast_requests++;
+    s->fast_in_flight++;
+    aio_bh_schedule_oneshot(qemu_get_current_aio_context(),
+                            fast_test_complete_bh, req);
+    return true;
+}
+
+static int coroutine_fn fast_test_co_preadv(BlockDriverState *bs,
+                                            int64_t offset, int64_t bytes,
+                                            QEMUIOVector *qiov,
+                                            BdrvRequestFlags flags)
+{
+    BDRVFastTestState *s = bs->opaque;
+
+    s->co_requests++;
+    return 0;
+}
+
+static int coroutine_fn fast_test_co_pwritev(BlockDriverState *bs,
+                                             int64_t offset, int64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             BdrvRequestFlags flags)
+{
+    BDRVFastTestState *s = bs->opaque;
+
+    /* The test only writes while an overlapping fast path read is pending */
+    g_assert_cmpint(s->fast_in_flight, ==, 0);
+    s->co_requests++;
+    return 0;
+}
+
+static int64_t coroutine_fn fast_test_co_getlength(BlockDriverState *bs)
+{
+    return 1 * MiB;
+}
+
+static BlockDriver bdrv_fast_test = {
+    .format_name            = "fast-test",
+    .instance_size          = sizeof(BDRVFastTestState),
+
+    .bdrv_aio_prwv_fast     = fast_test_aio_prwv_fast,
+    .bdrv_co_preadv         = fast_test_co_preadv,
+    .bdrv_co_pwritev        = fast_test_co_pwritev,
+    .bdrv_co_getlength      = fast_test_co_getlength,
+};
+
+static BlockBackend *fast_test_blk_new(BDRVFastTestState **s)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(),
+                                BLK_PERM_ALL, BLK_PERM_ALL);
+    BlockDriverState *bs;
+
+    bs = bdrv_new_open_driver(&bdrv_fast_test, "fast-test", BDRV_O_RDWR,
+                              &error_abort);
+    blk_insert_bs(blk, bs, &error_abort);
+    bdrv_unref(bs);
+
+    *s = bs->opaque;
+    return blk;
+}
+
+static void test_fast_path_done_cb(void *opaque, int ret)
+{
+    bool *completed = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    *completed = true;
+}
+
+static void test_fast_path_drain(void)
+{
+    BDRVFastTestState *s;
+    BlockBackend *blk = fast_test_blk_new(&s);
+    BlockDriverState *bs = blk_bs(blk);
+    uint8_t buf[512];
+    QEMUIOVector qiov;
+    bool completed = false;
+
+    qemu_iovec_init_buf(&qiov, buf, sizeof(buf));
+
+    blk_aio_preadv(blk, 0, &qiov, 0, test_fast_path_done_cb, &completed);
+    g_assert_cmpint(s->fast_requests, ==, 1);
+    g_assert(!completed);
+
+    /* Draining waits for the fast path request */
+    bdrv_drained_begin(bs);
+    g_assert(completed);
+
+    /* Requests submitted while drained take the coroutine path */
+    completed = false;
+    blk_aio_preadv(blk, 0, &qiov, 0, test_fast_path_done_cb, &completed);
+    g_assert_cmpint(s->fast_requests, ==, 1);
+
+    bdrv_drained_end(bs);
+    while (!completed) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(s->fast_requests, ==, 1);
+    g_assert_cmpint(s->co_requests, ==, 1);
+
+    blk_unref(blk);
+}
+
+typedef struct SerialisingWriteData {
+    BlockBackend *blk;
+    bool done;
+} SerialisingWriteData;
+
+static void coroutine_fn test_fast_path_serialising_write(void *opaque)
+{
+    SerialisingWriteData *data = opaque;
+    uint8_t buf[512] = { 0 };
+    int ret;
+
+    ret = blk_co_pwrite(data->blk, 0, sizeof(buf), buf, BDRV_REQ_SERIALISING);
+    g_assert_cmpint(ret, ==, 0);
+    data->done = true;
+}
+
+static void test_fast_path_serialising(void)
+{
+    BDRVFastTestState *s;
+    BlockBackend *blk = fast_test_blk_new(&s);
+    SerialisingWriteData data = { .blk = blk };
+    uint8_t buf[512];
+    QEMUIOVector qiov;
+    bool read_completed = false;
+    bool later_read_completed = false;
+    Coroutine *co;
+
+    qemu_iovec_init_buf(&qiov, buf, sizeof(buf));
+
+    blk_aio_preadv(blk, 0, &qiov, 0, test_fast_path_done_cb, &read_completed);
+    g_assert_cmpint(s->fast_requests, ==, 1);
+
+    /* The serialising write waits for the overlapping fast path read */
+    co = qemu_coroutine_create(test_fast_path_serialising_write, &data);
+    qemu_coroutine_enter(co);
+    g_assert(!data.done);
+    g_assert_cmpint(s->co_requests, ==, 0);
+
+    /* No fast path while a serialising request is in flight */
+    blk_aio_preadv(blk, 64 * KiB, &qiov, 0, test_fast_path_done_cb,
+                   &later_read_completed);
+    g_assert_cmpint(s->fast_requests, ==, 1);
+
+    while (!read_completed || !data.done || !later_read_completed) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(s->co_requests, ==, 2);
+
+    /* Once the serialising request is gone, the fast path is used again */
+    read_completed = false;
+    blk_aio_preadv(blk, 0, &qiov, 0, test_fast_path_done_cb, &read_completed);
+    g_assert_cmpint(s->fast_requests, ==, 2);
+    blk_drain(blk);
+    g_assert(read_completed);
+
+    blk_unref(blk);
+}
+
 int main(int argc, char **argv)
 {
     bdrv_init();
@@ -80,6 +282,9 @@ int main(int argc, char **argv)
     g_test_add_func("/block-backend/drain_aio_error", test_drain_aio_error);
     g_test_add_func("/block-backend/drain_all_aio_error",
                     test_drain_all_aio_error);
+    g_test_add_func("/block-backend/fast_path/drain", test_fast_path_drain);
+    g_test_add_func("/block-backend/fast_path/serialising",
+                    test_fast_path_serialising);
 
     return g_test_run();
 }
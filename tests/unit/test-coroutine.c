@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/coroutine_int.h"
+#include "qemu/thread.h"
 
 /*
  * Check that qemu_in_coroutine() works
@@ -449,6 +450,127 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that the pool statistics account for every coroutine and track the
+ * demand on the pool
+ */
+
+#define POOL_STATS_COROUTINES 200
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void get_current_thread_stats(const CoroutinePoolStats *stats,
+                                     void *opaque)
+{
+    CoroutinePoolStats *out = opaque;
+
+    if (stats->thread_id == qemu_get_thread_id()) {
+        *out = *stats;
+    }
+}
+
+static void test_pool_stats(void)
+{
+    Coroutine *coroutines[POOL_STATS_COROUTINES];
+    CoroutinePoolStats before = {}, after = {};
+    bool done = false;
+    int i;
+
+    /* The thread appears in the statistics once it has used coroutines */
+    qemu_coroutine_enter(qemu_coroutine_create(set_and_exit, &done));
+    g_assert(done);
+    qemu_coroutine_pool_foreach_thread(get_current_thread_stats, &before);
+    g_assert_cmpint(before.thread_id, ==, qemu_get_thread_id());
+
+    for (i = 0; i < POOL_STATS_COROUTINES; i++) {
+        coroutines[i] = qemu_coroutine_create(yield_once, NULL);
+        qemu_coroutine_enter(coroutines[i]);
+    }
+    for (i = 0; i < POOL_STATS_COROUTINES; i++) {
+        qemu_coroutine_enter(coroutines[i]);
+    }
+
+    qemu_coroutine_pool_foreach_thread(get_current_thread_stats, &after);
+    g_assert_cmpuint(after.hits + after.misses - before.hits - before.misses,
+                     ==, POOL_STATS_COROUTINES);
+    /* Each miss happens with an empty pool, so it is part of the demand */
+    g_assert_cmpuint(after.peak_demand, >=, after.misses - before.misses);
+}
+
+/*
+ * Check that coroutines created in one thread and terminated in another do not
+ * make either thread's pool limit grow without bound
+ */
+
+#define POOL_CROSS_THREAD_BATCH 1000
+#define POOL_CROSS_THREAD_ROUNDS 150 /* more than two pool sizing windows */
+
+typedef struct {
+    Coroutine *coroutines[POOL_CROSS_THREAD_BATCH];
+    QemuSemaphore created;
+    QemuSemaphore terminated;
+    CoroutinePoolStats stats;
+} CrossThreadPoolData;
+
+static void *cross_thread_pool_worker(void *opaque)
+{
+    CrossThreadPoolData *data = opaque;
+    int i, round;
+
+    for (round = 0; round < POOL_CROSS_THREAD_ROUNDS; round++) {
+        qemu_sem_wait(&data->created);
+        for (i = 0; i < POOL_CROSS_THREAD_BATCH; i++) {
+            qemu_coroutine_enter(data->coroutines[i]);
+        }
+        qemu_sem_post(&data->terminated);
+    }
+
+    /* The thread's statistics go away when it exits */
+    qemu_coroutine_pool_foreach_thread(get_current_thread_stats, &data->stats);
+    return NULL;
+}
+
+static void test_pool_cross_thread(void)
+{
+    CrossThreadPoolData *data = g_new0(CrossThreadPoolData, 1);
+    CoroutinePoolStats stats = {};
+    QemuThread thread;
+    int i, round;
+
+    qemu_sem_init(&data->created, 0);
+    qemu_sem_init(&data->terminated, 0);
+    qemu_thread_create(&thread, "cross-thread-pool", cross_thread_pool_worker,
+                       data, QEMU_THREAD_JOINABLE);
+
+    for (round = 0; round < POOL_CROSS_THREAD_ROUNDS; round++) {
+        for (i = 0; i < POOL_CROSS_THREAD_BATCH; i++) {
+            data->coroutines[i] = qemu_coroutine_create(yield_once, NULL);
+            qemu_coroutine_enter(data->coroutines[i]);
+        }
+        qemu_sem_post(&data->created);
+        qemu_sem_wait(&data->terminated);
+    }
+    qemu_thread_join(&thread);
+
+    /* The demand of the creating thread is measured per window */
+    qemu_coroutine_pool_foreach_thread(get_current_thread_stats, &stats);
+    g_assert_cmpuint(stats.peak_demand, <,
+                     POOL_CROSS_THREAD_ROUNDS * POOL_CROSS_THREAD_BATCH / 2);
+
+    /* The terminating thread never needed its pool, so it keeps only a few */
+    g_assert_cmpint(data->stats.thread_id, !=, 0);
+    g_assert_cmpuint(data->stats.peak_demand, ==, 0);
+    g_assert_cmpuint(data->stats.pool_size, <=,
+                     qemu_coroutine_get_pool_max_size());
+
+    qemu_sem_destroy(&data->created);
+    qemu_sem_destroy(&data->terminated);
+    g_free(data);
+}
+
 
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
@@ -650,6 +772,8 @@ int main(int argc, char **argv)
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
+    g_test_add_func("/basic/pool-stats", test_pool_stats);
+    g_test_add_func("/basic/pool-cross-thread", test_pool_cross_thread);
     g_test_add_func("/basic/yield", test_yield);
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
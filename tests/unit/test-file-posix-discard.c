@@ -0,0 +1,209 @@
+/*
+ * Discard batching tests for the file block driver
+ *
+ * Copyright (c) 2024 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qapi-types-block-core.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+#include "qemu/units.h"
+
+#define IMG_SIZE (1 * MiB)
+
+typedef struct TestImage {
+    char *path;
+    int fd;
+    BlockBackend *blk;
+} TestImage;
+
+typedef struct DiscardReq {
+    int64_t offset;
+    int64_t bytes;
+} DiscardReq;
+
+typedef struct DiscardData {
+    BlockBackend *blk;
+    const DiscardReq *req;
+    int ret;
+    bool done;
+} DiscardData;
+
+static void test_image_open(TestImage *img)
+{
+    g_autofree uint8_t *buf = g_malloc(IMG_SIZE);
+    QDict *options = qdict_new();
+
+    img->fd = g_file_open_tmp("qemu-tst-discard.XXXXXX", &img->path, NULL);
+    g_assert(img->fd >= 0);
+
+    memset(buf, 0xa5, IMG_SIZE);
+    g_assert_cmpint(pwrite(img->fd, buf, IMG_SIZE, 0), ==, IMG_SIZE);
+
+    qdict_put_str(options, "driver", "file");
+    qdict_put_str(options, BDRV_OPT_DISCARD, "unmap");
+    qdict_put_str(options, "discard-batch-delay", "10000");
+    img->blk = blk_new_open(img->path, NULL, options, BDRV_O_RDWR,
+                            &error_abort);
+}
+
+static void test_image_close(TestImage *img)
+{
+    blk_unref(img->blk);
+    close(img->fd);
+    unlink(img->path);
+    g_free(img->path);
+}
+
+static void coroutine_fn discard_entry(void *opaque)
+{
+    DiscardData *data = opaque;
+
+    data->ret = blk_co_pdiscard(data->blk, data->req->offset,
+                                data->req->bytes);
+    data->done = true;
+}
+
+/*
+ * Issue all requests at once, so that they end up in the same batch, and
+ * wait for them. Returns false if the file system can't discard.
+ */
+static bool discard_batch(TestImage *img, const DiscardReq *reqs, int n)
+{
+    g_autofree DiscardData *data = g_new0(DiscardData, n);
+    BlockStatsSpecific *stats;
+    uint64_t nb_failed;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        data[i].blk = img->blk;
+        data[i].req = &reqs[i];
+        qemu_coroutine_enter(qemu_coroutine_create(discard_entry, &data[i]));
+    }
+
+    for (i = 0; i < n; i++) {
+        while (!data[i].done) {
+            aio_poll(qemu_get_aio_context(), true);
+        }
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+
+    stats = bdrv_get_specific_stats(blk_bs(img->blk));
+    nb_failed = stats->u.file.discard_nb_failed;
+    qapi_free_BlockStatsSpecific(stats);
+
+    return nb_failed == 0;
+}
+
+/* Check that each request is accounted once, with its own length */
+static void check_stats(TestImage *img, const DiscardReq *reqs, int n)
+{
+    BlockStatsSpecific *stats = bdrv_get_specific_stats(blk_bs(img->blk));
+    uint64_t bytes = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        bytes += reqs[i].bytes;
+    }
+
+    g_assert_cmpint(stats->driver, ==, BLOCKDEV_DRIVER_FILE);
+    g_assert_cmpuint(stats->u.file.discard_nb_ok, ==, n);
+    g_assert_cmpuint(stats->u.file.discard_nb_failed, ==, 0);
+    g_assert_cmpuint(stats->u.file.discard_bytes_ok, ==, bytes);
+    qapi_free_BlockStatsSpecific(stats);
+}
+
+/* Check that [0, @end) reads as zeroes and the rest was left alone */
+static void check_content(TestImage *img, int64_t end)
+{
+    g_autofree uint8_t *buf = g_malloc(IMG_SIZE);
+    int64_t i;
+
+    g_assert_cmpint(pread(img->fd, buf, IMG_SIZE, 0), ==, IMG_SIZE);
+    for (i = 0; i < IMG_SIZE; i++) {
+        g_assert_cmpint(buf[i], ==, i < end ? 0 : 0xa5);
+    }
+}
+
+static void run_test(const DiscardReq *reqs, int n, int64_t end,
+                     uint32_t max_pdiscard)
+{
+    TestImage img;
+
+    test_image_open(&img);
+    if (max_pdiscard) {
+        blk_bs(img.blk)->bl.max_pdiscard = max_pdiscard;
+    }
+
+    if (!discard_batch(&img, reqs, n)) {
+        g_test_skip("The file system does not support discard");
+    } else {
+        check_stats(&img, reqs, n);
+        check_content(&img, end);
+    }
+
+    test_image_close(&img);
+}
+
+static void test_adjacent(void)
+{
+    static const DiscardReq reqs[] = {
+        { 64 * KiB, 64 * KiB },
+        { 0, 64 * KiB },
+        { 192 * KiB, 64 * KiB },
+        { 128 * KiB, 64 * KiB },
+    };
+
+    run_test(reqs, ARRAY_SIZE(reqs), 256 * KiB, 0);
+}
+
+static void test_overlapping(void)
+{
+    static const DiscardReq reqs[] = {
+        { 0, 128 * KiB },
+        { 64 * KiB, 128 * KiB },
+        { 128 * KiB, 128 * KiB },
+        { 32 * KiB, 32 * KiB },
+    };
+
+    run_test(reqs, ARRAY_SIZE(reqs), 256 * KiB, 0);
+}
+
+/*
+ * The last request could be merged with both pending ranges, but only with
+ * one of them at a time without exceeding max_pdiscard
+ */
+static void test_max_pdiscard(void)
+{
+    static const DiscardReq reqs[] = {
+        { 0, 128 * KiB },
+        { 192 * KiB, 64 * KiB },
+        { 128 * KiB, 64 * KiB },
+    };
+
+    run_test(reqs, ARRAY_SIZE(reqs), 256 * KiB, 128 * KiB);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/file-posix/discard-batch/adjacent", test_adjacent);
+    g_test_add_func("/file-posix/discard-batch/overlapping",
+                    test_overlapping);
+    g_test_add_func("/file-posix/discard-batch/max-pdiscard",
+                    test_max_pdiscard);
+
+    return g_test_run();
+}
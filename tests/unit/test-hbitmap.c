@@ -398,6 +398,39 @@ static void test_hbitmap_reset_all(TestHBitmapData *data,
     hbitmap_test_reset_all(data);
 }
 
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *other;
+    uint64_t i;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    other = hbitmap_alloc(L3 * 2, 0);
+
+    /* Ranges that are set in one, the other or both bitmaps */
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L3, L2);
+    hbitmap_set(other, L3 + L2 - 1, L1);
+    hbitmap_set(other, L3 * 2 - 1, 1);
+
+    hbitmap_merge(data->hb, other, other);
+
+    hbitmap_test_set(data, L3 + L2 - 1, L1);
+    hbitmap_test_set(data, L3 * 2 - 1, 1);
+    g_assert_cmpint(hbitmap_count(other), ==, hbitmap_count(data->hb));
+    for (i = 0; i < L3 * 2; i++) {
+        g_assert_cmpint(hbitmap_get(other, i), ==, hbitmap_get(data->hb, i));
+    }
+
+    /* Nothing may remain set after clearing all ranges again */
+    hbitmap_reset(other, 0, L3);
+    hbitmap_reset(other, L3, L3);
+    g_assert_true(hbitmap_empty(other));
+    g_assert_cmpint(hbitmap_next_dirty(other, 0, L3 * 2), ==, -1);
+
+    hbitmap_free(other);
+}
+
 static void test_hbitmap_granularity(TestHBitmapData *data,
                                      const void *unused)
 {
@@ -1061,6 +1094,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
@@ -734,6 +734,44 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_reserve(void)
+{
+    ThrottleState ts;
+    ThrottleConfig cfg;
+    uint64_t bytes;
+    double units;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1000000;
+    cfg.buckets[THROTTLE_BPS_READ].avg = 500000;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 2000;
+
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* the smallest limit applies, and only limited buckets are accounted */
+    g_assert(throttle_reserve(&ts, THROTTLE_READ, 10 * SCALE_MS,
+                              &bytes, &units));
+    g_assert_cmpint(bytes, ==, 5000);
+    g_assert(isinf(units));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 5000));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 5000));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+
+    g_assert(throttle_reserve(&ts, THROTTLE_WRITE, 10 * SCALE_MS,
+                              &bytes, &units));
+    g_assert_cmpint(bytes, ==, 10000);
+    g_assert(double_cmp(units, 20));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 15000));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 20));
+
+    /* less than one operation can't be reserved */
+    g_assert(!throttle_reserve(&ts, THROTTLE_WRITE, 100 * SCALE_US,
+                               &bytes, &units));
+    g_assert_cmpint(bytes, ==, 0);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 20));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -829,6 +867,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/reserve",            test_reserve);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
@@ -97,13 +97,14 @@ static bool aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
     return true;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        AioPollFn *io_poll,
-                        IOHandler *io_poll_ready,
-                        void *opaque)
+static void aio_set_fd_handler_internal(AioContext *ctx,
+                                        int fd,
+                                        IOHandler *io_read,
+                                        IOHandler *io_write,
+                                        AioPollFn *io_poll,
+                                        IOHandler *io_poll_ready,
+                                        void *opaque,
+                                        bool edge_triggered)
 {
     AioHandler *node;
     AioHandler *new_node = NULL;
@@ -143,11 +144,14 @@ void aio_set_fd_handler(AioContext *ctx,
         new_node->io_poll = io_poll;
         new_node->io_poll_ready = io_poll_ready;
         new_node->opaque = opaque;
+        new_node->edge_triggered = edge_triggered;
 
         if (is_new) {
             new_node->pfd.fd = fd;
         } else {
             new_node->pfd = node->pfd;
+            new_node->poll_ns = node->poll_ns;
+            new_node->poll_stats = node->poll_stats;
         }
         g_source_add_poll(&ctx->source, &new_node->pfd);
 
@@ -178,6 +182,18 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 }
 
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioPollFn *io_poll,
+                        IOHandler *io_poll_ready,
+                        void *opaque)
+{
+    aio_set_fd_handler_internal(ctx, fd, io_read, io_write, io_poll,
+                                io_poll_ready, opaque, false);
+}
+
 static void aio_set_fd_poll(AioContext *ctx, int fd,
                             IOHandler *io_poll_begin,
                             IOHandler *io_poll_end)
@@ -192,15 +208,48 @@ static void aio_set_fd_poll(AioContext *ctx, int fd,
     node->io_poll_end = io_poll_end;
 }
 
+void aio_set_event_notifier_poll_stats(AioContext *ctx,
+                                       EventNotifier *notifier,
+                                       AioPollStats *stats)
+{
+    AioHandler *node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+
+    if (!node) {
+        return;
+    }
+
+    node->poll_stats = stats;
+}
+
+void aio_context_foreach_poll_stats(AioContext *ctx, AioPollStatsFn *fn,
+                                    void *opaque)
+{
+    AioHandler *node;
+
+    /*
+     * Nodes are not freed while list_lock is incremented, so this is safe even
+     * outside the AioContext's home thread.  poll_ns is read without
+     * synchronization, a slightly stale value is good enough for reporting.
+     */
+    qemu_lockcnt_inc(&ctx->list_lock);
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (node->poll_stats && !QLIST_IS_INSERTED(node, node_deleted)) {
+            fn(node->poll_stats, node->poll_ns, opaque);
+        }
+    }
+    qemu_lockcnt_dec(&ctx->list_lock);
+}
+
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read,
                             AioPollFn *io_poll,
                             EventNotifierHandler *io_poll_ready)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier),
-                       (IOHandler *)io_read, NULL, io_poll,
-                       (IOHandler *)io_poll_ready, notifier);
+    /* Event notifier handlers always clear the counter when they run */
+    aio_set_fd_handler_internal(ctx, event_notifier_get_fd(notifier),
+                                (IOHandler *)io_read, NULL, io_poll,
+                                (IOHandler *)io_poll_ready, notifier, true);
 }
 
 void aio_set_event_notifier_poll(AioContext *ctx,
@@ -317,10 +366,61 @@ static void aio_free_deleted_handlers(AioContext *ctx)
     qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
 }
 
-static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
+/*
+ * Adapt the polling time of @node after it became ready @block_ns nanoseconds
+ * into aio_poll().  Each handler has its own polling time so that idle
+ * handlers sharing the AioContext with busy ones do not keep it high.
+ */
+static void adjust_polling_time(AioContext *ctx, AioHandler *node,
+                                int64_t block_ns)
+{
+    if (block_ns <= node->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        int64_t old = node->poll_ns;
+
+        if (ctx->poll_shrink) {
+            node->poll_ns /= ctx->poll_shrink;
+        } else {
+            node->poll_ns = 0;
+        }
+
+        trace_poll_shrink(ctx, old, node->poll_ns);
+    } else if (node->poll_ns < ctx->poll_max_ns &&
+               block_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t old = node->poll_ns;
+        int64_t grow = ctx->poll_grow;
+
+        if (grow == 0) {
+            grow = 2;
+        }
+
+        if (node->poll_ns) {
+            node->poll_ns *= grow;
+        } else {
+            node->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+
+        if (node->poll_ns > ctx->poll_max_ns) {
+            node->poll_ns = ctx->poll_max_ns;
+        }
+
+        trace_poll_grow(ctx, old, node->poll_ns);
+    }
+}
+
+/*
+ * @block_ns is the time aio_poll() took until handlers became ready, or 0 if
+ * the polling time should not be adjusted.
+ */
+static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node,
+                                 int64_t block_ns)
 {
     bool progress = false;
     bool poll_ready;
+    bool polled;
     int revents;
 
     revents = node->pfd.revents & node->pfd.events;
@@ -328,6 +428,12 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
 
     poll_ready = node->poll_ready;
     node->poll_ready = false;
+    polled = QLIST_IS_INSERTED(node, node_poll);
+
+    /* The event was not caught by polling although the handler was polled */
+    if (block_ns && polled && !poll_ready && revents && node->poll_stats) {
+        stat64_add(&node->poll_stats->misses, 1);
+    }
 
     /*
      * Start polling AioHandlers when they become ready because activity is
@@ -344,6 +450,9 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
         }
         QLIST_INSERT_HEAD(&ctx->poll_aio_handlers, node, node_poll);
     }
+    if (block_ns && QLIST_IS_INSERTED(node, node_poll)) {
+        adjust_polling_time(ctx, node, block_ns);
+    }
     if (!QLIST_IS_INSERTED(node, node_deleted) &&
         poll_ready && revents == 0 && node->io_poll_ready) {
         /*
@@ -391,14 +500,15 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
  * scanning all handlers with aio_dispatch_handlers().
  */
 static bool aio_dispatch_ready_handlers(AioContext *ctx,
-                                        AioHandlerList *ready_list)
+                                        AioHandlerList *ready_list,
+                                        int64_t block_ns)
 {
     bool progress = false;
     AioHandler *node;
 
     while ((node = QLIST_FIRST(ready_list))) {
         QLIST_REMOVE(node, node_ready);
-        progress = aio_dispatch_handler(ctx, node) || progress;
+        progress = aio_dispatch_handler(ctx, node, block_ns) || progress;
     }
 
     return progress;
@@ -411,7 +521,7 @@ static bool aio_dispatch_handlers(AioContext *ctx)
     bool progress = false;
 
     QLIST_FOREACH_SAFE_RCU(node, &ctx->aio_handlers, node, tmp) {
-        progress = aio_dispatch_handler(ctx, node) || progress;
+        progress = aio_dispatch_handler(ctx, node, 0) || progress;
     }
 
     return progress;
@@ -442,6 +552,9 @@ static bool run_poll_handlers_once(AioContext *ctx,
             aio_add_poll_ready_handler(ready_list, node);
 
             node->poll_idle_timeout = now + POLL_IDLE_INTERVAL_NS;
+            if (node->poll_stats) {
+                stat64_add(&node->poll_stats->hits, 1);
+            }
 
             /*
              * Polling was successful, exit try_poll_mode immediately
@@ -524,6 +637,7 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
 {
     bool progress;
     int64_t start_time, elapsed_time;
+    AioHandler *node;
 
     assert(qemu_lockcnt_count(&ctx->list_lock) > 0);
 
@@ -548,6 +662,13 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
         assert(!(max_ns && progress));
     } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
 
+    /* Charge the polling time to the handlers that did not detect an event */
+    QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+        if (node->poll_stats && !node->poll_ready) {
+            stat64_add(&node->poll_stats->wasted_ns, elapsed_time);
+        }
+    }
+
     if (remove_idle_poll_handlers(ctx, ready_list,
                                   start_time + elapsed_time)) {
         *timeout = 0;
@@ -578,13 +699,20 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
 static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
                           int64_t *timeout)
 {
-    int64_t max_ns;
+    AioHandler *node;
+    int64_t max_ns = 0;
 
     if (QLIST_EMPTY_RCU(&ctx->poll_aio_handlers)) {
         return false;
     }
 
-    max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
+    /* Poll for as long as the handler that benefits most from polling */
+    QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+        max_ns = MAX(max_ns, node->poll_ns);
+    }
+    max_ns = MIN(max_ns, ctx->poll_max_ns);
+
+    max_ns = qemu_soonest_timeout(*timeout, max_ns);
     if (max_ns && !ctx->fdmon_ops->need_wait(ctx)) {
         /*
          * Enable poll mode. It pairs with the poll_set_started() in
@@ -606,6 +734,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     bool use_notify_me;
     int64_t timeout;
     int64_t start = 0;
+    int64_t block_ns = 0;
 
     /*
      * There cannot be two concurrent aio_poll calls for the same AioContext (or
@@ -678,49 +807,16 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     aio_notify_accept(ctx);
 
-    /* Adjust polling time */
+    /* Calculate blocked time for adaptive polling */
     if (ctx->poll_max_ns) {
-        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
-
-        if (block_ns <= ctx->poll_ns) {
-            /* This is the sweet spot, no adjustment needed */
-        } else if (block_ns > ctx->poll_max_ns) {
-            /* We'd have to poll for too long, poll less */
-            int64_t old = ctx->poll_ns;
-
-            if (ctx->poll_shrink) {
-                ctx->poll_ns /= ctx->poll_shrink;
-            } else {
-                ctx->poll_ns = 0;
-            }
-
-            trace_poll_shrink(ctx, old, ctx->poll_ns);
-        } else if (ctx->poll_ns < ctx->poll_max_ns &&
-                   block_ns < ctx->poll_max_ns) {
-            /* There is room to grow, poll longer */
-            int64_t old = ctx->poll_ns;
-            int64_t grow = ctx->poll_grow;
-
-            if (grow == 0) {
-                grow = 2;
-            }
-
-            if (ctx->poll_ns) {
-                ctx->poll_ns *= grow;
-            } else {
-                ctx->poll_ns = 4000; /* start polling at 4 microseconds */
-            }
-
-            if (ctx->poll_ns > ctx->poll_max_ns) {
-                ctx->poll_ns = ctx->poll_max_ns;
-            }
-
-            trace_poll_grow(ctx, old, ctx->poll_ns);
-        }
+        block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
     }
 
     progress |= aio_bh_poll(ctx);
-    progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
+    progress |= aio_dispatch_ready_handlers(ctx, &ready_list, block_ns);
+    if (ctx->fdmon_ops->dispatch) {
+        progress |= ctx->fdmon_ops->dispatch(ctx);
+    }
 
     aio_free_deleted_handlers(ctx);
 
@@ -770,7 +866,6 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
      * is used once.
      */
     ctx->poll_max_ns = max_ns;
-    ctx->poll_ns = 0;
     ctx->poll_grow = grow;
     ctx->poll_shrink = shrink;
 
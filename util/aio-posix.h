@@ -37,7 +37,10 @@ struct AioHandler {
     unsigned flags; /* see fdmon-io_uring.c */
 #endif
     int64_t poll_idle_timeout; /* when to stop userspace polling */
+    int64_t poll_ns; /* current adaptive polling time in nanoseconds */
+    AioPollStats *poll_stats; /* optional, owned by the caller */
     bool poll_ready; /* has polling detected an event? */
+    bool edge_triggered; /* io_read() always consumes all pending events */
 };
 
 /* Add a handler to a ready list */
@@ -177,6 +177,19 @@ void aio_set_event_notifier_poll(AioContext *ctx,
     /* Not implemented */
 }
 
+void aio_set_event_notifier_poll_stats(AioContext *ctx,
+                                       EventNotifier *notifier,
+                                       AioPollStats *stats)
+{
+    /* Not implemented */
+}
+
+void aio_context_foreach_poll_stats(AioContext *ctx, AioPollStatsFn *fn,
+                                    void *opaque)
+{
+    /* Not implemented */
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
@@ -19,13 +19,17 @@
  * 4. Nanosecond timeouts are supported so it requires fewer syscalls than
  *    epoll(7).
  *
- * This code only monitors file descriptors and does not do asynchronous disk
- * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * 5. Other requests, like disk I/O, can be submitted on the same ring with
+ *    aio_add_sqe().  Their completions are dispatched directly by aio_poll()
+ *    without waking up the event loop through a separate ring's fd.
  *
  * File descriptor monitoring is implemented using the following operations:
  *
- * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.
+ * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.  Event
+ *    notifiers use multishot polling (IORING_POLL_ADD_MULTI) when the kernel
+ *    supports it, so the request does not have to be re-armed after every
+ *    event.  Other fds must be re-armed because their handlers may leave
+ *    events pending.
  * 2. IORING_OP_POLL_REMOVE - removes a file descriptor being monitored.  When
  *    the poll mask changes for a file descriptor it is first removed and then
  *    re-added with the new poll mask, so this operation is also used as part
@@ -38,9 +42,14 @@
  * the "cq ring".  Ring entries are called "sqe" and "cqe", respectively.
  *
  * The code is structured so that sq/cq rings are only modified within
- * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
- * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
- * and/or IORING_OP_POLL_REMOVE sqes for them.
+ * fdmon_io_uring_wait() and aio_add_sqe(), both of which run in the
+ * AioContext's home thread.  Changes to AioHandlers are made by enqueuing them
+ * on ctx->submit_list so that fdmon_io_uring_wait() can submit
+ * IORING_OP_POLL_ADD and/or IORING_OP_POLL_REMOVE sqes for them.
+ *
+ * The user_data field of cqes is either an AioHandler pointer, a CqeHandler
+ * pointer tagged with FDMON_IO_URING_CQE_HANDLER, or NULL for internal
+ * requests whose completion is not interesting.
  */
 
 #include "qemu/osdep.h"
@@ -49,12 +58,20 @@
 #include "aio-posix.h"
 
 enum {
-    FDMON_IO_URING_ENTRIES  = 128, /* sq/cq ring size */
+    /*
+     * sq ring size, the cq ring is twice as large.  Requests from
+     * aio_add_sqe() share the ring with fd monitoring, so leave room for a
+     * queue depth like that of block/linux-aio.c.
+     */
+    FDMON_IO_URING_ENTRIES  = 1024,
 
     /* AioHandler::flags */
     FDMON_IO_URING_PENDING  = (1 << 0),
     FDMON_IO_URING_ADD      = (1 << 1),
     FDMON_IO_URING_REMOVE   = (1 << 2),
+
+    /* Tag in the low bit of cqe user_data for CqeHandler pointers */
+    FDMON_IO_URING_CQE_HANDLER = 1,
 };
 
 static inline int poll_events_from_pfd(int pfd_events)
@@ -73,28 +90,26 @@ static inline int pfd_events_from_poll(int poll_events)
            (poll_events & POLLERR ? G_IO_ERR : 0);
 }
 
-/*
- * Returns an sqe for submitting a request.  Only be called within
- * fdmon_io_uring_wait().
- */
+static void reap_cq_ring(AioContext *ctx);
+
+/* Returns an sqe for submitting a request */
 static struct io_uring_sqe *get_sqe(AioContext *ctx)
 {
     struct io_uring *ring = &ctx->fdmon_io_uring;
     struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
     int ret;
 
-    if (likely(sqe)) {
-        return sqe;
-    }
-
-    /* No free sqes left, submit pending sqes first */
-    do {
+    while (unlikely(!sqe)) {
+        /* No free sqes left, submit pending sqes first */
         ret = io_uring_submit(ring);
-    } while (ret == -EINTR);
+        if (ret == -EBUSY || ret == -EAGAIN) {
+            reap_cq_ring(ctx);
+        } else {
+            assert(ret >= 0 || ret == -EINTR);
+        }
 
-    assert(ret > 1);
-    sqe = io_uring_get_sqe(ring);
-    assert(sqe);
+        sqe = io_uring_get_sqe(ring);
+    }
     return sqe;
 }
 
@@ -172,9 +187,24 @@ static void add_poll_add_sqe(AioContext *ctx, AioHandler *node)
     int events = poll_events_from_pfd(node->pfd.events);
 
     io_uring_prep_poll_add(sqe, node->pfd.fd, events);
+#ifdef IORING_POLL_ADD_MULTI
+    if (node->edge_triggered && ctx->fdmon_io_uring_multishot) {
+        sqe->len |= IORING_POLL_ADD_MULTI;
+    }
+#endif
     io_uring_sqe_set_data(sqe, node);
 }
 
+/* Will the poll request post more cqes, i.e. is it still armed? */
+static bool cqe_has_more(struct io_uring_cqe *cqe)
+{
+#ifdef IORING_CQE_F_MORE
+    return cqe->flags & IORING_CQE_F_MORE;
+#else
+    return false;
+#endif
+}
+
 static void add_poll_remove_sqe(AioContext *ctx, AioHandler *node)
 {
     struct io_uring_sqe *sqe = get_sqe(ctx);
@@ -221,34 +251,82 @@ static void fill_sq_ring(AioContext *ctx)
     }
 }
 
-/* Returns true if a handler became ready */
+/* Re-arm @node now if @can_submit, otherwise from the next fill_sq_ring() */
+static void rearm_poll_add(AioContext *ctx, AioHandler *node, bool can_submit)
+{
+    if (can_submit) {
+        add_poll_add_sqe(ctx, node);
+    } else {
+        enqueue(&ctx->submit_list, node, FDMON_IO_URING_ADD);
+    }
+}
+
+/*
+ * Returns true if a handler became ready.  @can_submit is false while the sq
+ * ring is full, see reap_cq_ring().
+ */
 static bool process_cqe(AioContext *ctx,
                         AioHandlerList *ready_list,
-                        struct io_uring_cqe *cqe)
+                        struct io_uring_cqe *cqe,
+                        bool can_submit)
 {
-    AioHandler *node = io_uring_cqe_get_data(cqe);
+    uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+    AioHandler *node;
+    bool more;
     unsigned flags;
 
     /* poll_timeout and poll_remove have a zero user_data field */
-    if (!node) {
+    if (!data) {
         return false;
     }
 
+    if (data & FDMON_IO_URING_CQE_HANDLER) {
+        CqeHandler *cqe_handler =
+            (CqeHandler *)(data & ~(uintptr_t)FDMON_IO_URING_CQE_HANDLER);
+
+        /* The callback runs later in fdmon_io_uring_dispatch() */
+        cqe_handler->cqe = *cqe;
+        ctx->cqe_handlers_in_flight--;
+        QSIMPLEQ_INSERT_TAIL(&ctx->cqe_handler_ready_list, cqe_handler, next);
+        return true;
+    }
+
+    node = (AioHandler *)data;
+    more = cqe_has_more(cqe);
+
     /*
-     * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
-     * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
-     * bit before IORING_OP_POLL_REMOVE is submitted.
+     * Deletion can only happen when IORING_OP_POLL_ADD terminates, i.e. when
+     * a one-shot request completes or a multishot request posts its final cqe.
+     * If we race with enqueue() here then we can safely clear the
+     * FDMON_IO_URING_REMOVE bit before IORING_OP_POLL_REMOVE is submitted.
      */
-    flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
-    if (flags & FDMON_IO_URING_REMOVE) {
-        QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node, node_deleted);
+    if (more) {
+        if (qatomic_read(&node->flags) & FDMON_IO_URING_REMOVE) {
+            return false;
+        }
+    } else {
+        flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+        if (flags & FDMON_IO_URING_REMOVE) {
+            QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node,
+                                  node_deleted);
+            return false;
+        }
+    }
+
+    if (cqe->res == -EINVAL && node->edge_triggered &&
+        ctx->fdmon_io_uring_multishot) {
+        /* The kernel does not support multishot poll, fall back to one-shot */
+        ctx->fdmon_io_uring_multishot = false;
+        rearm_poll_add(ctx, node, can_submit);
         return false;
     }
 
     aio_add_ready_handler(ready_list, node, pfd_events_from_poll(cqe->res));
 
-    /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
-    add_poll_add_sqe(ctx, node);
+    /* One-shot and terminated multishot requests must be re-armed */
+    if (!more) {
+        rearm_poll_add(ctx, node, can_submit);
+    }
     return true;
 }
 
@@ -261,7 +339,7 @@ static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list)
     unsigned head;
 
     io_uring_for_each_cqe(ring, head, cqe) {
-        if (process_cqe(ctx, ready_list, cqe)) {
+        if (process_cqe(ctx, ready_list, cqe, true)) {
             num_ready++;
         }
 
@@ -272,12 +350,48 @@ static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list)
     return num_ready;
 }
 
+/*
+ * Make room in the cq ring when the kernel does not accept more sqes because
+ * it could not post their completions.  Waits for a cqe if none is ready yet.
+ * Ready AioHandlers are kept in ctx->fdmon_io_uring_ready_list until the next
+ * fdmon_io_uring_wait(), and the sq ring is still full, so re-arming them is
+ * left to fill_sq_ring().
+ */
+static void reap_cq_ring(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->fdmon_io_uring;
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    do {
+        ret = io_uring_wait_cqe(ring, &cqe);
+    } while (ret == -EINTR);
+
+    assert(ret == 0);
+
+    while (io_uring_peek_cqe(ring, &cqe) == 0) {
+        process_cqe(ctx, &ctx->fdmon_io_uring_ready_list, cqe, false);
+        io_uring_cqe_seen(ring, cqe);
+    }
+}
+
 static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
                                int64_t timeout)
 {
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
+    unsigned num_reaped = 0;
+    AioHandler *node;
     int ret;
 
+    /* Handlers that became ready while get_sqe() was short of sqes */
+    while ((node = QLIST_FIRST(&ctx->fdmon_io_uring_ready_list))) {
+        aio_add_ready_handler(ready_list, node, node->pfd.revents);
+        num_reaped++;
+    }
+    if (num_reaped) {
+        timeout = 0;
+    }
+
     if (timeout == 0) {
         wait_nr = 0; /* non-blocking */
     } else if (timeout > 0) {
@@ -292,13 +406,14 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
 
     assert(ret >= 0);
 
-    return process_cq_ring(ctx, ready_list);
+    return num_reaped + process_cq_ring(ctx, ready_list);
 }
 
 static bool fdmon_io_uring_need_wait(AioContext *ctx)
 {
     /* Have io_uring events completed? */
-    if (io_uring_cq_ready(&ctx->fdmon_io_uring)) {
+    if (io_uring_cq_ready(&ctx->fdmon_io_uring) ||
+        !QLIST_EMPTY(&ctx->fdmon_io_uring_ready_list)) {
         return true;
     }
 
@@ -315,12 +430,52 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
     return false;
 }
 
+/* Invoke CqeHandlers whose requests completed */
+static bool fdmon_io_uring_dispatch(AioContext *ctx)
+{
+    CqeHandler *cqe_handler;
+    bool progress = false;
+
+    /*
+     * Callbacks may run nested aio_poll() calls, which dispatch the remaining
+     * handlers from the same list.
+     */
+    while ((cqe_handler = QSIMPLEQ_FIRST(&ctx->cqe_handler_ready_list))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->cqe_handler_ready_list, next);
+        cqe_handler->cb(cqe_handler);
+        progress = true;
+    }
+
+    return progress;
+}
+
 static const FDMonOps fdmon_io_uring_ops = {
     .update = fdmon_io_uring_update,
     .wait = fdmon_io_uring_wait,
     .need_wait = fdmon_io_uring_need_wait,
+    .dispatch = fdmon_io_uring_dispatch,
 };
 
+bool aio_has_io_uring(AioContext *ctx)
+{
+    return ctx->fdmon_ops == &fdmon_io_uring_ops;
+}
+
+void aio_add_sqe(void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, CqeHandler *cqe_handler)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    struct io_uring_sqe *sqe;
+
+    assert(aio_has_io_uring(ctx));
+
+    sqe = get_sqe(ctx);
+    prep_sqe(sqe, opaque);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)cqe_handler |
+                                        FDMON_IO_URING_CQE_HANDLER));
+    ctx->cqe_handlers_in_flight++;
+}
+
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
     int ret;
@@ -331,15 +486,49 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     }
 
     QSLIST_INIT(&ctx->submit_list);
+    QLIST_INIT(&ctx->fdmon_io_uring_ready_list);
+    QSIMPLEQ_INIT(&ctx->cqe_handler_ready_list);
+    ctx->cqe_handlers_in_flight = 0;
+    ctx->fdmon_io_uring_multishot = true;
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
 
+/*
+ * Complete requests submitted with aio_add_sqe() before the ring goes away.
+ * Their callbacks may submit more requests, e.g. to resubmit short reads.
+ */
+static void fdmon_io_uring_drain_cqe_handlers(AioContext *ctx)
+{
+    AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
+    AioHandler *node;
+
+    while (ctx->cqe_handlers_in_flight ||
+           !QSIMPLEQ_EMPTY(&ctx->cqe_handler_ready_list)) {
+        if (ctx->cqe_handlers_in_flight) {
+            fdmon_io_uring_wait(ctx, &ready_list, -1);
+        }
+        fdmon_io_uring_dispatch(ctx);
+    }
+
+    /*
+     * File descriptors are polled again by the next fd monitoring
+     * implementation, so ready handlers need not be remembered.
+     */
+    while ((node = QLIST_FIRST(&ready_list))) {
+        QLIST_REMOVE(node, node_ready);
+    }
+    while ((node = QLIST_FIRST(&ctx->fdmon_io_uring_ready_list))) {
+        QLIST_REMOVE(node, node_ready);
+    }
+}
+
 void fdmon_io_uring_destroy(AioContext *ctx)
 {
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
         AioHandler *node;
 
+        fdmon_io_uring_drain_cqe_handlers(ctx);
         io_uring_queue_exit(&ctx->fdmon_io_uring);
 
         /* Move handlers due to be removed onto the deleted list */
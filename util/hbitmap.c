@@ -50,8 +50,18 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level, which holds the actual bits and accounts for almost all of
+ * the memory, is split into chunks of HB_CHUNK_WORDS words.  A chunk is only
+ * allocated when a bit in it is set and is freed again when it becomes empty,
+ * so a sparsely populated bitmap needs memory proportional to the number of
+ * set bits rather than to its size.  Whether a chunk is empty can be read
+ * from the 2nd-last level, which is why the upper levels are not chunked.
  */
 
+#define HB_CHUNK_SHIFT  9
+#define HB_CHUNK_WORDS  (UINT64_C(1) << HB_CHUNK_SHIFT)
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -94,13 +104,98 @@ struct HBitmap {
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
      * bitmap will still allocate HBITMAP_LEVELS arrays.
+     *
+     * levels[HBITMAP_LEVELS - 1] is always NULL, the last level is stored
+     * in @chunks instead.  Use hb_word() and hb_word_ptr() to access words
+     * on any level.
      */
     unsigned long *levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /*
+     * The last level, in chunks of HB_CHUNK_WORDS words (the last chunk may
+     * be shorter).  NULL chunks have no bits set.
+     */
+    unsigned long **chunks;
+
+    /* The length of each levels[] array, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+static inline uint64_t hb_nb_chunks(const HBitmap *hb)
+{
+    return DIV_ROUND_UP(hb->sizes[HBITMAP_LEVELS - 1], HB_CHUNK_WORDS);
+}
+
+/* Returns the number of words in chunk @idx */
+static inline uint64_t hb_chunk_words(const HBitmap *hb, uint64_t idx)
+{
+    return MIN(HB_CHUNK_WORDS,
+               hb->sizes[HBITMAP_LEVELS - 1] - (idx << HB_CHUNK_SHIFT));
+}
+
+/* Returns word @pos on @level; words in unallocated chunks are zero.  */
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    const unsigned long *chunk;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return hb->levels[level][pos];
+    }
+
+    chunk = hb->chunks[pos >> HB_CHUNK_SHIFT];
+    return chunk ? chunk[pos & (HB_CHUNK_WORDS - 1)] : 0;
+}
+
+/* Returns a pointer to word @pos on @level.  If the word is in a chunk that
+ * is not allocated yet, the chunk is allocated if @alloc is true; otherwise
+ * NULL is returned.
+ */
+static inline unsigned long *hb_word_ptr(HBitmap *hb, int level, uint64_t pos,
+                                         bool alloc)
+{
+    unsigned long **chunk;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return &hb->levels[level][pos];
+    }
+
+    chunk = &hb->chunks[pos >> HB_CHUNK_SHIFT];
+    if (!*chunk) {
+        if (!alloc) {
+            return NULL;
+        }
+        *chunk = g_new0(unsigned long,
+                        hb_chunk_words(hb, pos >> HB_CHUNK_SHIFT));
+    }
+    return &(*chunk)[pos & (HB_CHUNK_WORDS - 1)];
+}
+
+/* Frees the chunks between @first and @last (inclusive) that have no bits
+ * set.  The 2nd-last level must be up to date.
+ */
+static void hb_free_empty_chunks(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    const int level = HBITMAP_LEVELS - 2;
+    const uint64_t words_per_chunk = HB_CHUNK_WORDS >> BITS_PER_LEVEL;
+    uint64_t i, j, end;
+
+    for (i = first; i <= last; i++) {
+        if (!hb->chunks[i]) {
+            continue;
+        }
+
+        j = i * words_per_chunk;
+        end = MIN(j + words_per_chunk, hb->sizes[level]);
+        while (j < end && !hb->levels[level][j]) {
+            j++;
+        }
+        if (j == end) {
+            g_free(hb->chunks[i]);
+            hb->chunks[i] = NULL;
+        }
+    }
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +231,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +244,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +277,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -219,9 +314,9 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
+    const int last_lev = HBITMAP_LEVELS - 1;
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -236,6 +331,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
     sz = (end_bit + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    cur = hb_word(hb, last_lev, pos);
 
     /* There may be some zero bits in @cur before @start. We are not interested
      * in them, let's set them.
@@ -247,13 +343,13 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        } while (pos < sz && hb_word(hb, last_lev, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, last_lev, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -439,18 +535,22 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(hb_word_ptr(hb, level, i, true),
+                               start, next - 1);
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            elem = hb_word_ptr(hb, level, i, true);
+            changed |= (*elem == 0);
+            *elem = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb_word_ptr(hb, level, i, true), start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -497,6 +597,11 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
     assert(start <= last);
 
+    /* Words in unallocated chunks are already zero */
+    if (!elem) {
+        return false;
+    }
+
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
     blanked = *elem != 0 && ((*elem & ~mask) == 0);
@@ -523,25 +628,30 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(hb_word_ptr(hb, level, i, false), start, next - 1)) {
             changed = true;
         } else {
             pos++;
         }
 
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            elem = hb_word_ptr(hb, level, i, false);
+            if (elem) {
+                changed |= (*elem != 0);
+                *elem = 0UL;
+            }
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(hb_word_ptr(hb, level, i, false), start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -577,18 +687,26 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
 
     hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last)) {
+        hb_free_empty_chunks(hb, first >> (BITS_PER_LEVEL + HB_CHUNK_SHIFT),
+                             last >> (BITS_PER_LEVEL + HB_CHUNK_SHIFT));
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
     }
 }
 
 void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
+    uint64_t j;
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    for (j = 0; j < hb_nb_chunks(hb); j++) {
+        g_free(hb->chunks[j]);
+        hb->chunks[j] = NULL;
+    }
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -621,7 +739,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -638,7 +756,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -652,7 +770,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -660,12 +778,12 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t first;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -674,7 +792,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -683,9 +801,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_word(hb, HBITMAP_LEVELS - 1, cur);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
         cur++;
@@ -697,7 +815,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -706,12 +824,19 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el, *elem;
+
+        memcpy(&el, buf, sizeof(el));
 
         if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+            le32_to_cpus((uint32_t *)&el);
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            le64_to_cpus((uint64_t *)&el);
+        }
+
+        elem = hb_word_ptr(hb, HBITMAP_LEVELS - 1, cur, el != 0);
+        if (elem) {
+            *elem = el;
         }
 
         buf += sizeof(unsigned long);
@@ -726,14 +851,20 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, i;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    for (i = first; i < first + el_count; i++) {
+        unsigned long *elem = hb_word_ptr(hb, HBITMAP_LEVELS - 1, i, false);
+
+        if (elem) {
+            *elem = 0;
+        }
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -743,14 +874,16 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, i;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    for (i = first; i < first + el_count; i++) {
+        *hb_word_ptr(hb, HBITMAP_LEVELS - 1, i, true) = ~0UL;
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -770,7 +903,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -779,12 +912,20 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
     bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+
+    /* Deserializing zeroes may have left empty chunks behind */
+    hb_free_empty_chunks(bitmap, 0, hb_nb_chunks(bitmap) - 1);
 }
 
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+    uint64_t j;
     assert(!hb->meta);
+    for (j = 0; j < hb_nb_chunks(hb); j++) {
+        g_free(hb->chunks[j]);
+    }
+    g_free(hb->chunks);
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
@@ -808,7 +949,11 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i == HBITMAP_LEVELS - 1) {
+            hb->chunks = g_new0(unsigned long *, hb_nb_chunks(hb));
+        } else {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -820,6 +965,35 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     return hb;
 }
 
+/* Resizes the last level from @old_size to the current number of words */
+static void hb_truncate_chunks(HBitmap *hb, uint64_t old_size)
+{
+    uint64_t old_nb_chunks = DIV_ROUND_UP(old_size, HB_CHUNK_WORDS);
+    uint64_t nb_chunks = hb_nb_chunks(hb);
+    uint64_t i, old_len, len;
+
+    /* Any bits beyond the new size have been reset already */
+    for (i = nb_chunks; i < old_nb_chunks; i++) {
+        g_free(hb->chunks[i]);
+    }
+    hb->chunks = g_renew(unsigned long *, hb->chunks, nb_chunks);
+    for (i = old_nb_chunks; i < nb_chunks; i++) {
+        hb->chunks[i] = NULL;
+    }
+
+    /* The last chunk that existed before and after may change its length */
+    i = MIN(old_nb_chunks, nb_chunks) - 1;
+    old_len = MIN(HB_CHUNK_WORDS, old_size - (i << HB_CHUNK_SHIFT));
+    len = hb_chunk_words(hb, i);
+    if (hb->chunks[i] && len != old_len) {
+        hb->chunks[i] = g_renew(unsigned long, hb->chunks[i], len);
+        if (len > old_len) {
+            memset(&hb->chunks[i][old_len], 0x00,
+                   (len - old_len) * sizeof(unsigned long));
+        }
+    }
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -862,6 +1036,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_truncate_chunks(hb, old);
+            continue;
+        }
         hb->levels[i] = g_renew(unsigned long, hb->levels[i], size);
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -929,27 +1107,55 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* This merge is O(size / BITS_PER_LONG) for the upper levels plus
+     * O(allocated words) for the last level, where chunks that are empty in
+     * both bitmaps are skipped.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
+    for (j = 0; j < hb_nb_chunks(result); j++) {
+        const unsigned long *ca = a->chunks[j];
+        const unsigned long *cb = b->chunks[j];
+        uint64_t k, len = hb_chunk_words(result, j);
+        unsigned long *cr;
+
+        if (!ca && !cb) {
+            g_free(result->chunks[j]);
+            result->chunks[j] = NULL;
+            continue;
+        }
+
+        cr = result->chunks[j];
+        if (!cr) {
+            cr = result->chunks[j] = g_new(unsigned long, len);
+        }
+        for (k = 0; k < len; k++) {
+            cr[k] = (ca ? ca[k] : 0) | (cb ? cb[k] : 0);
+        }
+    }
+
     /* Recompute the dirty count */
     result->count = hb_count_between(result, 0, result->size - 1);
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t i, nb_chunks = hb_nb_chunks(bitmap);
+    g_autofree struct iovec *iov = g_new(struct iovec, nb_chunks);
+    g_autofree unsigned long *zeroes = g_new0(unsigned long, HB_CHUNK_WORDS);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+
+    /* Hash the last level as if it was a flat array of words */
+    for (i = 0; i < nb_chunks; i++) {
+        iov[i].iov_base = bitmap->chunks[i] ?: zeroes;
+        iov[i].iov_len = hb_chunk_words(bitmap, i) * sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, nb_chunks, &hash, errp);
 
     return hash;
 }
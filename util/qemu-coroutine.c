@@ -16,6 +16,7 @@
 #include "trace.h"
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/lockable.h"
 #include "qemu/coroutine_int.h"
 #include "qemu/coroutine-tls.h"
 #include "block/aio.h"
@@ -25,10 +26,20 @@
  * reused as soon as there are 64 coroutines in it. The maximum pool size starts
  * with 64 and is increased on demand so that coroutines are not deleted even if
  * they are not immediately reused.
+ *
+ * On top of that, each thread keeps as many coroutines in its alloc_pool as it
+ * recently needed, so that threads with bursts of concurrent requests do not
+ * keep freeing and reallocating coroutine stacks.  The demand is how far the
+ * alloc_pool fell below its size at the start of a window of POOL_PEAK_WINDOW
+ * coroutine creations, plus the coroutines allocated because it was empty.
+ * It only looks at the thread's own pool: coroutines often terminate in a
+ * different thread than the one that created them, so counting creations and
+ * terminations per thread would not balance.
  */
 enum {
     POOL_MIN_BATCH_SIZE = 64,
     POOL_INITIAL_MAX_SIZE = 64,
+    POOL_PEAK_WINDOW = 64 * 1024,
 };
 
 /** Free list to speed up creation */
@@ -36,26 +47,144 @@ static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int pool_max_size = POOL_INITIAL_MAX_SIZE;
 static unsigned int release_pool_size;
 
+/*
+ * Per-thread pool state and statistics.  Only the owning thread modifies it,
+ * other threads may read it while holding pool_threads_lock.  The counters
+ * are word-sized so that they can be read atomically on every host.
+ */
+typedef struct CoroutinePoolThread {
+    int thread_id;
+    unsigned long hits;         /* coroutines reused from the pool */
+    unsigned long misses;       /* coroutines allocated, pool was empty */
+    unsigned long frees;        /* terminated coroutines freed, pool was full */
+    unsigned int pool_size;     /* copy of alloc_pool_size for readers */
+    unsigned int peak_demand;   /* in the current window */
+    unsigned int last_peak_demand; /* in the previous window */
+    unsigned int window_base;   /* alloc_pool_size at the window start */
+    unsigned int window_misses; /* misses in the current window */
+    unsigned int window;        /* creations left in the current window */
+    QLIST_ENTRY(CoroutinePoolThread) next;
+} CoroutinePoolThread;
+
+static QemuMutex pool_threads_lock;
+static QLIST_HEAD(, CoroutinePoolThread) pool_threads =
+    QLIST_HEAD_INITIALIZER(pool_threads);
+
 typedef QSLIST_HEAD(, Coroutine) CoroutineQSList;
 QEMU_DEFINE_STATIC_CO_TLS(CoroutineQSList, alloc_pool);
 QEMU_DEFINE_STATIC_CO_TLS(unsigned int, alloc_pool_size);
+QEMU_DEFINE_STATIC_CO_TLS(CoroutinePoolThread *, pool_thread);
 QEMU_DEFINE_STATIC_CO_TLS(Notifier, coroutine_pool_cleanup_notifier);
 
+static void __attribute__((__constructor__)) coroutine_pool_init(void)
+{
+    qemu_mutex_init(&pool_threads_lock);
+}
+
 static void coroutine_pool_cleanup(Notifier *n, void *value)
 {
     Coroutine *co;
     Coroutine *tmp;
     CoroutineQSList *alloc_pool = get_ptr_alloc_pool();
+    CoroutinePoolThread *pt = get_pool_thread();
 
     QSLIST_FOREACH_SAFE(co, alloc_pool, pool_next, tmp) {
         QSLIST_REMOVE_HEAD(alloc_pool, pool_next);
         qemu_coroutine_delete(co);
     }
+
+    if (pt) {
+        WITH_QEMU_LOCK_GUARD(&pool_threads_lock) {
+            QLIST_REMOVE(pt, next);
+        }
+        g_free(pt);
+        set_pool_thread(NULL);
+    }
+}
+
+/* Slow path; a good place to register the destructor, too.  */
+static CoroutinePoolThread *coroutine_pool_thread_new(void)
+{
+    CoroutinePoolThread *pt = g_new0(CoroutinePoolThread, 1);
+    Notifier *notifier = get_ptr_coroutine_pool_cleanup_notifier();
+
+    pt->thread_id = qemu_get_thread_id();
+    pt->window = POOL_PEAK_WINDOW;
+    WITH_QEMU_LOCK_GUARD(&pool_threads_lock) {
+        QLIST_INSERT_HEAD(&pool_threads, pt, next);
+    }
+    set_pool_thread(pt);
+
+    if (!notifier->notify) {
+        notifier->notify = coroutine_pool_cleanup;
+        qemu_thread_atexit_add(notifier);
+    }
+    return pt;
+}
+
+static inline CoroutinePoolThread *coroutine_pool_thread(void)
+{
+    CoroutinePoolThread *pt = get_pool_thread();
+
+    return likely(pt) ? pt : coroutine_pool_thread_new();
+}
+
+/* How many coroutines this thread's alloc_pool may hold */
+static unsigned int coroutine_pool_thread_max_size(CoroutinePoolThread *pt)
+{
+    unsigned int peak = MAX(pt->peak_demand, pt->last_peak_demand);
+
+    return MAX(qatomic_read(&pool_max_size), peak);
+}
+
+/*
+ * Only the owning thread writes the counters, so this doesn't need an atomic
+ * read-modify-write operation on the hot path.
+ */
+static void coroutine_pool_stat_inc(unsigned long *counter)
+{
+    qatomic_set(counter, qatomic_read(counter) + 1);
+}
+
+static void coroutine_pool_thread_set_size(CoroutinePoolThread *pt,
+                                           unsigned int size)
+{
+    set_alloc_pool_size(size);
+    qatomic_set(&pt->pool_size, size);
+}
+
+/*
+ * Account for a coroutine being created in this thread.  Demand can only grow
+ * here, terminating coroutines just refill the pool.
+ */
+static void coroutine_pool_thread_created(CoroutinePoolThread *pt, bool miss)
+{
+    int64_t demand;
+
+    if (miss) {
+        pt->window_misses++;
+    }
+
+    /* Negative if the alloc_pool was refilled from the release_pool */
+    demand = (int64_t)pt->window_base - get_alloc_pool_size() +
+             pt->window_misses;
+    if (demand > pt->peak_demand) {
+        qatomic_set(&pt->peak_demand, demand);
+    }
+
+    if (--pt->window == 0) {
+        qatomic_set(&pt->last_peak_demand, pt->peak_demand);
+        qatomic_set(&pt->peak_demand, 0);
+        pt->window_base = get_alloc_pool_size();
+        pt->window_misses = 0;
+        pt->window = POOL_PEAK_WINDOW;
+    }
 }
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 {
     Coroutine *co = NULL;
+    CoroutinePoolThread *pt = coroutine_pool_thread();
 
     if (IS_ENABLED(CONFIG_COROUTINE_POOL)) {
         CoroutineQSList *alloc_pool = get_ptr_alloc_pool();
@@ -63,13 +192,6 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         co = QSLIST_FIRST(alloc_pool);
         if (!co) {
             if (release_pool_size > POOL_MIN_BATCH_SIZE) {
-                /* Slow path; a good place to register the destructor, too.  */
-                Notifier *notifier = get_ptr_coroutine_pool_cleanup_notifier();
-                if (!notifier->notify) {
-                    notifier->notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(notifier);
-                }
-
                 /* This is not exact; there could be a little skew between
                  * release_pool_size and the actual size of release_pool.  But
                  * it is just a heuristic, it does not need to be perfect.
@@ -81,12 +203,16 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         }
         if (co) {
             QSLIST_REMOVE_HEAD(alloc_pool, pool_next);
-            set_alloc_pool_size(get_alloc_pool_size() - 1);
+            coroutine_pool_thread_set_size(pt, get_alloc_pool_size() - 1);
+            coroutine_pool_stat_inc(&pt->hits);
         }
     }
 
+    coroutine_pool_thread_created(pt, !co);
+
     if (!co) {
         co = qemu_coroutine_new();
+        coroutine_pool_stat_inc(&pt->misses);
     }
 
     co->entry = entry;
@@ -97,6 +223,8 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 
 static void coroutine_delete(Coroutine *co)
 {
+    CoroutinePoolThread *pt = coroutine_pool_thread();
+
     co->caller = NULL;
 
     if (IS_ENABLED(CONFIG_COROUTINE_POOL)) {
@@ -105,13 +233,14 @@ static void coroutine_delete(Coroutine *co)
             qatomic_inc(&release_pool_size);
             return;
         }
-        if (get_alloc_pool_size() < qatomic_read(&pool_max_size)) {
+        if (get_alloc_pool_size() < coroutine_pool_thread_max_size(pt)) {
             QSLIST_INSERT_HEAD(get_ptr_alloc_pool(), co, pool_next);
-            set_alloc_pool_size(get_alloc_pool_size() + 1);
+            coroutine_pool_thread_set_size(pt, get_alloc_pool_size() + 1);
             return;
         }
     }
 
+    coroutine_pool_stat_inc(&pt->frees);
     qemu_coroutine_delete(co);
 }
 
@@ -230,3 +359,34 @@ void qemu_coroutine_dec_pool_size(unsigned int removing_pool_size)
 {
     qatomic_sub(&pool_max_size, removing_pool_size);
 }
+
+unsigned int qemu_coroutine_get_pool_max_size(void)
+{
+    return qatomic_read(&pool_max_size);
+}
+
+unsigned int qemu_coroutine_get_release_pool_size(void)
+{
+    return qatomic_read(&release_pool_size);
+}
+
+void qemu_coroutine_pool_foreach_thread(CoroutinePoolStatsFn *fn,
+                                        void *opaque)
+{
+    CoroutinePoolThread *pt;
+
+    QEMU_LOCK_GUARD(&pool_threads_lock);
+    QLIST_FOREACH(pt, &pool_threads, next) {
+        CoroutinePoolStats stats = {
+            .thread_id = pt->thread_id,
+            .hits = qatomic_read(&pt->hits),
+            .misses = qatomic_read(&pt->misses),
+            .frees = qatomic_read(&pt->frees),
+            .pool_size = qatomic_read(&pt->pool_size),
+            .peak_demand = MAX(qatomic_read(&pt->peak_demand),
+                               qatomic_read(&pt->last_peak_demand)),
+        };
+
+        fn(&stats, opaque);
+    }
+}
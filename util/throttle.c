@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 #include "qapi/error.h"
 #include "qemu/throttle.h"
 #include "qemu/timer.h"
@@ -504,6 +505,80 @@ void throttle_account(ThrottleState *ts, ThrottleDirection direction,
     }
 }
 
+/* Account in advance the I/O that the limits for @direction allow to be
+ * performed in @ns nanoseconds.  The caller can then perform that amount
+ * of I/O without accounting it again.
+ *
+ * @ts:        the throttling state
+ * @direction: the ThrottleDirection
+ * @ns:        the time slice to reserve
+ * @bytes:     set to the number of bytes reserved (UINT64_MAX if unlimited)
+ * @units:     set to the number of operations reserved (INFINITY if
+ *             unlimited)
+ * @ret:       whether at least one operation could be reserved
+ */
+bool throttle_reserve(ThrottleState *ts, ThrottleDirection direction,
+                      int64_t ns, uint64_t *bytes, double *units)
+{
+    static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+    };
+    static const BucketType bucket_types_units[THROTTLE_MAX][2] = {
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+    };
+    unsigned i;
+
+    assert(direction < THROTTLE_MAX);
+    *bytes = UINT64_MAX;
+    *units = INFINITY;
+
+    for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[direction][i]];
+        if (bkt->avg) {
+            *bytes = MIN(*bytes, muldiv64(bkt->avg, ns,
+                                          NANOSECONDS_PER_SECOND));
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[direction][i]];
+        if (bkt->avg) {
+            *units = MIN(*units,
+                         (double) bkt->avg * ns / NANOSECONDS_PER_SECOND);
+        }
+    }
+
+    if (*bytes == 0 || *units < 1.0) {
+        *bytes = 0;
+        *units = 0;
+        return false;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[direction][i]];
+        if (bkt->avg) {
+            bkt->level += *bytes;
+            if (bkt->burst_length > 1) {
+                bkt->burst_level += *bytes;
+            }
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[direction][i]];
+        if (bkt->avg) {
+            bkt->level += *units;
+            if (bkt->burst_length > 1) {
+                bkt->burst_level += *units;
+            }
+        }
+    }
+
+    return true;
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
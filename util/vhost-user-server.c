@@ -52,6 +52,14 @@
  * possible by QIOChannel's support for spurious coroutine re-entry in
  * qio_channel_yield(). The coroutine will restart I/O when re-entered from the
  * new AioContext.
+ *
+ * With virtqueue AioContexts, each kick fd is monitored in the AioContext of
+ * its virtqueue while vu_client_trip() stays in VuServer->ctx. libvhost-user
+ * is not thread-safe, so kicks and request completions hold the vq_locks entry
+ * of their thread, and a vhost-user message is processed with all vq_locks
+ * held, from the time vu_message_read() has received it until vu_dispatch()
+ * returns. A removed VuFdWatch is freed in the AioContext that monitored it
+ * because kick_handler() may still be running there.
  */
 
 static void vmsg_close_fds(VhostUserMsg *vmsg)
@@ -84,7 +92,13 @@ void vhost_user_server_inc_in_flight(VuServer *server)
 void vhost_user_server_dec_in_flight(VuServer *server)
 {
     if (qatomic_fetch_dec(&server->in_flight) == 1) {
-        if (server->wait_idle) {
+        bool wait_idle;
+
+        /* The last request may complete in another thread than co_trip's */
+        WITH_QEMU_LOCK_GUARD(&server->wait_idle_lock) {
+            wait_idle = server->wait_idle;
+        }
+        if (wait_idle) {
             aio_co_wake(server->co_trip);
         }
     }
@@ -95,6 +109,50 @@ bool vhost_user_server_has_in_flight(VuServer *server)
     return qatomic_load_acquire(&server->in_flight) > 0;
 }
 
+void vhost_user_server_lock_vq(VuServer *server, int vq_index)
+{
+    if (server->num_vq_ctxs) {
+        qemu_rec_mutex_lock(&server->vq_locks[vq_index % server->num_vq_ctxs]);
+    }
+}
+
+void vhost_user_server_unlock_vq(VuServer *server, int vq_index)
+{
+    if (server->num_vq_ctxs) {
+        qemu_rec_mutex_unlock(
+            &server->vq_locks[vq_index % server->num_vq_ctxs]);
+    }
+}
+
+static void vu_lock_all_vqs(VuServer *server)
+{
+    unsigned int i;
+
+    for (i = 0; i < server->num_vq_ctxs; i++) {
+        qemu_rec_mutex_lock(&server->vq_locks[i]);
+    }
+}
+
+static void vu_unlock_all_vqs(VuServer *server)
+{
+    unsigned int i;
+
+    for (i = 0; i < server->num_vq_ctxs; i++) {
+        qemu_rec_mutex_unlock(&server->vq_locks[i]);
+    }
+}
+
+static void vu_detach_watches(VuServer *server);
+
+/* Release the vq_locks taken in vu_message_read() */
+static void vu_message_done(VuServer *server)
+{
+    if (server->vqs_locked) {
+        server->vqs_locked = false;
+        vu_unlock_all_vqs(server);
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -187,6 +245,11 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    /* Keep virtqueue threads out until vu_message_done() */
+    if (!server->vqs_locked) {
+        vu_lock_all_vqs(server);
+        server->vqs_locked = true;
+    }
     return true;
 
 fail:
@@ -201,22 +264,36 @@ static coroutine_fn void vu_client_trip(void *opaque)
     VuDev *vu_dev = &server->vu_dev;
 
     while (!vu_dev->broken) {
+        bool ok;
+
         if (server->quiescing) {
             server->co_trip = NULL;
             aio_wait_kick();
             return;
         }
+        ok = vu_dispatch(vu_dev);
+        vu_message_done(server);
+
         /* vu_dispatch() returns false if server->ctx went away */
-        if (!vu_dispatch(vu_dev) && server->ctx) {
+        if (!ok && server->ctx) {
             break;
         }
     }
 
+    /* No new requests may start while waiting for in-flight ones */
+    vu_lock_all_vqs(server);
+    vu_detach_watches(server);
+    vu_unlock_all_vqs(server);
+
+    qemu_mutex_lock(&server->wait_idle_lock);
     if (vhost_user_server_has_in_flight(server)) {
         /* Wait for requests to complete before we can unmap the memory */
         server->wait_idle = true;
+        qemu_mutex_unlock(&server->wait_idle_lock);
         qemu_coroutine_yield();
         server->wait_idle = false;
+    } else {
+        qemu_mutex_unlock(&server->wait_idle_lock);
     }
     assert(!vhost_user_server_has_in_flight(server));
 
@@ -249,14 +326,63 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    int vq_index = (long)vu_fd_watch->pvt;
 
-    vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    vhost_user_server_lock_vq(server, vq_index);
 
-    /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
-    if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    /* Another thread may have disabled the watch while we were waiting */
+    if (vu_fd_watch->enabled) {
+        vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
 
-        qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
+        if (vu_dev->broken) {
+            qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+    }
+
+    vhost_user_server_unlock_vq(server, vq_index);
+}
+
+/* Returns the AioContext in which @vu_fd_watch is monitored */
+static AioContext *vu_fd_watch_aio_context(VuServer *server,
+                                           VuFdWatch *vu_fd_watch)
+{
+    if (server->num_vq_ctxs) {
+        /* libvhost-user only watches kick fds, pvt is the virtqueue index */
+        long vq_index = (long)vu_fd_watch->pvt;
+
+        return server->vq_ctxs[vq_index % server->num_vq_ctxs];
+    }
+    return server->ctx;
+}
+
+/* Called with all vq_locks held */
+static void vu_attach_watches(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        vu_fd_watch->enabled = true;
+        aio_set_fd_handler(vu_fd_watch_aio_context(server, vu_fd_watch),
+                           vu_fd_watch->fd, kick_handler, NULL, NULL, NULL,
+                           vu_fd_watch);
+    }
+}
+
+/* Called with all vq_locks held */
+static void vu_detach_watches(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (!vu_fd_watch->enabled) {
+            continue;
+        }
+        vu_fd_watch->enabled = false;
+        aio_set_fd_handler(vu_fd_watch_aio_context(server, vu_fd_watch),
+                           vu_fd_watch->fd, NULL, NULL, NULL, NULL,
+                           vu_fd_watch);
     }
 }
 
@@ -291,11 +417,12 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ctx, fd, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        vu_fd_watch->enabled = true;
+        qemu_socket_set_nonblock(fd);
+        aio_set_fd_handler(vu_fd_watch_aio_context(server, vu_fd_watch), fd,
+                           kick_handler, NULL, NULL, NULL, vu_fd_watch);
     }
 }
 
@@ -303,6 +430,7 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 static void remove_watch(VuDev *vu_dev, int fd)
 {
     VuServer *server;
+    AioContext *ctx;
     g_assert(vu_dev);
     g_assert(fd >= 0);
 
@@ -313,10 +441,17 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    ctx = vu_fd_watch_aio_context(server, vu_fd_watch);
+    vu_fd_watch->enabled = false;
+    aio_set_fd_handler(ctx, fd, NULL, NULL, NULL, NULL, NULL);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
-    g_free(vu_fd_watch);
+    if (ctx == qemu_get_current_aio_context()) {
+        g_free(vu_fd_watch);
+    } else {
+        /* kick_handler() may be running in @ctx right now */
+        aio_bh_schedule_oneshot(ctx, g_free, vu_fd_watch);
+    }
 }
 
 
@@ -370,12 +505,9 @@ void vhost_user_server_stop(VuServer *server)
     server->restart_listener_bh = NULL;
 
     if (server->sioc) {
-        VuFdWatch *vu_fd_watch;
-
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
-        }
+        vu_lock_all_vqs(server);
+        vu_detach_watches(server);
+        vu_unlock_all_vqs(server);
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
 
@@ -403,18 +535,15 @@ static void restart_listener_bh(void *opaque)
 /* Called with ctx acquired */
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 {
-    VuFdWatch *vu_fd_watch;
-
     server->ctx = ctx;
 
     if (!server->sioc) {
         return;
     }
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
-                           NULL, NULL, vu_fd_watch);
-    }
+    vu_lock_all_vqs(server);
+    vu_attach_watches(server);
+    vu_unlock_all_vqs(server);
 
     if (server->co_trip) {
         /*
@@ -441,12 +570,9 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 void vhost_user_server_detach_aio_context(VuServer *server)
 {
     if (server->sioc) {
-        VuFdWatch *vu_fd_watch;
-
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
-        }
+        vu_lock_all_vqs(server);
+        vu_detach_watches(server);
+        vu_unlock_all_vqs(server);
     }
 
     server->ctx = NULL;
@@ -462,12 +588,15 @@ void vhost_user_server_detach_aio_context(VuServer *server)
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
+                             AioContext **vq_ctxs,
+                             unsigned int num_vq_ctxs,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp)
 {
     QEMUBH *bh;
     QIONetListener *listener;
+    unsigned int i;
 
     if (socket_addr->type != SOCKET_ADDRESS_TYPE_UNIX &&
         socket_addr->type != SOCKET_ADDRESS_TYPE_FD) {
@@ -491,8 +620,18 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .vq_ctxs               = vq_ctxs,
+        .num_vq_ctxs           = num_vq_ctxs,
     };
 
+    qemu_mutex_init(&server->wait_idle_lock);
+    if (num_vq_ctxs) {
+        server->vq_locks = g_new(QemuRecMutex, num_vq_ctxs);
+        for (i = 0; i < num_vq_ctxs; i++) {
+            qemu_rec_mutex_init(&server->vq_locks[i]);
+        }
+    }
+
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");
 
     qio_net_listener_set_client_func(server->listener,
@@ -503,3 +642,17 @@ bool vhost_user_server_start(VuServer *server,
     QTAILQ_INIT(&server->vu_fd_watches);
     return true;
 }
+
+/* Frees the resources of a stopped server whose client has gone away */
+void vhost_user_server_cleanup(VuServer *server)
+{
+    unsigned int i;
+
+    for (i = 0; i < server->num_vq_ctxs; i++) {
+        qemu_rec_mutex_destroy(&server->vq_locks[i]);
+    }
+    g_free(server->vq_locks);
+    server->vq_locks = NULL;
+    server->num_vq_ctxs = 0;
+    qemu_mutex_destroy(&server->wait_idle_lock);
+}